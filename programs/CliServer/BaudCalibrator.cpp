@@ -0,0 +1,345 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   BaudCalibrator.cpp
+ *
+ *   @brief  Finds the fastest baud rate which a serial link can sustain.
+ *
+ ****************************************************************************/
+
+#include "BaudCalibrator.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+
+#include "Clock.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! Rates which are tried, slowest first.
+constexpr uint32_t RATES[] = {
+    115200, 230400, 460800, 500000, 576000, 921600, 1000000, 1500000, 2000000, 3000000,
+};
+
+bool isValidRate(uint32_t baud) {
+    for (uint32_t rate : RATES) {
+        if (rate == baud) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! @returns the contents of the baud file (device -> rate).
+std::map<std::string, uint32_t> readFile(char const* fileName) {
+    std::map<std::string, uint32_t> rates;
+    FILE* file = fopen(fileName, "r");
+    if (file == nullptr) {
+        return rates;
+    }
+    char device[256];
+    uint32_t baud;
+    while (fscanf(file, "%255s %" SCNu32, device, &baud) == 2) {
+        rates[device] = baud;
+    }
+    fclose(file);
+    return rates;
+}
+
+//! @brief Stores a value little endian.
+template <typename T>
+void put(uint8_t* dst, T val) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        dst[i] = static_cast<uint8_t>(val >> (8 * i));
+    }
+}
+
+//! @returns the byte at index i of test packet seq.
+uint8_t testByte(uint8_t seq, size_t i) {
+    return static_cast<uint8_t>(seq * 31 + i);
+}
+
+}  // namespace
+
+uint32_t BaudCalibrator::load(char const* fileName, char const* device) {
+    if (fileName[0] == '\0') {
+        return DEFAULT_BAUD;
+    }
+    auto rates = readFile(fileName);
+    auto it = rates.find(device);
+    if (it == rates.end() || !isValidRate(it->second)) {
+        return DEFAULT_BAUD;
+    }
+    return it->second;
+}
+
+void BaudCalibrator::setFile(char const* fileName, char const* device, uint32_t baud) {
+    this->m_fileName = fileName;
+    this->m_device = device;
+    this->m_baud = baud;
+}
+
+void BaudCalibrator::startCalibration() {
+    this->m_stableBaud = this->m_baud;
+    this->m_rateIdx = 0;
+    while (this->m_rateIdx < LEN(RATES) && RATES[this->m_rateIdx] <= this->m_baud) {
+        this->m_rateIdx++;
+    }
+    this->m_state = State::NEXT;
+}
+
+bool BaudCalibrator::needsPoll() const {
+    return this->m_state != State::IDLE || this->m_pendingBaud != 0 || this->m_revertAtMs != 0;
+}
+
+bool BaudCalibrator::isReply(Packet const& cmd) {
+    if (cmd.getCommand() != ServerCommand::BAUD || cmd.getLength() < 1) {
+        return false;
+    }
+    uint8_t kind = cmd.getData()[0];
+    return kind == SET_REPLY || kind == TEST_REPLY || kind == CONFIRM_REPLY;
+}
+
+void BaudCalibrator::handleReply(Packet const& cmd) {
+    PacketReader reader(cmd);
+    uint8_t kind = reader.read<uint8_t>();
+    if (kind == CONFIRM_REPLY && this->m_state == State::CONFIRMING) {
+        uint32_t rate = RATES[this->m_rateIdx];
+        uint32_t baud = reader.read<uint32_t>();
+        if (!reader.ok() || baud != rate) {
+            // The other end has already given up on the rate.
+            Log::warning("%" PRIu32 " baud was confirmed at %" PRIu32 " baud", rate, baud);
+            this->switchTo(this->m_stableBaud);
+            Log::info("Calibration finished at %" PRIu32 " baud", this->m_stableBaud);
+            this->m_state = State::IDLE;
+            return;
+        }
+        this->m_stableBaud = rate;
+        this->save();
+        this->m_rateIdx++;
+        this->m_state = State::NEXT;
+        return;
+    }
+    if (kind != TEST_REPLY || this->m_state != State::TESTING) {
+        return;
+    }
+    uint8_t seq = reader.read<uint8_t>();
+    if (reader.remaining() != TEST_PAYLOAD_LEN) {
+        return;
+    }
+    uint8_t const* payload = reader.current();
+    for (size_t i = 0; i < TEST_PAYLOAD_LEN; i++) {
+        if (payload[i] != testByte(seq, i)) {
+            return;
+        }
+    }
+    this->m_testsReceived++;
+}
+
+void BaudCalibrator::poll(uint64_t nowMs) {
+    // Switch only after the SET_REPLY has gone out at the old rate.
+    if (this->m_pendingBaud != 0) {
+        this->m_revertBaud = this->m_baud;
+        if (this->switchTo(this->m_pendingBaud)) {
+            this->m_revertAtMs = nowMs + this->m_pendingConfirmMs;
+        }
+        this->m_pendingBaud = 0;
+    }
+    if (this->m_revertAtMs != 0 && nowMs >= this->m_revertAtMs) {
+        Log::warning("Baud rate %" PRIu32 " wasn't confirmed", this->m_baud);
+        this->m_revertAtMs = 0;
+        this->switchTo(this->m_revertBaud);
+    }
+
+    switch (this->m_state) {
+        case State::IDLE: {
+            break;
+        }
+
+        case State::NEXT: {
+            if (this->m_rateIdx >= LEN(RATES)) {
+                Log::info("Calibration finished at %" PRIu32 " baud", this->m_stableBaud);
+                this->m_state = State::IDLE;
+                break;
+            }
+            uint8_t request[7] = {SET_REQUEST};
+            put(&request[1], RATES[this->m_rateIdx]);
+            put(&request[5], CONFIRM_MS);
+            this->m_outbox->send(ServerCommand::BAUD, request, sizeof(request));
+            this->m_setSentMs = nowMs;
+            this->m_deadlineMs = nowMs + SETTLE_MS;
+            this->m_state = State::SWITCHING;
+            break;
+        }
+
+        case State::SWITCHING: {
+            if (nowMs < this->m_deadlineMs) {
+                break;
+            }
+            if (!this->switchTo(RATES[this->m_rateIdx])) {
+                this->switchTo(this->m_stableBaud);
+                this->m_state = State::IDLE;
+                break;
+            }
+            this->m_testsReceived = 0;
+            this->m_rxErrorsAtStart = this->m_rxErrors;
+            this->m_deadlineMs = nowMs + TEST_WAIT_MS;
+            this->m_state = State::TESTING;
+            uint8_t test[2 + TEST_PAYLOAD_LEN];
+            test[0] = TEST_REQUEST;
+            for (uint32_t seq = 0; seq < TEST_PACKETS; seq++) {
+                test[1] = static_cast<uint8_t>(seq);
+                for (size_t i = 0; i < TEST_PAYLOAD_LEN; i++) {
+                    test[2 + i] = testByte(test[1], i);
+                }
+                this->m_outbox->send(ServerCommand::BAUD, test, sizeof(test));
+            }
+            break;
+        }
+
+        case State::TESTING: {
+            if (this->m_testsReceived < TEST_PACKETS && nowMs < this->m_deadlineMs) {
+                break;
+            }
+            uint32_t rate = RATES[this->m_rateIdx];
+            uint32_t errors = (TEST_PACKETS - this->m_testsReceived) +
+                              (this->m_rxErrors - this->m_rxErrorsAtStart);
+            Log::info(
+                "%" PRIu32 " baud: %" PRIu32 " of %" PRIu32 " test packets failed", rate, errors,
+                TEST_PACKETS);
+            if (errors * 1000 > MAX_ERRORS_PER_MILLE * TEST_PACKETS) {
+                // The other end switches back by itself when no confirm arrives.
+                this->switchTo(this->m_stableBaud);
+                Log::info("Calibration finished at %" PRIu32 " baud", this->m_stableBaud);
+                this->m_state = State::IDLE;
+                break;
+            }
+            // The other end switches back once its confirm time (which
+            // started no earlier than our SET_REQUEST) runs out, so there's
+            // no point waiting for the reply any longer than that.
+            this->m_deadlineMs = this->m_setSentMs + CONFIRM_MS;
+            this->m_state = State::CONFIRMING;
+            this->sendKind(CONFIRM_REQUEST, rate);
+            break;
+        }
+
+        case State::CONFIRMING: {
+            if (nowMs < this->m_deadlineMs) {
+                break;
+            }
+            Log::warning("%" PRIu32 " baud wasn't confirmed by the other end", RATES[this->m_rateIdx]);
+            this->switchTo(this->m_stableBaud);
+            Log::info("Calibration finished at %" PRIu32 " baud", this->m_stableBaud);
+            this->m_state = State::IDLE;
+            break;
+        }
+    }
+}
+
+void BaudCalibrator::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_baud", this->m_baud);
+    metrics->set("cliserver_rx_errors_total", this->m_rxErrors);
+}
+
+bool BaudCalibrator::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::BAUD) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    uint8_t kind = reader.read<uint8_t>();
+    switch (kind) {
+        case SET_REQUEST: {
+            uint32_t baud = reader.read<uint32_t>();
+            uint16_t confirmMs = reader.read<uint16_t>();
+            if (!reader.ok() || !isValidRate(baud) || confirmMs == 0) {
+                break;
+            }
+            this->m_pendingBaud = baud;
+            this->m_pendingConfirmMs = confirmMs;
+            PacketWriter writer(rsp, ServerCommand::BAUD);
+            writer.write<uint8_t>(SET_REPLY);
+            writer.write(baud);
+            return true;
+        }
+
+        case TEST_REQUEST: {
+            PacketWriter writer(rsp, ServerCommand::BAUD);
+            writer.write<uint8_t>(TEST_REPLY);
+            writer.append(reader.current(), reader.remaining());
+            return true;
+        }
+
+        case CONFIRM_REQUEST: {
+            uint32_t baud = reader.read<uint32_t>();
+            if (!reader.ok()) {
+                break;
+            }
+            if (baud == this->m_baud && this->m_revertAtMs != 0) {
+                this->m_revertAtMs = 0;
+                this->save();
+            }
+            PacketWriter writer(rsp, ServerCommand::BAUD);
+            writer.write<uint8_t>(CONFIRM_REPLY);
+            writer.write(this->m_baud);
+            return true;
+        }
+    }
+    PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+    return true;
+}
+
+bool BaudCalibrator::switchTo(uint32_t baud) {
+    if (baud == this->m_baud) {
+        return true;
+    }
+    Log::info("Switching to %" PRIu32 " baud", baud);
+    if (!this->m_switch(baud)) {
+        Log::error("Unable to switch to %" PRIu32 " baud", baud);
+        return false;
+    }
+    this->m_baud = baud;
+    return true;
+}
+
+void BaudCalibrator::sendKind(Kind kind, uint32_t baud) {
+    uint8_t request[5] = {kind};
+    put(&request[1], baud);
+    this->m_outbox->send(ServerCommand::BAUD, request, sizeof(request));
+}
+
+void BaudCalibrator::save() const {
+    if (this->m_fileName.empty()) {
+        return;
+    }
+    auto rates = readFile(this->m_fileName.c_str());
+    rates[this->m_device] = this->m_baud;
+
+    std::string tmpName = this->m_fileName + ".tmp";
+    FILE* file = fopen(tmpName.c_str(), "w");
+    if (file == nullptr) {
+        Log::error("Unable to open baud file '%s': %s", tmpName.c_str(), strerror(errno));
+        return;
+    }
+    for (auto const& [device, baud] : rates) {
+        fprintf(file, "%s %" PRIu32 "\n", device.c_str(), baud);
+    }
+    if (fclose(file) != 0 || rename(tmpName.c_str(), this->m_fileName.c_str()) != 0) {
+        Log::error("Unable to write baud file '%s': %s", this->m_fileName.c_str(), strerror(errno));
+    }
+}
@@ -0,0 +1,189 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   BaudCalibrator.h
+ *
+ *   @brief  Finds the fastest baud rate which a serial link can sustain.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "Bus.h"
+
+class Metrics;
+class Outbox;
+
+//! @brief Negotiates baud rate changes over a serial link.
+//!
+//! @details Both ends of the link implement the BAUD command, so this class
+//!          plays both roles. When asked to switch, it answers at the current
+//!          rate, switches, and then switches back unless the change is
+//!          confirmed within the confirm time. This means that a rate which
+//!          doesn't work can never strand the link.
+//!
+//!          When calibrating, it steps through the standard rates above the
+//!          current rate. At each one it asks the other end to switch, sends
+//!          a burst of TEST_PACKETS test packets, and counts how many come
+//!          back intact. If no more than MAX_ERRORS_PER_MILLE of them are
+//!          lost or corrupted, it asks the other end to keep the rate, and
+//!          only counts the rate as confirmed once the other end's
+//!          CONFIRM_REPLY arrives. If the reply doesn't arrive before the
+//!          other end's confirm time runs out, both ends switch back to the
+//!          last confirmed rate. Calibration stops at the first rate which
+//!          fails. The fastest confirmed rate
+//!          is saved in the baud file and is used when the device is next
+//!          opened.
+//!
+//!          BAUD: uint8_t kind, followed by
+//!              SET_REQUEST:     uint32_t baud, uint16_t confirmMs
+//!              SET_REPLY:       uint32_t baud
+//!              TEST_REQUEST:    arbitrary payload
+//!              TEST_REPLY:      the payload of the request
+//!              CONFIRM_REQUEST: uint32_t baud
+//!              CONFIRM_REPLY:   uint32_t baud
+class BaudCalibrator : public IPacketHandler {
+ public:
+    //! Value of the kind byte of a BAUD packet.
+    enum Kind : uint8_t {
+        SET_REQUEST = 0,      //!< Switch to a new rate.
+        SET_REPLY = 1,        //!< Answer to SET_REQUEST (sent at the old rate).
+        TEST_REQUEST = 2,     //!< Echo this packet back.
+        TEST_REPLY = 3,       //!< Answer to TEST_REQUEST.
+        CONFIRM_REQUEST = 4,  //!< Keep the new rate.
+        CONFIRM_REPLY = 5,    //!< Answer to CONFIRM_REQUEST.
+    };
+
+    //! Called to reopen the serial port at a new rate.
+    using SwitchFn = std::function<bool(uint32_t baud)>;
+
+    //! Rate used for devices which haven't been calibrated.
+    static constexpr uint32_t DEFAULT_BAUD = 115200;
+
+    //! Time the other end waits for a confirm before switching back.
+    static constexpr uint16_t CONFIRM_MS = 2000;
+
+    //! Time allowed for the other end to switch before testing.
+    static constexpr uint32_t SETTLE_MS = 300;
+
+    //! Number of test packets sent at each rate.
+    static constexpr uint32_t TEST_PACKETS = 32;
+
+    //! Number of bytes in each test packet.
+    static constexpr size_t TEST_PAYLOAD_LEN = 200;
+
+    //! Time allowed for all of the test packets to come back.
+    static constexpr uint32_t TEST_WAIT_MS = 1000;
+
+    //! Maximum fraction (in 1/1000ths) of test packets which may be lost.
+    static constexpr uint32_t MAX_ERRORS_PER_MILLE = 10;
+
+    //! @brief Constructor.
+    BaudCalibrator(
+        Outbox* outbox,    //!< [in] Used to send requests to the other end.
+        SwitchFn switchFn  //!< [in] Reopens the serial port at a new rate.
+    )
+        : m_outbox(outbox), m_switch(switchFn) {}
+
+    //! @returns the rate saved for a device, or DEFAULT_BAUD.
+    static uint32_t load(
+        char const* fileName,  //!< [in] Baud file (may be empty).
+        char const* device     //!< [in] Name of the serial device.
+    );
+
+    //! @brief Sets where calibrated rates are saved.
+    void setFile(
+        char const* fileName,  //!< [in] Baud file (may be empty).
+        char const* device,    //!< [in] Name of the serial device.
+        uint32_t baud          //!< [in] Rate the device was opened at.
+    );
+
+    //! @returns the rate the serial port is currently using.
+    uint32_t baud() const { return this->m_baud; }
+
+    //! @brief Starts calibrating the link.
+    void startCalibration();
+
+    //! @returns true if poll needs to be called.
+    bool needsPoll() const;
+
+    //! @returns true if cmd is the answer to one of our requests.
+    //! @details These are consumed by the main loop (by calling handleReply)
+    //!          rather than being dispatched, since they mustn't be answered.
+    static bool isReply(
+        Packet const& cmd  //!< [in] Packet which was received.
+    );
+
+    //! @brief Processes the answer to one of our requests.
+    void handleReply(
+        Packet const& cmd  //!< [in] Packet for which isReply returned true.
+    );
+
+    //! @brief Records a packet which failed to parse (i.e. a bad CRC).
+    void noteRxError() { this->m_rxErrors++; }
+
+    //! @brief Performs pending switches and advances the calibration.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Publishes the rate and error counts.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+    //! @brief Handles the BAUD command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! Progress of a calibration.
+    enum class State : uint8_t {
+        IDLE,       //!< Not calibrating.
+        NEXT,       //!< Ready to try the next rate.
+        SWITCHING,  //!< Waiting for the other end to switch.
+        TESTING,    //!< Waiting for the test packets to come back.
+        CONFIRMING, //!< Waiting for the other end to confirm the rate.
+    };
+
+    bool switchTo(uint32_t baud);
+    void sendKind(Kind kind, uint32_t baud);
+    void save() const;
+
+    Outbox* m_outbox;                   //!< Used to send requests.
+    SwitchFn m_switch;                  //!< Reopens the serial port.
+    std::string m_fileName;             //!< Where calibrated rates are saved.
+    std::string m_device;               //!< Name of the serial device.
+    uint32_t m_baud = DEFAULT_BAUD;     //!< Current rate.
+
+    // Answering requests from the other end.
+    uint32_t m_pendingBaud = 0;         //!< Rate to switch to once the reply is sent.
+    uint16_t m_pendingConfirmMs = 0;    //!< Confirm time for m_pendingBaud.
+    uint32_t m_revertBaud = 0;          //!< Rate to return to if not confirmed.
+    uint64_t m_revertAtMs = 0;          //!< When to return to m_revertBaud.
+
+    // Calibrating.
+    State m_state = State::IDLE;        //!< Progress of the calibration.
+    size_t m_rateIdx = 0;               //!< Index of the rate being tried.
+    uint32_t m_stableBaud = 0;          //!< Fastest rate confirmed so far.
+    uint64_t m_deadlineMs = 0;          //!< When the current state times out.
+    uint64_t m_setSentMs = 0;           //!< When SET_REQUEST was sent for the rate being tried.
+    uint32_t m_testsReceived = 0;       //!< Intact test packets received.
+    uint32_t m_rxErrors = 0;            //!< Packets which failed to parse.
+    uint32_t m_rxErrorsAtStart = 0;     //!< m_rxErrors when testing started.
+};
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
@@ -32,13 +33,42 @@
 #include <sys/unistd.h>
 #include <termios.h>
 
+#include <string>
+#include <vector>
+
+#include "BaudCalibrator.h"
 #include "Bus.h"
+#include "Clock.h"
+#include "ControlLoop.h"
 #include "CorePacketHandler.h"
+#include "DeltaDumpHandler.h"
 #include "DumpMem.h"
+#include "Federation.h"
+#include "FirmwareUploadHandler.h"
+#include "FlowControl.h"
+#include "Handshake.h"
+#include "HealthMonitor.h"
+#include "LeaseManager.h"
 #include "LinuxColorLog.h"
 #include "LinuxSerialBus.h"
+#include "LoadGenerator.h"
 #include "Log.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketQueue.h"
+#include "PacketData.h"
+#include "PcapngWriter.h"
+#include "RegisterMirror.h"
+#include "RequestQueue.h"
+#include "ResponseTracker.h"
+#include "RxTimestamp.h"
+#include "ServerCommand.h"
+#include "ServerTiming.h"
 #include "SocketBus.h"
+#include "Telemetry.h"
+#include "TelemetryHistory.h"
+#include "Tracer.h"
+#include "Triggers.h"
 
 enum {
     // Options assigned a single character code can use that charater code
@@ -53,6 +83,34 @@ enum {
     // Options from this point onwards don't have any short option equivalents
 
     OPT_FIRST_LONG_OPT = 0x80,
+
+    OPT_FIRMWARE,
+    OPT_LEASE_DEVICE,
+    OPT_LEASE_GROUP,
+    OPT_PCAP,
+    OPT_PEER,
+    OPT_QUEUE,
+    OPT_ADVERTISE,
+    OPT_REGISTRY,
+    OPT_REGISTRY_SERVE,
+    OPT_PROBE_INTERVAL,
+    OPT_METRICS,
+    OPT_SLO_TARGET,
+    OPT_LOW_PRIORITY,
+    OPT_MIRROR_DEVICE,
+    OPT_MIRROR_SIZE,
+    OPT_MIRROR_FLUSH,
+    OPT_BAUD_FILE,
+    OPT_CALIBRATE_BAUD,
+    OPT_FLOW_CONTROL,
+    OPT_BENCH,
+    OPT_TELEMETRY,
+    OPT_HISTORY,
+    OPT_TRIGGER,
+    OPT_CONTROL,
+    OPT_CONTROL_FIFO,
+    OPT_TRACE,
+    OPT_TRACE_SAMPLE,
 };
 
 static const char* g_pgm_name;
@@ -61,23 +119,70 @@ struct option g_long_option[] = {
     // clang-format off
     // option       has_arg              flasg      val
     // -----------  ------------------- ----------- ------------
+    {"advertise",   required_argument,  nullptr,    OPT_ADVERTISE},
+    {"baud-file",   required_argument,  nullptr,    OPT_BAUD_FILE},
+    {"bench",       required_argument,  nullptr,    OPT_BENCH},
+    {"calibrate-baud", no_argument,     nullptr,    OPT_CALIBRATE_BAUD},
+    {"control",     required_argument,  nullptr,    OPT_CONTROL},
+    {"control-fifo", required_argument, nullptr,    OPT_CONTROL_FIFO},
     {"debug",       no_argument,        nullptr,    OPT_DEBUG},
+    {"firmware",    required_argument,  nullptr,    OPT_FIRMWARE},
+    {"flow-control", required_argument, nullptr,    OPT_FLOW_CONTROL},
     {"help",        no_argument,        nullptr,    OPT_HELP},
+    {"history",     required_argument,  nullptr,    OPT_HISTORY},
+    {"lease-device", required_argument, nullptr,    OPT_LEASE_DEVICE},
+    {"lease-group", required_argument,  nullptr,    OPT_LEASE_GROUP},
+    {"low-priority", required_argument, nullptr,    OPT_LOW_PRIORITY},
+    {"pcap",        required_argument,  nullptr,    OPT_PCAP},
+    {"peer",        required_argument,  nullptr,    OPT_PEER},
+    {"metrics",     required_argument,  nullptr,    OPT_METRICS},
+    {"mirror-device", required_argument, nullptr,   OPT_MIRROR_DEVICE},
+    {"mirror-flush", required_argument, nullptr,    OPT_MIRROR_FLUSH},
+    {"mirror-size", required_argument,  nullptr,    OPT_MIRROR_SIZE},
     {"port",        required_argument,  nullptr,    OPT_PORT},
+    {"probe-interval", required_argument, nullptr,  OPT_PROBE_INTERVAL},
+    {"queue",       required_argument,  nullptr,    OPT_QUEUE},
+    {"registry",    required_argument,  nullptr,    OPT_REGISTRY},
+    {"registry-serve", required_argument, nullptr,  OPT_REGISTRY_SERVE},
     {"serial",      required_argument,  nullptr,    OPT_SERIAL},
+    {"slo-target",  required_argument,  nullptr,    OPT_SLO_TARGET},
+    {"telemetry",   required_argument,  nullptr,    OPT_TELEMETRY},
+    {"trace",       required_argument,  nullptr,    OPT_TRACE},
+    {"trace-sample", required_argument, nullptr,    OPT_TRACE_SAMPLE},
+    {"trigger",     required_argument,  nullptr,    OPT_TRIGGER},
     {"verbose",     no_argument,        nullptr,    OPT_VERBOSE},
     {},
     // clang-format on
 };
 
+//! @brief How often (in milliseconds) periodic work is done by the main loop.
+static constexpr int TICK_MS = 100;
+
+//! @brief How often (in milliseconds) the metrics file is rewritten.
+static constexpr uint64_t METRICS_INTERVAL_MS = 1000;
+
+//! @brief How often (in milliseconds) to try reopening a serial port which went away.
+static constexpr uint64_t REOPEN_INTERVAL_MS = 500;
+
+//! @brief A partial packet is dropped if no more of it arrives within this many milliseconds.
+static constexpr uint64_t INTER_BYTE_TIMEOUT_MS = 100;
+
 //! @brief  Verbose flag, set when -v is passed on the command line.
 int g_verbose = 0;
 
 //! @brief Debug flag, set when -d is passed on the command line.
 int g_debug = 0;
 
+//! @brief Set when SIGINT or SIGTERM is received, to end the main loop.
+static volatile sig_atomic_t g_quit = 0;
+
 static void usage(void);
 
+//! @brief Handles SIGINT and SIGTERM.
+static void quitHandler(int /* sig */) {
+    g_quit = 1;
+}
+
 //! @brief Main program.
 //! @returns 0 if everything was successful
 //! @returns non-zero if an error occurs.
@@ -89,6 +194,32 @@ int main(
 
     char const* portStr = SocketBus::DEFAULT_PORT_STR;
     char const* serialPortStr = "";
+    char const* pcapFileStr = "";
+    char const* firmwareFileStr = "";
+    char const* queueFileStr = "";
+    char const* registryStr = "";
+    char const* registryServeStr = "";
+    char const* advertiseStr = "";
+    std::vector<char const*> peerStrs;
+    char const* metricsFileStr = "";
+    char const* baudFileStr = "";
+    char const* benchStr = "";
+    char const* telemetryStr = "";
+    uint32_t historyMs = 0;
+    std::vector<char const*> triggerStrs;
+    char const* controlStr = "";
+    int controlFifoPriority = 0;
+    bool calibrateBaud = false;
+    FlowControl flowControl;
+    uint32_t probeIntervalMs = 0;
+    uint32_t sloTargetMs = 0;
+    size_t mirrorSize = 0;
+    char const* mirrorFlushStr = "immediate";
+    char const* mirrorDeviceStr = "";
+    RequestQueue requestQueue;
+    char const* traceFileStr = "";
+    double traceSampleRate = 1.0;
+    LeaseManager leaseManager;
 
     // Figure out which directory our executable came from
 
@@ -121,21 +252,165 @@ int main(
 
     while ((opt = getopt_long(argc, argv, "dhv", g_long_option, NULL)) > 0) {
         switch (opt) {
+            case OPT_ADVERTISE: {
+                advertiseStr = optarg;
+                break;
+            }
+
+            case OPT_BAUD_FILE: {
+                baudFileStr = optarg;
+                break;
+            }
+
+            case OPT_BENCH: {
+                benchStr = optarg;
+                break;
+            }
+
+            case OPT_CALIBRATE_BAUD: {
+                calibrateBaud = true;
+                break;
+            }
+
+            case OPT_CONTROL: {
+                controlStr = optarg;
+                break;
+            }
+
+            case OPT_CONTROL_FIFO: {
+                controlFifoPriority = atoi(optarg);
+                break;
+            }
+
             case OPT_DEBUG: {
                 g_debug = true;
                 break;
             }
 
+            case OPT_FIRMWARE: {
+                firmwareFileStr = optarg;
+                break;
+            }
+
+            case OPT_FLOW_CONTROL: {
+                if (!flowControl.setMode(optarg)) {
+                    Log::error("Invalid flow control: '%s'", optarg);
+                    return 1;
+                }
+                break;
+            }
+
+            case OPT_HISTORY: {
+                historyMs = strtoul(optarg, nullptr, 0);
+                break;
+            }
+
+            case OPT_LEASE_DEVICE: {
+                if (!leaseManager.addDevice(optarg)) {
+                    Log::error("Too many lease devices: '%s'", optarg);
+                    return 1;
+                }
+                break;
+            }
+
+            case OPT_LEASE_GROUP: {
+                if (!leaseManager.addGroup(optarg)) {
+                    Log::error("Invalid lease group: '%s'", optarg);
+                    return 1;
+                }
+                break;
+            }
+
+            case OPT_LOW_PRIORITY: {
+                requestQueue.setLowPriority(static_cast<uint8_t>(strtoul(optarg, nullptr, 0)));
+                break;
+            }
+
+            case OPT_METRICS: {
+                metricsFileStr = optarg;
+                break;
+            }
+
+            case OPT_MIRROR_DEVICE: {
+                mirrorDeviceStr = optarg;
+                break;
+            }
+
+            case OPT_MIRROR_FLUSH: {
+                mirrorFlushStr = optarg;
+                break;
+            }
+
+            case OPT_MIRROR_SIZE: {
+                mirrorSize = strtoul(optarg, nullptr, 0);
+                break;
+            }
+
+            case OPT_PCAP: {
+                pcapFileStr = optarg;
+                break;
+            }
+
+            case OPT_PEER: {
+                peerStrs.push_back(optarg);
+                break;
+            }
+
             case OPT_PORT: {
                 portStr = optarg;
                 break;
             }
 
+            case OPT_PROBE_INTERVAL: {
+                probeIntervalMs = strtoul(optarg, nullptr, 0);
+                break;
+            }
+
+            case OPT_QUEUE: {
+                queueFileStr = optarg;
+                break;
+            }
+
+            case OPT_REGISTRY: {
+                registryStr = optarg;
+                break;
+            }
+
+            case OPT_REGISTRY_SERVE: {
+                registryServeStr = optarg;
+                break;
+            }
+
             case OPT_SERIAL: {
                 serialPortStr = optarg;
                 break;
             }
 
+            case OPT_SLO_TARGET: {
+                sloTargetMs = strtoul(optarg, nullptr, 0);
+                break;
+            }
+
+            case OPT_TELEMETRY: {
+                telemetryStr = optarg;
+                break;
+            }
+
+            case OPT_TRACE: {
+                traceFileStr = optarg;
+                break;
+            }
+
+            case OPT_TRACE_SAMPLE: {
+                traceSampleRate = strtod(optarg, nullptr);
+                break;
+            }
+
+            case OPT_TRIGGER: {
+                triggerStrs.push_back(optarg);
+                break;
+            }
+
             case OPT_VERBOSE: {
                 g_verbose = true;
                 break;
@@ -153,8 +428,8 @@ int main(
         Log::debug("portStr = %s", portStr);
     }
 
-    uint8_t cmdPacketData[256];
-    uint8_t rspPacketData[256];
+    uint8_t cmdPacketData[MAX_PACKET_DATA_LEN];
+    uint8_t rspPacketData[MAX_PACKET_DATA_LEN];
     Packet cmdPacket(LEN(cmdPacketData), cmdPacketData);
     Packet rspPacket(LEN(rspPacketData), rspPacketData);
     SocketBus socketBus(&cmdPacket, &rspPacket);
@@ -164,66 +439,513 @@ int main(
     serialBus.setDebug(true);
 
     CorePacketHandler corePacketHandler;
+    DeltaDumpHandler deltaDumpHandler;
+    FirmwareUploadHandler firmwareUploadHandler;
+    Handshake handshake(LEN(cmdPacketData), RequestQueue::MAX_QUEUED);
     int fd = -1;
+    RxTimestamp rxTimestamp;
+
+    if (firmwareFileStr[0] != '\0') {
+        firmwareUploadHandler.setFileName(firmwareFileStr);
+    }
+
+    PcapngWriter capture;
+    uint32_t captureInterface = 0;
+    if (pcapFileStr[0] != '\0') {
+        if (!capture.open(pcapFileStr)) {
+            exit(1);
+        }
+        captureInterface = capture.addInterface(serialPortStr[0] == '\0' ? "socket" : serialPortStr);
+    }
+
+    Tracer tracer;
+    if (traceFileStr[0] != '\0') {
+        if (!tracer.open(traceFileStr, traceSampleRate)) {
+            exit(1);
+        }
+    }
 
     IBus* bus = nullptr;
     if (serialPortStr[0] == '\0') {
+        socketBus.add(handshake);
         socketBus.add(corePacketHandler);
+        socketBus.add(deltaDumpHandler);
+        socketBus.add(firmwareUploadHandler);
+        socketBus.add(leaseManager);
         if (socketBus.setupServer(portStr) != IBus::Error::NONE) {
             exit(1);
         }
         fd = socketBus.socket();
+        rxTimestamp.attach(fd);
         bus = &socketBus;
     } else {
+        serialBus.add(handshake);
         serialBus.add(corePacketHandler);
+        serialBus.add(deltaDumpHandler);
+        serialBus.add(firmwareUploadHandler);
+        serialBus.add(leaseManager);
         printf("Opening serial port\n");
-        if (serialBus.open(serialPortStr, 115200) != IBus::Error::NONE) {
+        if (serialBus.open(serialPortStr, BaudCalibrator::load(baudFileStr, serialPortStr)) !=
+            IBus::Error::NONE) {
             exit(1);
         }
         printf("Serial port opened\n");
         fd = serialBus.serial();
+        rxTimestamp.attach(fd);
+        if (!flowControl.apply(fd)) {
+            exit(1);
+        }
         bus = &serialBus;
     }
 
-    while (true) {
-        struct pollfd pfd = {
-            .fd = fd,
-            .events = POLLIN,
-            .revents = 0,
-        };
-        if (poll(&pfd, 1, -1) < 0) {
+    // Packets originated by the server are held in the queue while the
+    // serial device is offline.
+    PacketQueue queue;
+    if (queueFileStr[0] != '\0') {
+        if (!queue.open(queueFileStr)) {
+            exit(1);
+        }
+    }
+    Outbox outbox(bus, &queue);
+    outbox.setCapture(&capture, captureInterface);
+    outbox.setFlowControl(&flowControl);
+
+    // Clients which ask for it are told how long each request took.
+    handshake.offer(Feature::SERVER_TIMING);
+    ServerTiming serverTiming(&outbox, handshake);
+
+    Federation federation(leaseManager, &outbox);
+    if (registryServeStr[0] != '\0') {
+        if (!federation.serve(registryServeStr)) {
+            exit(1);
+        }
+    }
+    if (registryStr[0] != '\0') {
+        std::string endpoint = advertiseStr;
+        if (endpoint.empty()) {
+            char hostName[256];
+            gethostname(hostName, sizeof(hostName));
+            hostName[sizeof(hostName) - 1] = '\0';
+            endpoint = std::string(hostName) + ":" + portStr;
+        }
+        if (!federation.join(registryStr, endpoint.c_str())) {
+            exit(1);
+        }
+    }
+    for (auto peerStr : peerStrs) {
+        if (!federation.addPeer(peerStr)) {
+            Log::error("Invalid peer: '%s'", peerStr);
+            exit(1);
+        }
+    }
+    if (federation.isActive()) {
+        bus->add(federation);
+    }
+
+    HealthMonitor health(&outbox);
+    health.setIdleInterval(probeIntervalMs);
+    bus->add(health);
+
+    Telemetry telemetry;
+    if (telemetryStr[0] != '\0' && !telemetry.serve(telemetryStr)) {
+        exit(1);
+    }
+    // Triggers go first, since they're the most latency sensitive.
+    Triggers triggers(&outbox);
+    for (auto triggerStr : triggerStrs) {
+        if (triggers.add(triggerStr) < 0) {
+            Log::error("Invalid trigger: '%s'", triggerStr);
+            exit(1);
+        }
+    }
+    telemetry.addSink(triggers);
+    bus->add(triggers);
+
+    TelemetryHistory history;
+    history.setRetention(historyMs);
+    telemetry.addSink(history);
+    bus->add(history);
+
+    LoadGenerator loadGenerator(&outbox);
+    if (benchStr[0] != '\0' && !loadGenerator.configure(benchStr)) {
+        Log::error("Invalid benchmark: '%s'", benchStr);
+        exit(1);
+    }
+    bus->add(loadGenerator);
+
+    RegisterMirror mirror;
+    if (mirrorSize > 0) {
+        mirror.setSize(mirrorSize);
+        if (!mirror.setFlushPolicy(mirrorFlushStr)) {
+            Log::error("Invalid mirror flush policy: '%s'", mirrorFlushStr);
+            exit(1);
+        }
+        if (mirrorDeviceStr[0] != '\0' && !mirror.open(mirrorDeviceStr)) {
+            exit(1);
+        }
+        bus->add(mirror);
+    }
+
+    ControlLoop controlLoop(&mirror);
+    if (controlStr[0] != '\0') {
+        if (!controlLoop.start(controlStr)) {
+            exit(1);
+        }
+    }
+    if (controlFifoPriority > 0) {
+        if (!controlLoop.isEnabled()) {
+            Log::error("--control-fifo needs a control loop (--control)");
+            exit(1);
+        }
+        if (!controlLoop.setRealtime(controlFifoPriority)) {
+            exit(1);
+        }
+    }
+
+    // SIGINT and SIGTERM end the main loop, so that everything is shut down
+    // normally (which is also when a profiling build writes its profile).
+    // They're only unblocked while waiting in ppoll, so one which arrives
+    // while the loop is busy is seen at the next wait rather than lost.
+    struct sigaction quitAction = {};
+    quitAction.sa_handler = quitHandler;
+    sigemptyset(&quitAction.sa_mask);
+    sigaction(SIGINT, &quitAction, nullptr);
+    sigaction(SIGTERM, &quitAction, nullptr);
+    sigset_t quitSignals;
+    sigset_t pollSignals;
+    sigemptyset(&quitSignals);
+    sigaddset(&quitSignals, SIGINT);
+    sigaddset(&quitSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quitSignals, &pollSignals);
+
+    Metrics metrics;
+    uint64_t nextMetricsMs = 0;
+
+    // Bulk transfers are the first thing to go when the server is overloaded.
+    requestQueue.setLowPriority(ServerCommand::DELTA_DUMP);
+    requestQueue.setLowPriority(ServerCommand::FW_DATA);
+    requestQueue.setTarget(sloTargetMs * 1000000ull);
+    std::vector<int> auxFds;
+
+    // Time that the first byte of the packet currently being parsed arrived.
+    uint64_t rxStartNs = 0;
+    // When data was last received (monotonic milliseconds).
+    uint64_t lastRxMs = 0;
+
+    BaudCalibrator baudCalibrator(&outbox, [&](uint32_t baud) {
+        if (serialBus.open(serialPortStr, baud) != IBus::Error::NONE) {
+            return false;
+        }
+        fd = serialBus.serial();
+        rxTimestamp.attach(fd);
+        rxStartNs = 0;
+        return flowControl.apply(fd);
+    });
+    if (bus == &serialBus) {
+        baudCalibrator.setFile(
+            baudFileStr, serialPortStr, BaudCalibrator::load(baudFileStr, serialPortStr));
+        bus->add(baudCalibrator);
+        if (calibrateBaud) {
+            baudCalibrator.startCalibration();
+        }
+    }
+
+    // Added last, so it only sees the commands which nothing answered.
+    ResponseTracker responseTracker;
+    bus->add(responseTracker);
+
+    // Only wake up periodically if something needs periodic attention.
+    int pollTimeoutMs = (leaseManager.hasDevices() || federation.isActive() || health.isEnabled() ||
+                         mirror.needsPoll() || flowControl.isEnabled() || loadGenerator.isEnabled() ||
+                         telemetry.isEnabled() || tracer.isOpen() || metricsFileStr[0] != '\0')
+                            ? TICK_MS
+                            : -1;
+    uint64_t nextTickMs = 0;
+    uint64_t nextReopenMs = 0;
+
+    std::vector<struct pollfd> pfds;
+    while (!g_quit) {
+        // The bus is always first, followed by any auxiliary sockets. While
+        // the serial port is gone, fd is -1, which poll ignores.
+        // Peer links come and go, so the auxiliary sockets are gathered
+        // every time around.
+        auxFds.clear();
+        federation.addPollFds(&auxFds);
+        if (telemetry.isEnabled()) {
+            auxFds.push_back(telemetry.socket());
+        }
+        pfds.clear();
+        pfds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+        for (int auxFd : auxFds) {
+            pfds.push_back({.fd = auxFd, .events = POLLIN, .revents = 0});
+        }
+        // Only skip the wait if a request can actually be dequeued, which
+        // needs the bus to be between packets and the write gap to be open.
+        uint64_t writeWaitUs = flowControl.waitUs(Clock::monotonicNs());
+        bool canPop = rxStartNs == 0 && fd >= 0 && writeWaitUs == 0;
+        int timeoutMs = (canPop && !requestQueue.isEmpty()) ? 0 : pollTimeoutMs;
+        if (timeoutMs < 0 && baudCalibrator.needsPoll()) {
+            timeoutMs = TICK_MS;
+        }
+        // Nothing can be dequeued while the serial port is gone, so just
+        // wake up to try reopening it.
+        if (fd < 0) {
+            timeoutMs = TICK_MS;
+        }
+        // While writes are throttled, sleep until the next one is allowed.
+        if (fd >= 0 && writeWaitUs > 0 && (!requestQueue.isEmpty() || outbox.hasPending())) {
+            timeoutMs = static_cast<int>((writeWaitUs + 999) / 1000);
+        }
+        // Don't sleep past the point where a partial packet is given up on.
+        if (rxStartNs != 0) {
+            uint64_t loopMs = Clock::monotonicNs() / 1000000;
+            uint64_t stallMs = lastRxMs + INTER_BYTE_TIMEOUT_MS;
+            int rxLeftMs = stallMs > loopMs ? static_cast<int>(stallMs - loopMs) : 0;
+            if (timeoutMs < 0 || timeoutMs > rxLeftMs) {
+                timeoutMs = rxLeftMs;
+            }
+        }
+        struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        if (ppoll(pfds.data(), pfds.size(), timeoutMs < 0 ? nullptr : &timeout, &pollSignals) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             Log::error("Poll failed: %s", strerror(errno));
             break;
         }
-        if (pfd.revents == 0) {
-            continue;
+        // Taken first, so that nothing the loop does delays it.
+        uint64_t wakeNs = Clock::realtimeNs();
+        for (size_t i = 1; i < pfds.size(); i++) {
+            // Hangups are passed on too, so that a peer link notices them.
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            if (pfds[i].fd == telemetry.socket()) {
+                telemetry.processInput();
+            } else {
+                federation.processInput(pfds[i].fd);
+            }
         }
-        if ((pfd.revents & POLLRDHUP) != 0) {
-            Log::info("Remote disconnected");
-            break;
+        uint64_t nowMs = Clock::monotonicNs() / 1000000;
+        if (loadGenerator.isEnabled()) {
+            loadGenerator.pump(nowMs);
+            if (loadGenerator.isDone()) {
+                loadGenerator.report(nowMs);
+                break;
+            }
         }
-        if ((pfd.revents & POLLIN) == 0) {
-            Log::error("Unexexpected poll revent: 0x%04x", static_cast<unsigned int>(pfd.revents));
+        if ((pollTimeoutMs >= 0 || baudCalibrator.needsPoll() || fd < 0) && nowMs >= nextTickMs) {
+            nextTickMs = nowMs + TICK_MS;
+            if (fd < 0 && nowMs >= nextReopenMs) {
+                nextReopenMs = nowMs + REOPEN_INTERVAL_MS;
+                if (serialBus.open(serialPortStr, baudCalibrator.baud()) == IBus::Error::NONE) {
+                    Log::info("Serial port reopened");
+                    fd = serialBus.serial();
+                    rxTimestamp.attach(fd);
+                    flowControl.apply(fd);
+                    handshake.reset();
+                    outbox.setOnline(true);
+                }
+            }
+            baudCalibrator.poll(nowMs);
+            if (bus == &serialBus && fd >= 0) {
+                flowControl.poll(fd);
+            }
+            leaseManager.poll(nowMs);
+            federation.poll(nowMs);
+            health.poll(nowMs);
+            mirror.poll(nowMs);
+            telemetry.poll(nowMs);
+            tracer.poll(nowMs);
+            if (metricsFileStr[0] != '\0' && nowMs >= nextMetricsMs) {
+                nextMetricsMs = nowMs + METRICS_INTERVAL_MS;
+                health.updateMetrics(&metrics, nowMs);
+                requestQueue.updateMetrics(&metrics);
+                mirror.updateMetrics(&metrics);
+                baudCalibrator.updateMetrics(&metrics);
+                flowControl.updateMetrics(&metrics);
+                federation.updateMetrics(&metrics);
+                telemetry.updateMetrics(&metrics);
+                history.updateMetrics(&metrics);
+                triggers.updateMetrics(&metrics);
+                serverTiming.updateMetrics(&metrics);
+                rxTimestamp.updateMetrics(&metrics);
+                controlLoop.updateMetrics(&metrics);
+                metrics.write(metricsFileStr);
+            }
+        }
+        struct pollfd const& pfd = pfds[0];
+        if ((pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0) {
+            if (bus != &serialBus) {
+                Log::info("Remote disconnected");
+                break;
+            }
+            // The serial device went away (i.e. it's resetting or was
+            // unplugged). Keep serving everything else, with server packets
+            // going into the queue, and reopen the port from the tick.
+            Log::info("Serial port disconnected, waiting for it to return");
+            outbox.setOnline(false);
+            health.noteLinkDown();
+            serialBus.close();
+            fd = -1;
+            rxStartNs = 0;
+            nextReopenMs = nowMs + REOPEN_INTERVAL_MS;
             continue;
         }
+        if (pfd.revents != 0 && (pfd.revents & POLLIN) == 0) {
+            Log::error("Unexexpected poll revent: 0x%04x", static_cast<unsigned int>(pfd.revents));
+        }
+
+        // A packet whose sender stopped part way through would otherwise
+        // block the request queue for good. The parser resynchronizes on
+        // the next packet's framing.
+        if (rxStartNs != 0 && (pfd.revents & POLLIN) == 0 && nowMs >= lastRxMs + INTER_BYTE_TIMEOUT_MS) {
+            Log::warning("Dropping partial packet (nothing received for %" PRIu64 " ms)", nowMs - lastRxMs);
+            metrics.add("cliserver_rx_stalled_packets_total");
+            rxStartNs = 0;
+        }
+
+        if ((pfd.revents & POLLIN) != 0) {
+            // Any traffic from the other end shows that it's alive.
+            health.noteActivity(nowMs);
+            lastRxMs = nowMs;
 
-        if (auto rc = bus->processByte(); rc != Packet::Error::NONE) {
-            if (rc != Packet::Error::NOT_DONE) {
-                Log::error("Error processing packet: %s", as_str(rc));
+            // Parse everything which has arrived, so that a burst of requests
+            // ends up in the request queue rather than in the kernel buffer.
+            int numBytes = 0;
+            if (ioctl(fd, FIONREAD, &numBytes) < 0 || numBytes < 1) {
+                numBytes = 1;
+            }
+            for (int i = 0; i < numBytes; i++) {
+                // Each packet is timestamped with the arrival of its first
+                // byte rather than when it happens to be parsed.
+                if (rxStartNs == 0) {
+                    rxStartNs = rxTimestamp.arrivalNs(fd, wakeNs);
+                }
+                if (auto rc = bus->processByte(); rc != Packet::Error::NONE) {
+                    if (rc != Packet::Error::NOT_DONE) {
+                        Log::error("Error processing packet: %s", as_str(rc));
+                        baudCalibrator.noteRxError();
+                        rxStartNs = 0;
+                    }
+                    continue;
+                }
+
+                // We've parsed a packet. Everything received is captured,
+                // including the packets which are consumed below.
+                uint64_t rxDoneNs = Clock::realtimeNs();
+                if (capture.isOpen()) {
+                    capture.writePacket(
+                        captureInterface, rxDoneNs, PcapngWriter::Direction::INBOUND,
+                        cmdPacket.getCommand(), cmdPacket.getData(), cmdPacket.getLength());
+                }
+                if (HealthMonitor::isProbeReply(cmdPacket)) {
+                    rxStartNs = 0;
+                    continue;
+                }
+                if (LoadGenerator::isReply(cmdPacket)) {
+                    loadGenerator.handleReply(cmdPacket);
+                    rxStartNs = 0;
+                    continue;
+                }
+                if (BaudCalibrator::isReply(cmdPacket)) {
+                    baudCalibrator.handleReply(cmdPacket);
+                    rxStartNs = 0;
+                    continue;
+                }
+                // Samples are stamped with when they arrived on the link.
+                if (telemetry.consume(cmdPacket, rxStartNs)) {
+                    rxStartNs = 0;
+                    continue;
+                }
+                ServerError admitErr = handshake.admit(cmdPacket, requestQueue.size());
+                if (admitErr == ServerError::NONE &&
+                    !requestQueue.push(
+                        cmdPacket, tracer.startTrace(), rxStartNs, rxDoneNs, Clock::monotonicNs())) {
+                    admitErr = ServerError::OVERLOADED;
+                }
+                if (admitErr != ServerError::NONE) {
+                    PacketWriter::error(&rspPacket, cmdPacket.getCommand(), admitErr);
+                    bus->writePacket(rspPacket);
+                    if (capture.isOpen()) {
+                        capture.writePacket(
+                            captureInterface, Clock::realtimeNs(), PcapngWriter::Direction::OUTBOUND,
+                            rspPacket.getCommand(), rspPacket.getData(), rspPacket.getLength());
+                    }
+                }
+                rxStartNs = 0;
             }
-            continue;
         }
 
-        // We've parsed a packet.
-        bus->handlePacket();
+        // Packets held back by the write gap go out ahead of new responses.
+        outbox.poll();
+
+        // Handle a single request and then go back to reading, so that
+        // queueing delay is measured on requests which are actually waiting.
+        // The queued request is copied back into cmdPacket, so this can only
+        // happen between packets.
+        RequestQueue::Entry request;
+        RequestQueue::Verdict verdict;
+        if (rxStartNs != 0 || fd < 0 || flowControl.waitUs(Clock::monotonicNs()) > 0 ||
+            !requestQueue.pop(Clock::monotonicNs(), &request, &verdict)) {
+            continue;
+        }
+        uint64_t handleStartNs = Clock::realtimeNs();
+        TraceContext const& traceCtx = request.trace;
+        metrics.add("cliserver_packets_total");
+        bool responded = true;
+        if (verdict == RequestQueue::Verdict::SHED) {
+            PacketWriter::error(&rspPacket, request.command, ServerError::OVERLOADED);
+            bus->writePacket(rspPacket);
+        } else {
+            cmdPacket.setCommand(request.command);
+            memcpy(cmdPacket.getData(), request.data.data(), request.length);
+            cmdPacket.setLength(request.length);
+            // Once devices are pooled, requests need the right lease.
+            ServerError leaseErr =
+                leaseManager.hasDevices() ? leaseManager.authorize(&cmdPacket, nowMs) : ServerError::NONE;
+            if (leaseErr != ServerError::NONE) {
+                PacketWriter::error(&rspPacket, request.command, leaseErr);
+                bus->writePacket(rspPacket);
+            } else if (cmdPacket.getCommand() == ServerCommand::ROUTE) {
+                // The response is relayed once the other server answers.
+                ServerError routeErr = federation.forward(cmdPacket, nowMs);
+                if (routeErr != ServerError::NONE) {
+                    PacketWriter::error(&rspPacket, ServerCommand::ROUTE, routeErr);
+                    bus->writePacket(rspPacket);
+                } else {
+                    responded = false;
+                }
+            } else {
+                responseTracker.reset();
+                bus->handlePacket();
+                responded = responseTracker.wasAnswered();
+            }
+        }
+        uint64_t txDoneNs = Clock::realtimeNs();
+        if (responded) {
+            flowControl.noteWrite(Clock::monotonicNs());
+            if (capture.isOpen()) {
+                capture.writePacket(
+                    captureInterface, txDoneNs, PcapngWriter::Direction::OUTBOUND,
+                    rspPacket.getCommand(), rspPacket.getData(), rspPacket.getLength());
+            }
+            serverTiming.send(request, handleStartNs, txDoneNs, traceCtx);
+        }
+        tracer.addSpan(traceCtx, "receive", request.rxStartNs, request.rxDoneNs);
+        tracer.addSpan(traceCtx, "queue", request.rxDoneNs, handleStartNs);
+        tracer.addSpan(traceCtx, "handle", handleStartNs, txDoneNs);
+        tracer.endTrace(traceCtx, request.command, request.rxStartNs, txDoneNs);
     }
 
+    capture.close();
+    tracer.close();
+
     if (g_verbose) {
         Log::debug("Done");
     }
 
-    exit(0);
-    return 0;  // Get rid of warning about not returning anything
+    return 0;
 }  // main
 
 //! @brief Prints program usage.
@@ -232,8 +954,58 @@ void usage() {
     Log::info("%s", "");
     Log::info("Connect to a network port");
     Log::info("%s", "");
+    Log::info("      --baud-file FILE");
+    Log::info("                    Remember the calibrated baud rate of each serial device in FILE");
+    Log::info("      --bench COUNT[:WINDOW]");
+    Log::info("                    Send COUNT PING requests (WINDOW at a time) and report the rate");
+    Log::info("      --calibrate-baud");
+    Log::info("                    Find the fastest baud rate the serial link can sustain");
+    Log::info("      --control PLUGIN.so@HZ");
+    Log::info("                    Run a control loop plugin at HZ cycles per second");
+    Log::info("      --control-fifo PRIO");
+    Log::info("                    Run the control loop thread with SCHED_FIFO priority PRIO (1-99)");
     Log::info("  -d, --debug       Turn on debug output");
+    Log::info("      --firmware FILE");
+    Log::info("                    Accept firmware uploads, writing them to FILE");
+    Log::info("      --flow-control none|rtscts");
+    Log::info("                    Serial flow control; overruns throttle writes");
     Log::info("  -h, --help        Display this message");
+    Log::info("      --history MS  Keep MS milliseconds of telemetry for HISTORY queries");
+    Log::info("      --lease-device NAME");
+    Log::info("                    Add NAME to the pool of devices which can be leased");
+    Log::info("      --lease-group NAME=DEV1,DEV2,...");
+    Log::info("                    Group identical devices; readers are spread across them");
+    Log::info("      --low-priority CMD");
+    Log::info("                    Treat command CMD as low priority (may be shed)");
+    Log::info("      --metrics FILE");
+    Log::info("                    Write metrics in Prometheus text format to FILE");
+    Log::info("      --mirror-device FILE");
+    Log::info("                    Load the mirror from, and write it back to, FILE");
+    Log::info("      --mirror-size N");
+    Log::info("                    Mirror an N byte device control table");
+    Log::info("      --mirror-flush immediate|sync|periodic:MS");
+    Log::info("                    When dirty mirror registers are written back");
     Log::info("  -p, --port PORT   Port to run server on");
+    Log::info("      --probe-interval MS");
+    Log::info("                    Probe the link after MS milliseconds of silence");
+    Log::info("      --registry HOST:PORT");
+    Log::info("                    Advertise our devices to the federation registry");
+    Log::info("      --registry-serve PORT");
+    Log::info("                    Act as the federation registry on UDP PORT");
+    Log::info("      --advertise HOST:PORT");
+    Log::info("                    Endpoint advertised to the registry (default hostname:port)");
+    Log::info("      --peer HOST:PORT=PTY");
+    Log::info("                    Forward requests for HOST:PORT's devices over PTY (a socat link)");
+    Log::info("      --queue FILE  Queue packets in FILE while the serial device is offline");
+    Log::info("      --pcap FILE   Capture all packets to a pcapng file");
+    Log::info("      --slo-target MS");
+    Log::info("                    Shed low priority requests when queueing delay exceeds MS");
+    Log::info("      --telemetry PORT");
+    Log::info("                    Stream SAMPLE packets to subscribers on UDP PORT");
+    Log::info("      --trace FILE  Export request spans as OTLP JSON to FILE");
+    Log::info("      --trace-sample RATE");
+    Log::info("                    Fraction of requests to trace (default 1.0)");
+    Log::info("      --trigger \"FIELD OP VALUE -> CMD [BYTE...]\"");
+    Log::info("                    Send a packet as soon as a sample field meets a condition");
     Log::info("  -v, --verbose     Turn on verbose messages");
 }
@@ -0,0 +1,42 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Clock.h
+ *
+ *   @brief  Nanosecond timestamps used by the instrumentation code.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+
+namespace Clock {
+
+//! @returns the time of the clock identified by clockId, in nanoseconds.
+inline uint64_t ns(clockid_t clockId) {
+    struct timespec ts;
+    clock_gettime(clockId, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+//! @returns the wall clock time, in nanoseconds since the epoch.
+inline uint64_t realtimeNs() {
+    return ns(CLOCK_REALTIME);
+}
+
+//! @returns the monotonic time, in nanoseconds. Use this for intervals.
+inline uint64_t monotonicNs() {
+    return ns(CLOCK_MONOTONIC);
+}
+
+}  // namespace Clock
@@ -0,0 +1,236 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ControlLoop.cpp
+ *
+ *   @brief  Runs a plugin control loop at a fixed rate.
+ *
+ ****************************************************************************/
+
+#include "ControlLoop.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "Clock.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "RegisterMirror.h"
+
+namespace {
+
+//! Upper bounds (in microseconds) of the histogram buckets.
+constexpr uint32_t BUCKET_US[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+static_assert(LEN(BUCKET_US) + 1 == ControlLoop::NUM_BUCKETS, "NUM_BUCKETS doesn't match BUCKET_US");
+
+}  // namespace
+
+ControlLoop::~ControlLoop() {
+    // The thread notices within a period.
+    this->m_done = true;
+    if (this->m_thread.joinable()) {
+        this->m_thread.join();
+    }
+    if (this->m_exit != nullptr) {
+        this->m_exit(&this->m_ctl);
+    }
+    if (this->m_handle != nullptr) {
+        dlclose(this->m_handle);
+    }
+    if (this->m_timerFd >= 0) {
+        close(this->m_timerFd);
+    }
+}
+
+bool ControlLoop::start(char const* spec) {
+    std::string specStr = spec;
+    auto at = specStr.rfind('@');
+    uint32_t rateHz = 0;
+    if (at != std::string::npos) {
+        rateHz = strtoul(specStr.c_str() + at + 1, nullptr, 0);
+    }
+    if (rateHz == 0 || rateHz > 1000000) {
+        Log::error("Control loop must be PLUGIN@RATE_HZ: '%s'", spec);
+        return false;
+    }
+    std::string fileName = specStr.substr(0, at);
+    if (!this->m_mirror->hasDevice()) {
+        Log::error("Control loops need the register mirror on a device (--mirror-device)");
+        return false;
+    }
+
+    this->m_handle = dlopen(fileName.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (this->m_handle == nullptr) {
+        Log::error("Unable to load control plugin: %s", dlerror());
+        return false;
+    }
+    auto init = reinterpret_cast<InitFn>(dlsym(this->m_handle, "cliserver_control_init"));
+    this->m_step = reinterpret_cast<StepFn>(dlsym(this->m_handle, "cliserver_control_step"));
+    this->m_exit = reinterpret_cast<ExitFn>(dlsym(this->m_handle, "cliserver_control_exit"));
+    if (this->m_step == nullptr) {
+        Log::error("Control plugin '%s' has no cliserver_control_step", fileName.c_str());
+        return false;
+    }
+
+    this->m_ctl.periodNs = 1000000000u / rateHz;
+    this->m_ctl.inputs = this->m_inputs;
+    this->m_ctl.outputs = this->m_outputs;
+    if (init != nullptr && init(&this->m_ctl) != 0) {
+        Log::error("Control plugin '%s' failed to initialize", fileName.c_str());
+        this->m_exit = nullptr;
+        return false;
+    }
+    if (this->m_ctl.inputLen > CLI_CONTROL_MAX_INPUT || this->m_ctl.outputLen > CLI_CONTROL_MAX_OUTPUT) {
+        Log::error("Control plugin '%s' has too many inputs or outputs", fileName.c_str());
+        return false;
+    }
+    if (this->m_ctl.inputAddress + this->m_ctl.inputLen > this->m_mirror->size() ||
+        this->m_ctl.outputAddress + this->m_ctl.outputLen > this->m_mirror->size()) {
+        Log::error("Control plugin '%s' registers are outside the mirror", fileName.c_str());
+        return false;
+    }
+
+    this->m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (this->m_timerFd < 0) {
+        Log::error("Unable to create control loop timer: %s", strerror(errno));
+        return false;
+    }
+    struct itimerspec timerSpec = {};
+    timerSpec.it_interval.tv_sec = this->m_ctl.periodNs / 1000000000u;
+    timerSpec.it_interval.tv_nsec = this->m_ctl.periodNs % 1000000000u;
+    timerSpec.it_value = timerSpec.it_interval;
+    if (timerfd_settime(this->m_timerFd, 0, &timerSpec, nullptr) < 0) {
+        Log::error("Unable to start control loop timer: %s", strerror(errno));
+        return false;
+    }
+    // Signals are left to the main thread (whose poll they interrupt), so
+    // the control loop thread starts with all of them blocked.
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    this->m_thread = std::thread(&ControlLoop::run, this);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+    Log::info("Running control loop '%s' at %" PRIu32 " Hz", fileName.c_str(), rateHz);
+    return true;
+}
+
+bool ControlLoop::setRealtime(int priority) {
+    struct sched_param param = {};
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(this->m_thread.native_handle(), SCHED_FIFO, &param);
+    if (err != 0) {
+        Log::error("Unable to switch the control loop to SCHED_FIFO: %s", strerror(err));
+        return false;
+    }
+    return true;
+}
+
+void ControlLoop::run() {
+    while (!this->m_done) {
+        uint64_t expirations;
+        if (read(this->m_timerFd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Log::error("Control loop timer failed: %s", strerror(errno));
+            return;
+        }
+        if (!this->m_done) {
+            this->cycle(expirations);
+        }
+    }
+}
+
+void ControlLoop::cycle(uint64_t expirations) {
+    uint64_t wakeNs = Clock::monotonicNs();
+    bool haveJitter = this->m_lastWakeNs != 0;
+    uint64_t jitterNs = 0;
+    if (haveJitter) {
+        uint64_t periodNs = wakeNs - this->m_lastWakeNs;
+        uint64_t expectedNs = this->m_ctl.periodNs * expirations;
+        jitterNs = periodNs > expectedNs ? periodNs - expectedNs : expectedNs - periodNs;
+    }
+    this->m_lastWakeNs = wakeNs;
+
+    // The inputs are read from the device in one go at the start of each
+    // cycle, so the plugin always sees the current register values.
+    this->m_ctl.nowNs = wakeNs;
+    bool haveInputs = this->m_mirror->read(this->m_ctl.inputAddress, this->m_inputs, this->m_ctl.inputLen);
+    if (haveInputs && this->m_step(&this->m_ctl) == 0 && this->m_ctl.outputLen > 0) {
+        // Only the outputs which changed go out, in a single write. Dirty
+        // registers written by clients are left to the flush policy.
+        this->m_mirror->writeThrough(this->m_ctl.outputAddress, this->m_outputs, this->m_ctl.outputLen);
+    }
+    this->m_ctl.cycle += expirations;
+    uint64_t cycleNs = Clock::monotonicNs() - wakeNs;
+
+    std::lock_guard<std::mutex> lock(this->m_mutex);
+    this->m_numCycles++;
+    if (!haveInputs) {
+        this->m_readErrors++;
+    }
+    if (expirations > 1 || cycleNs > this->m_ctl.periodNs) {
+        this->m_overruns++;
+    }
+    if (haveJitter) {
+        this->m_jitter.add(jitterNs / 1000);
+    }
+    this->m_cycleTime.add(cycleNs / 1000);
+}
+
+void ControlLoop::updateMetrics(Metrics* metrics) const {
+    std::lock_guard<std::mutex> lock(this->m_mutex);
+    this->m_jitter.publish(metrics, "cliserver_control_jitter_us");
+    this->m_cycleTime.publish(metrics, "cliserver_control_cycle_us");
+    metrics->set("cliserver_control_cycles_total", this->m_numCycles);
+    metrics->set("cliserver_control_overruns_total", this->m_overruns);
+    metrics->set("cliserver_control_read_errors_total", this->m_readErrors);
+}
+
+void ControlLoop::Histogram::add(uint64_t us) {
+    size_t idx = 0;
+    while (idx < NUM_BUCKETS - 1 && us > BUCKET_US[idx]) {
+        idx++;
+    }
+    this->buckets[idx]++;
+    this->count++;
+    this->sumUs += us;
+}
+
+void ControlLoop::Histogram::publish(Metrics* metrics, char const* name) const {
+    // Prometheus histogram buckets are cumulative.
+    char metricName[96];
+    uint64_t cumulative = 0;
+    for (size_t idx = 0; idx < NUM_BUCKETS; idx++) {
+        cumulative += this->buckets[idx];
+        if (idx < NUM_BUCKETS - 1) {
+            snprintf(metricName, sizeof(metricName), "%s_bucket{le=\"%" PRIu32 "\"}", name, BUCKET_US[idx]);
+        } else {
+            snprintf(metricName, sizeof(metricName), "%s_bucket{le=\"+Inf\"}", name);
+        }
+        metrics->set(metricName, cumulative);
+    }
+    snprintf(metricName, sizeof(metricName), "%s_count", name);
+    metrics->set(metricName, this->count);
+    snprintf(metricName, sizeof(metricName), "%s_sum", name);
+    metrics->set(metricName, this->sumUs);
+}
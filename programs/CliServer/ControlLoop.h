@@ -0,0 +1,119 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ControlLoop.h
+ *
+ *   @brief  Runs a plugin control loop at a fixed rate.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "ControlPlugin.h"
+
+class Metrics;
+class RegisterMirror;
+
+//! @brief Runs a control loop plugin (see ControlPlugin.h) at a fixed rate.
+//!
+//! @details The loop runs on its own thread, woken once per period by a
+//!          timerfd, so nothing the main loop does (handling requests,
+//!          writing files) delays a cycle. Each cycle reads the plugin's
+//!          input registers from the mirror device in one read, calls the
+//!          plugin, and writes its outputs through the register mirror, so
+//!          the changed outputs go to the device in a single write. Other
+//!          dirty registers are left to the mirror's flush policy. Only
+//!          this thread is switched to SCHED_FIFO (see setRealtime).
+//!
+//!          Period jitter is how far each wakeup is from the nominal period
+//!          after the previous one. It is kept as a histogram, and so is the
+//!          time taken by each cycle. A cycle overruns if the timer expired
+//!          more than once since the last wakeup (cycles were skipped) or if
+//!          the cycle took longer than the period.
+class ControlLoop {
+ public:
+    //! Number of histogram buckets: 10 us to 10 ms, plus an overflow bucket.
+    static constexpr size_t NUM_BUCKETS = 11;
+
+    //! @brief Constructor.
+    explicit ControlLoop(
+        RegisterMirror* mirror  //!< [in] Where the inputs are read and the outputs written.
+    )
+        : m_mirror(mirror) {}
+
+    //! @brief Destructor. Stops the thread, unloads the plugin and closes the timer.
+    ~ControlLoop();
+
+    ControlLoop(ControlLoop const&) = delete;
+    ControlLoop& operator=(ControlLoop const&) = delete;
+
+    //! @brief Loads the plugin and starts the control loop thread.
+    //! @returns false if the plugin couldn't be loaded or initialized.
+    bool start(
+        char const* spec  //!< [in] "PLUGIN.so@RATE_HZ".
+    );
+
+    //! @brief Switches the control loop thread to SCHED_FIFO.
+    //! @returns false if the scheduling policy couldn't be changed.
+    bool setRealtime(
+        int priority  //!< [in] SCHED_FIFO priority (1 - 99).
+    );
+
+    //! @returns true if a control loop is running.
+    bool isEnabled() const { return this->m_thread.joinable(); }
+
+    //! @brief Publishes the jitter and cycle time histograms.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    using InitFn = int (*)(CliControl*);
+    using StepFn = int (*)(CliControl*);
+    using ExitFn = void (*)(CliControl*);
+
+    //! Histogram of durations.
+    struct Histogram {
+        uint64_t buckets[NUM_BUCKETS] = {};  //!< Counts (not cumulative).
+        uint64_t count = 0;                  //!< Number of observations.
+        uint64_t sumUs = 0;                  //!< Sum of the observations.
+
+        void add(uint64_t us);
+        void publish(Metrics* metrics, char const* name) const;
+    };
+
+    void run();
+    void cycle(uint64_t expirations);
+
+    RegisterMirror* m_mirror;               //!< Where the inputs and outputs live.
+    void* m_handle = nullptr;               //!< dlopen handle of the plugin.
+    StepFn m_step = nullptr;                //!< Plugin's step function.
+    ExitFn m_exit = nullptr;                //!< Plugin's exit function (may be null).
+    CliControl m_ctl = {};                  //!< State shared with the plugin.
+    uint8_t m_inputs[CLI_CONTROL_MAX_INPUT];    //!< Storage for m_ctl.inputs.
+    uint8_t m_outputs[CLI_CONTROL_MAX_OUTPUT];  //!< Storage for m_ctl.outputs.
+    int m_timerFd = -1;                     //!< Fires once per period.
+    std::thread m_thread;                   //!< Runs the cycles.
+    std::atomic<bool> m_done{false};        //!< Tells the thread to exit.
+    uint64_t m_lastWakeNs = 0;              //!< When the previous cycle started.
+
+    mutable std::mutex m_mutex;             //!< Protects the statistics below.
+    uint64_t m_numCycles = 0;               //!< Cycles run.
+    uint64_t m_overruns = 0;                //!< Cycles which were late or skipped.
+    uint64_t m_readErrors = 0;              //!< Cycles skipped because the inputs couldn't be read.
+    Histogram m_jitter;                     //!< Period jitter.
+    Histogram m_cycleTime;                  //!< Time taken by each cycle.
+};
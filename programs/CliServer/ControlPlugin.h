@@ -0,0 +1,65 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ControlPlugin.h
+ *
+ *   @brief  Interface implemented by control loop plugins.
+ *
+ *   A plugin is a shared library exporting these C functions:
+ *
+ *       int cliserver_control_init(struct CliControl* ctl);   (optional)
+ *       int cliserver_control_step(struct CliControl* ctl);
+ *       void cliserver_control_exit(struct CliControl* ctl);  (optional)
+ *
+ *   init sets the input and output register ranges (and may set state) and
+ *   returns 0 on success. Each cycle the input registers are read from the
+ *   device, and then step is called, fills in outputs, and returns 0 to have
+ *   them written to the device (anything else skips the write for that
+ *   cycle).
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Largest number of input registers a plugin can read.
+#define CLI_CONTROL_MAX_INPUT 256
+
+//! Largest number of output registers a plugin can write.
+#define CLI_CONTROL_MAX_OUTPUT 256
+
+//! @brief State shared between CliServer and a control loop plugin.
+struct CliControl {
+    // Filled in by CliServer before each call to step.
+    uint8_t const* inputs;   //!< inputLen register values read this cycle.
+    uint64_t cycle;          //!< Number of the cycle (starting at 0).
+    uint64_t nowNs;          //!< Time the cycle started (CLOCK_MONOTONIC).
+    uint32_t periodNs;       //!< Nominal period of the loop.
+
+    // Set by the plugin in init.
+    uint16_t inputAddress;   //!< First register read each cycle.
+    uint16_t inputLen;       //!< Number of registers read each cycle.
+    uint16_t outputAddress;  //!< First register written each cycle.
+    uint16_t outputLen;      //!< Number of registers written each cycle.
+    void* state;             //!< Private to the plugin.
+
+    // Filled in by the plugin in step.
+    uint8_t* outputs;        //!< outputLen register values.
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,59 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Crc32.h
+ *
+ *   @brief  Table driven CRC-32 (the same CRC used by zlib and Ethernet).
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace Crc32 {
+
+//! @brief Builds the lookup table for the reflected 0x04C11DB7 polynomial.
+constexpr std::array<uint32_t, 256> makeTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+//! Lookup table used by update.
+inline constexpr std::array<uint32_t, 256> TABLE = makeTable();
+
+//! @brief Continues a CRC calculation over some more data.
+//! @details Start with crc = 0. The result of one call can be passed in as
+//!          the crc for the next call.
+//! @returns the CRC of all of the data processed so far.
+inline uint32_t update(uint32_t crc, void const* data, size_t len) {
+    auto bytes = static_cast<uint8_t const*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = TABLE[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+//! @returns the CRC-32 of a block of data.
+inline uint32_t calc(void const* data, size_t len) {
+    return update(0, data, len);
+}
+
+}  // namespace Crc32
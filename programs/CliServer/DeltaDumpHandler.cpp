@@ -0,0 +1,151 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   DeltaDumpHandler.cpp
+ *
+ *   @brief  Memory dumps which only transfer blocks which have changed.
+ *
+ ****************************************************************************/
+
+#include "DeltaDumpHandler.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! @brief Copies memory from our own address space.
+//! @details Using process_vm_readv means that a bad address returns an
+//!          error rather than crashing the server.
+//! @returns true if all of the memory could be read.
+bool readMemory(uint64_t address, void* dst, size_t len) {
+    struct iovec local = {dst, len};
+    struct iovec remote = {reinterpret_cast<void*>(static_cast<uintptr_t>(address)), len};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == static_cast<ssize_t>(len);
+}
+
+//! @returns the 32-bit FNV-1a hash of a block of memory.
+uint32_t fnv1a(uint8_t const* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+}  // namespace
+
+bool DeltaDumpHandler::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::DELTA_DUMP) {
+        return false;
+    }
+
+    PacketReader reader(cmd);
+    auto address = reader.read<uint64_t>();
+    auto length = reader.read<uint32_t>();
+    auto generation = reader.read<uint32_t>();
+    auto cursor = reader.read<uint16_t>();
+    auto blockSize = reader.read<uint8_t>();
+
+    // Each response needs room for the header and at least one block.
+    constexpr size_t headerLen = sizeof(uint32_t) + 2 * sizeof(uint16_t);
+    constexpr size_t entryHdrLen = sizeof(uint16_t);
+    if (!reader.ok() || length == 0 || blockSize < MIN_BLOCK_SIZE ||
+        headerLen + entryHdrLen + blockSize > PacketWriter::maxLength(*rsp) ||
+        (length + blockSize - 1) / blockSize >= NO_MORE_BLOCKS) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return true;
+    }
+    size_t numBlocks = (length + blockSize - 1) / blockSize;
+
+    Region* region = this->findRegion(address, length, blockSize);
+
+    if (cursor == 0) {
+        // Take a new snapshot and figure out which blocks have changed
+        // relative to the generation that the client already has.
+        std::vector<uint8_t> snapshot(length);
+        if (!readMemory(address, snapshot.data(), length)) {
+            PacketWriter::error(rsp, cmd.getCommand(), ServerError::FAULT);
+            return true;
+        }
+        if (region == nullptr) {
+            if (this->m_regions.size() >= MAX_REGIONS) {
+                // Evict the region which was refreshed least recently.
+                auto oldest = std::min_element(
+                    this->m_regions.begin(), this->m_regions.end(),
+                    [](Region const& a, Region const& b) { return a.generation < b.generation; });
+                this->m_regions.erase(oldest);
+            }
+            this->m_regions.emplace_back();
+            region = &this->m_regions.back();
+            region->address = address;
+            region->length = length;
+            region->blockSize = blockSize;
+        }
+        bool haveBaseline = generation != 0 && generation == region->generation;
+
+        region->hashes.resize(numBlocks);
+        region->changed.clear();
+        for (size_t block = 0; block < numBlocks; block++) {
+            size_t offset = block * blockSize;
+            size_t len = std::min<size_t>(blockSize, length - offset);
+            uint32_t hash = fnv1a(&snapshot[offset], len);
+            if (!haveBaseline || hash != region->hashes[block]) {
+                region->changed.push_back(static_cast<uint16_t>(block));
+            }
+            region->hashes[block] = hash;
+        }
+        region->snapshot.swap(snapshot);
+        region->generation = ++this->m_lastGeneration;
+    } else if (region == nullptr || generation != region->generation) {
+        // The client is continuing a dump whose snapshot we no longer have.
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::STALE);
+        return true;
+    }
+
+    if (cursor > region->changed.size()) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return true;
+    }
+
+    size_t entryLen = entryHdrLen + blockSize;
+    size_t entriesPerPacket = (PacketWriter::maxLength(*rsp) - headerLen) / entryLen;
+    size_t endCursor = std::min(region->changed.size(), cursor + entriesPerPacket);
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(region->generation);
+    writer.write(static_cast<uint16_t>(region->changed.size()));
+    writer.write(endCursor < region->changed.size() ? static_cast<uint16_t>(endCursor) : NO_MORE_BLOCKS);
+    for (size_t i = cursor; i < endCursor; i++) {
+        uint16_t block = region->changed[i];
+        size_t offset = static_cast<size_t>(block) * blockSize;
+        writer.write(block);
+        writer.append(&region->snapshot[offset], std::min<size_t>(blockSize, length - offset));
+    }
+    return true;
+}
+
+DeltaDumpHandler::Region* DeltaDumpHandler::findRegion(
+    uint64_t address,
+    uint32_t length,
+    uint8_t blockSize) {
+    for (auto& region : this->m_regions) {
+        if (region.address == address && region.length == length && region.blockSize == blockSize) {
+            return &region;
+        }
+    }
+    return nullptr;
+}
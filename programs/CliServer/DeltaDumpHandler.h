@@ -0,0 +1,81 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   DeltaDumpHandler.h
+ *
+ *   @brief  Memory dumps which only transfer blocks which have changed.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Bus.h"
+
+//! @brief Handles the DELTA_DUMP command.
+//!
+//! @details The server keeps the per-block hashes of the last few regions
+//!          which were dumped. When a client asks for a region again and
+//!          says which generation of it already has, only the blocks whose
+//!          hash has changed since that generation are returned.
+//!
+//!          Request data:
+//!              uint64_t address
+//!              uint32_t length
+//!              uint32_t generation   (generation the client holds, 0 = none)
+//!              uint16_t cursor       (0 = take a new snapshot)
+//!              uint8_t  blockSize
+//!
+//!          Response data:
+//!              uint32_t generation   (generation of the snapshot being sent)
+//!              uint16_t numChanged   (total number of changed blocks)
+//!              uint16_t nextCursor   (NO_MORE_BLOCKS when complete)
+//!              followed by (uint16_t blockIndex, block data) entries.
+//!
+//!          When nextCursor isn't NO_MORE_BLOCKS, the client repeats the
+//!          request with the new generation and the returned cursor.
+class DeltaDumpHandler : public IPacketHandler {
+ public:
+    //! Value of nextCursor when all of the changed blocks have been sent.
+    static constexpr uint16_t NO_MORE_BLOCKS = 0xffff;
+
+    //! Number of regions which have their hashes cached.
+    static constexpr size_t MAX_REGIONS = 8;
+
+    //! Smallest block size which may be requested.
+    static constexpr uint8_t MIN_BLOCK_SIZE = 8;
+
+    //! @brief Handles the DELTA_DUMP command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! Cached state for a dumped region.
+    struct Region {
+        uint64_t address = 0;               //!< Start address of the region.
+        uint32_t length = 0;                //!< Number of bytes in the region.
+        uint8_t blockSize = 0;              //!< Number of bytes per block.
+        uint32_t generation = 0;            //!< Generation of the latest snapshot.
+        std::vector<uint32_t> hashes;       //!< Per-block hashes of the latest snapshot.
+        std::vector<uint8_t> snapshot;      //!< Contents of the latest snapshot.
+        std::vector<uint16_t> changed;      //!< Blocks which changed in the latest snapshot.
+    };
+
+    Region* findRegion(uint64_t address, uint32_t length, uint8_t blockSize);
+
+    std::vector<Region> m_regions;      //!< Cached regions.
+    uint32_t m_lastGeneration = 0;      //!< Last generation number handed out.
+};
@@ -0,0 +1,357 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Federation.cpp
+ *
+ *   @brief  Lets several CliServer instances share a directory of devices.
+ *
+ ****************************************************************************/
+
+#include "Federation.h"
+
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "HealthMonitor.h"
+#include "LeaseManager.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "Udp.h"
+
+namespace {
+
+//! Largest datagram we'll send or receive.
+constexpr size_t MAX_DATAGRAM = 65000;
+
+//! Baud rate the peer links are opened with (a pseudo terminal ignores it).
+constexpr int PEER_BAUD = 115200;
+
+}  // namespace
+
+Federation::~Federation() {
+    if (this->m_memberFd >= 0) {
+        close(this->m_memberFd);
+    }
+    if (this->m_registryFd >= 0) {
+        close(this->m_registryFd);
+    }
+}
+
+bool Federation::join(char const* registry, char const* endpoint) {
+    this->m_memberFd = Udp::open(registry, false);
+    this->m_endpoint = endpoint;
+    return this->m_memberFd >= 0;
+}
+
+bool Federation::serve(char const* port) {
+    this->m_registryFd = Udp::open(port, true);
+    return this->m_registryFd >= 0;
+}
+
+bool Federation::addPeer(char const* spec) {
+    char const* equals = strchr(spec, '=');
+    if (equals == nullptr || equals == spec || equals[1] == '\0' || this->m_peers.size() >= UINT8_MAX) {
+        return false;
+    }
+    auto peer = std::make_unique<Peer>();
+    peer->endpoint.assign(spec, equals - spec);
+    peer->device = equals + 1;
+    if (!this->openPeer(peer.get())) {
+        return false;
+    }
+    this->m_peers.push_back(std::move(peer));
+    return true;
+}
+
+void Federation::addPollFds(std::vector<int>* fds) const {
+    if (this->m_memberFd >= 0) {
+        fds->push_back(this->m_memberFd);
+    }
+    if (this->m_registryFd >= 0) {
+        fds->push_back(this->m_registryFd);
+    }
+    for (auto const& peer : this->m_peers) {
+        if (peer->fd >= 0) {
+            fds->push_back(peer->fd);
+        }
+    }
+}
+
+void Federation::processInput(int fd) {
+    for (auto& peer : this->m_peers) {
+        if (peer->fd == fd) {
+            this->readPeer(peer.get(), Clock::monotonicNs() / 1000000);
+            return;
+        }
+    }
+
+    char buf[MAX_DATAGRAM + 1];
+    struct sockaddr_storage from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t len = recvfrom(fd, buf, MAX_DATAGRAM, 0, reinterpret_cast<struct sockaddr*>(&from), &fromLen);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+    uint64_t nowMs = Clock::monotonicNs() / 1000000;
+
+    if (fd == this->m_registryFd && buf[0] == 'A' && buf[1] == ' ') {
+        this->handleAdvertisement(&buf[2], nowMs);
+        this->sendDirectory(from, fromLen);
+    } else if (fd == this->m_memberFd && buf[0] == 'D' && buf[1] == '\n') {
+        this->handleDirectory(&buf[2], nowMs);
+    }
+}
+
+void Federation::poll(uint64_t nowMs) {
+    if (this->m_memberFd >= 0 && nowMs >= this->m_nextAdvertiseMs) {
+        std::string msg = "A " + this->m_endpoint;
+        for (size_t idx = 0; idx < this->m_leaseManager.numDevices(); idx++) {
+            msg += ' ';
+            msg += this->m_leaseManager.deviceName(idx);
+        }
+        // A lost advertisement is harmless - we'll send another one shortly.
+        (void)send(this->m_memberFd, msg.data(), msg.size(), 0);
+        this->m_nextAdvertiseMs = nowMs + ADVERTISE_INTERVAL_MS;
+    }
+    if (!this->m_directory.empty() && nowMs >= this->m_directoryExpiresMs) {
+        Log::info("Lost contact with the registry");
+        this->m_directory.clear();
+    }
+    for (auto it = this->m_entries.begin(); it != this->m_entries.end();) {
+        if (it->second.expiresMs <= nowMs) {
+            Log::info("Server %s left the federation", it->first.c_str());
+            it = this->m_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto& peer : this->m_peers) {
+        // Requests are forwarded in order with the same timeout, so the
+        // oldest is always the first to expire.
+        while (!peer->outstanding.empty() && peer->outstanding.front().expiresMs <= nowMs) {
+            this->fail(peer->outstanding.front(), ServerError::NOT_AVAILABLE);
+            peer->outstanding.pop_front();
+            this->m_numTimedOut++;
+        }
+        if (peer->fd < 0 && nowMs >= peer->nextOpenMs) {
+            peer->nextOpenMs = nowMs + PEER_REOPEN_MS;
+            if (this->openPeer(peer.get())) {
+                Log::info("Link to %s reopened", peer->endpoint.c_str());
+            }
+        }
+    }
+}
+
+ServerError Federation::forward(Packet const& cmd, uint64_t nowMs) {
+    PacketReader reader(cmd);
+    auto peerIdx = reader.read<uint8_t>();
+    auto command = reader.read<uint8_t>();
+    if (!reader.ok() || command == ServerCommand::ROUTE || peerIdx >= this->m_peers.size()) {
+        return ServerError::BAD_REQUEST;
+    }
+    Peer* peer = this->m_peers[peerIdx].get();
+    if (peer->fd < 0) {
+        return ServerError::NOT_AVAILABLE;
+    }
+    if (peer->outstanding.size() >= MAX_OUTSTANDING) {
+        return ServerError::OVERLOADED;
+    }
+
+    size_t len = reader.remaining();
+    peer->txPacket.setCommand(command);
+    memcpy(peer->txPacket.getData(), reader.current(), len);
+    peer->txPacket.setLength(len);
+    if (peer->bus.writePacket(peer->txPacket) != Packet::Error::NONE) {
+        this->closePeer(peer, nowMs);
+        return ServerError::NOT_AVAILABLE;
+    }
+    peer->outstanding.push_back(Forwarded{command, nowMs + PEER_TIMEOUT_MS});
+    this->m_numForwarded++;
+    return ServerError::NONE;
+}
+
+void Federation::updateMetrics(Metrics* metrics) const {
+    size_t numOutstanding = 0;
+    for (auto const& peer : this->m_peers) {
+        numOutstanding += peer->outstanding.size();
+    }
+    metrics->set("cliserver_federation_outstanding", numOutstanding);
+    metrics->set("cliserver_federation_forwarded_total", this->m_numForwarded);
+    metrics->set("cliserver_federation_relayed_total", this->m_numRelayed);
+    metrics->set("cliserver_federation_timeouts_total", this->m_numTimedOut);
+    metrics->set("cliserver_federation_unmatched_total", this->m_numUnmatched);
+}
+
+bool Federation::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::LOCATE) {
+        return false;
+    }
+    std::string name(reinterpret_cast<char const*>(cmd.getData()), cmd.getLength());
+
+    for (size_t idx = 0; idx < this->m_leaseManager.numDevices(); idx++) {
+        if (this->m_leaseManager.deviceName(idx) == name) {
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(static_cast<uint8_t>(Where::LOCAL));
+            writer.write(static_cast<uint8_t>(idx));
+            return true;
+        }
+    }
+    auto it = this->m_directory.find(name);
+    if (it == this->m_directory.end() || it->second == this->m_endpoint) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return true;
+    }
+    for (size_t idx = 0; idx < this->m_peers.size(); idx++) {
+        if (this->m_peers[idx]->endpoint == it->second) {
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(static_cast<uint8_t>(Where::ROUTED));
+            writer.write(static_cast<uint8_t>(idx));
+            return true;
+        }
+    }
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(static_cast<uint8_t>(Where::REMOTE));
+    writer.append(it->second.data(), it->second.size());
+    return true;
+}
+
+void Federation::handleAdvertisement(char const* text, uint64_t nowMs) {
+    char const* space = strchrnul(text, ' ');
+    std::string endpoint(text, space - text);
+    if (endpoint.empty()) {
+        return;
+    }
+    if (this->m_entries.find(endpoint) == this->m_entries.end()) {
+        Log::info("Server %s joined the federation", endpoint.c_str());
+    }
+    Entry& entry = this->m_entries[endpoint];
+    entry.devices = *space == ' ' ? space + 1 : "";
+    entry.expiresMs = nowMs + ENTRY_TTL_MS;
+}
+
+void Federation::sendDirectory(struct sockaddr_storage const& to, socklen_t toLen) {
+    std::string msg = "D\n";
+    for (auto const& [endpoint, entry] : this->m_entries) {
+        size_t lineLen = endpoint.size() + 1 + entry.devices.size() + 1;
+        if (msg.size() + lineLen > MAX_DATAGRAM) {
+            Log::warning("Directory too large, some servers omitted");
+            break;
+        }
+        msg += endpoint;
+        msg += ' ';
+        msg += entry.devices;
+        msg += '\n';
+    }
+    (void)sendto(
+        this->m_registryFd, msg.data(), msg.size(), 0, reinterpret_cast<struct sockaddr const*>(&to),
+        toLen);
+}
+
+void Federation::handleDirectory(char const* text, uint64_t nowMs) {
+    this->m_directory.clear();
+    while (*text != '\0') {
+        char const* eol = strchrnul(text, '\n');
+        std::string line(text, eol - text);
+        text = *eol == '\n' ? eol + 1 : eol;
+
+        size_t pos = line.find(' ');
+        std::string endpoint = line.substr(0, pos);
+        while (pos != std::string::npos) {
+            size_t next = line.find(' ', pos + 1);
+            std::string device = line.substr(pos + 1, next == std::string::npos ? next : next - pos - 1);
+            if (!device.empty()) {
+                this->m_directory[device] = endpoint;
+            }
+            pos = next;
+        }
+    }
+    this->m_directoryExpiresMs = nowMs + ENTRY_TTL_MS;
+}
+
+bool Federation::openPeer(Peer* peer) {
+    if (peer->bus.open(peer->device.c_str(), PEER_BAUD) != IBus::Error::NONE) {
+        Log::error("Unable to open link to %s on %s", peer->endpoint.c_str(), peer->device.c_str());
+        return false;
+    }
+    peer->fd = peer->bus.serial();
+    return true;
+}
+
+void Federation::closePeer(Peer* peer, uint64_t nowMs) {
+    Log::warning("Link to %s went away", peer->endpoint.c_str());
+    peer->bus.close();
+    peer->fd = -1;
+    peer->nextOpenMs = nowMs + PEER_REOPEN_MS;
+    for (auto const& request : peer->outstanding) {
+        this->fail(request, ServerError::NOT_AVAILABLE);
+    }
+    peer->outstanding.clear();
+}
+
+void Federation::readPeer(Peer* peer, uint64_t nowMs) {
+    // Readable with nothing to read means that the other end went away.
+    int numBytes = 0;
+    if (ioctl(peer->fd, FIONREAD, &numBytes) < 0 || numBytes < 1) {
+        this->closePeer(peer, nowMs);
+        return;
+    }
+    for (int i = 0; i < numBytes; i++) {
+        if (auto rc = peer->bus.processByte(); rc != Packet::Error::NONE) {
+            if (rc != Packet::Error::NOT_DONE) {
+                Log::error("Error processing packet from %s: %s", peer->endpoint.c_str(), as_str(rc));
+            }
+            continue;
+        }
+        this->handlePeerPacket(peer);
+    }
+}
+
+void Federation::handlePeerPacket(Peer* peer) {
+    Packet const& rx = peer->rxPacket;
+
+    // The other server probes us like any other client when we're quiet.
+    if (rx.getCommand() == ServerCommand::PROBE && !HealthMonitor::isProbeReply(rx)) {
+        PacketReader reader(rx);
+        reader.read<uint8_t>();
+        auto seq = reader.read<uint8_t>();
+        PacketWriter writer(&peer->txPacket, ServerCommand::PROBE);
+        writer.write(HealthMonitor::PROBE_REPLY);
+        writer.write(seq);
+        peer->bus.writePacket(peer->txPacket);
+        return;
+    }
+
+    uint8_t command = rx.getCommand();
+    if (command == ServerCommand::ERROR && rx.getLength() >= 1) {
+        command = rx.getData()[0];
+    }
+    auto request = std::find_if(
+        peer->outstanding.begin(), peer->outstanding.end(),
+        [command](Forwarded const& fwd) { return fwd.command == command; });
+    if (request == peer->outstanding.end()) {
+        // Something the other server sent on its own (i.e. a trigger).
+        this->m_numUnmatched++;
+        return;
+    }
+    peer->outstanding.erase(request);
+    this->m_outbox->send(rx.getCommand(), rx.getData(), rx.getLength());
+    this->m_numRelayed++;
+}
+
+void Federation::fail(Forwarded const& request, ServerError err) {
+    uint8_t data[] = {request.command, static_cast<uint8_t>(err)};
+    this->m_outbox->send(ServerCommand::ERROR, data, sizeof(data));
+}
@@ -0,0 +1,231 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Federation.h
+ *
+ *   @brief  Lets several CliServer instances share a directory of devices.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+#include "LinuxSerialBus.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+class LeaseManager;
+class Metrics;
+class Outbox;
+
+//! @brief Advertises local devices to a registry and locates remote ones.
+//!
+//! @details Each instance periodically sends its endpoint and device names
+//!          to the registry in a single UDP datagram. The registry replies
+//!          with the whole directory, so every instance has an up to date
+//!          copy and LOCATE can be answered without a round trip. Any
+//!          instance can also act as the registry (--registry-serve).
+//!
+//!          Datagrams are text, one record per line:
+//!              A <endpoint> <device>...     advertisement (instance -> registry)
+//!              D                            directory header (registry -> instance)
+//!              <endpoint> <device>...       one line per live instance
+//!
+//!          LOCATE: name -> uint8_t where, then
+//!                  where == LOCAL:  uint8_t device
+//!                  where == REMOTE: endpoint ("host:port")
+//!                  where == ROUTED: uint8_t peer
+//!          ROUTE:  uint8_t peer, uint8_t command, data
+//!                  -> response to command, relayed from the peer
+//!
+//!          Requests for devices on another server are forwarded over a
+//!          persistent link to that server (--peer), so clients only need
+//!          to talk to one server. The bus library can only open the
+//!          client side of a link on a serial device, so the link is a
+//!          pseudo terminal which socat connects to the other server's TCP
+//!          port, i.e.
+//!              socat pty,raw,echo=0,link=/tmp/peer0 tcp:host:port
+//!          and the other server treats us like any other client.
+//!
+//!          A client which finds a device is ROUTED wraps each request for
+//!          it (typically a DEVICE_REQUEST) in ROUTE. The wrapped request is
+//!          written to the peer straight away, without waiting for earlier
+//!          ones to be answered, and the peer's response is relayed back
+//!          to the client unchanged. The peer answers in order, except that
+//!          it may reject a request with an ERROR early, so responses are
+//!          matched to the oldest outstanding request with the same command
+//!          (the command embedded in an ERROR). A request which isn't
+//!          answered within PEER_TIMEOUT_MS, or whose link goes down, is
+//!          answered with a NOT_AVAILABLE error. Devices on servers we have
+//!          no link to are still reported as REMOTE, and the client has to
+//!          connect to that server itself.
+class Federation : public IPacketHandler {
+ public:
+    //! Where a located device lives.
+    enum class Where : uint8_t {
+        LOCAL = 0,   //!< The device is managed by this server.
+        REMOTE = 1,  //!< The device is managed by another server.
+        ROUTED = 2,  //!< The device is managed by a server we forward to.
+    };
+
+    //! Most requests which can be waiting for an answer from a peer.
+    static constexpr size_t MAX_OUTSTANDING = 32;
+
+    //! Forwarded requests which aren't answered within this time fail.
+    static constexpr uint64_t PEER_TIMEOUT_MS = 5000;
+
+    //! How often to try reopening a peer link which went away.
+    static constexpr uint64_t PEER_REOPEN_MS = 1000;
+
+    //! How often each instance advertises itself.
+    static constexpr uint64_t ADVERTISE_INTERVAL_MS = 2000;
+
+    //! Instances which haven't advertised within this time are dropped.
+    static constexpr uint64_t ENTRY_TTL_MS = 3 * ADVERTISE_INTERVAL_MS;
+
+    //! @brief Constructor.
+    Federation(
+        LeaseManager const& leaseManager,  //!< [in] Local devices to advertise.
+        Outbox* outbox                     //!< [in] Used to relay responses from peers.
+    )
+        : m_leaseManager(leaseManager), m_outbox(outbox) {}
+
+    //! @brief Destructor. Closes the sockets.
+    ~Federation() override;
+
+    Federation(Federation const&) = delete;
+    Federation& operator=(Federation const&) = delete;
+
+    //! @brief Starts advertising to a registry.
+    //! @returns true if the registry address could be resolved.
+    bool join(
+        char const* registry,  //!< [in] "host:port" of the registry.
+        char const* endpoint   //!< [in] "host:port" clients use to reach us.
+    );
+
+    //! @brief Also acts as the registry, listening on the given UDP port.
+    //! @returns true if the port could be bound.
+    bool serve(
+        char const* port  //!< [in] UDP port to listen on.
+    );
+
+    //! @brief Opens a link which requests for another server are forwarded over.
+    //! @details spec has the form "endpoint=device", where endpoint is the
+    //!          other server's advertised endpoint and device is the pseudo
+    //!          terminal connected to it.
+    //! @returns false if spec is malformed or the device couldn't be opened.
+    bool addPeer(
+        char const* spec  //!< [in] Peer specification.
+    );
+
+    //! @returns true if this instance is part of a federation.
+    bool isActive() const {
+        return this->m_memberFd >= 0 || this->m_registryFd >= 0 || !this->m_peers.empty();
+    }
+
+    //! @brief Appends the sockets which need to be polled to fds.
+    void addPollFds(
+        std::vector<int>* fds  //!< [out] File descriptors to poll for input.
+    ) const;
+
+    //! @brief Reads any pending datagram, or peer response, from fd.
+    void processInput(
+        int fd  //!< [in] Socket which poll reported as readable.
+    );
+
+    //! @brief Sends advertisements, expires stale directory entries and
+    //!        forwarded requests, and reopens peer links.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Forwards a ROUTE request to its peer.
+    //! @details The response is relayed through the outbox once the peer
+    //!          answers, so nothing should be written for the request now.
+    //! @returns ServerError::NONE if the request was forwarded, otherwise
+    //!          the error to answer it with.
+    ServerError forward(
+        Packet const& cmd,  //!< [in] ROUTE request.
+        uint64_t nowMs      //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Publishes the number of requests forwarded and how they ended.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+    //! @brief Handles the LOCATE command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! Devices advertised by an instance, as seen by the registry.
+    struct Entry {
+        std::string devices;    //!< Space separated device names.
+        uint64_t expiresMs;     //!< When the entry expires.
+    };
+
+    //! A request forwarded to a peer which hasn't been answered yet.
+    struct Forwarded {
+        uint8_t command;        //!< Command of the request.
+        uint64_t expiresMs;     //!< When to give up on the answer.
+    };
+
+    //! A link to another server.
+    struct Peer {
+        std::string endpoint;                               //!< Endpoint of the other server.
+        std::string device;                                 //!< Pseudo terminal connected to it.
+        uint8_t rxData[MAX_PACKET_DATA_LEN];                //!< Data of rxPacket.
+        uint8_t txData[MAX_PACKET_DATA_LEN];                //!< Data of txPacket.
+        Packet rxPacket{MAX_PACKET_DATA_LEN, rxData};       //!< Packet received from the peer.
+        Packet txPacket{MAX_PACKET_DATA_LEN, txData};       //!< Packet sent to the peer.
+        LinuxSerialBus bus{&rxPacket, &txPacket};           //!< Frames packets on the link.
+        int fd = -1;                                        //!< Link, or -1 while it's down.
+        uint64_t nextOpenMs = 0;                            //!< When to try reopening the link.
+        std::deque<Forwarded> outstanding;                  //!< Requests waiting for answers, oldest first.
+    };
+
+    void handleAdvertisement(char const* text, uint64_t nowMs);
+    void sendDirectory(struct sockaddr_storage const& to, socklen_t toLen);
+    void handleDirectory(char const* text, uint64_t nowMs);
+    bool openPeer(Peer* peer);
+    void closePeer(Peer* peer, uint64_t nowMs);
+    void readPeer(Peer* peer, uint64_t nowMs);
+    void handlePeerPacket(Peer* peer);
+    void fail(Forwarded const& request, ServerError err);
+
+    LeaseManager const& m_leaseManager;          //!< Local devices.
+    Outbox* m_outbox;                            //!< Used to relay responses from peers.
+    std::string m_endpoint;                      //!< Our advertised endpoint.
+    int m_memberFd = -1;                         //!< Socket connected to the registry.
+    uint64_t m_nextAdvertiseMs = 0;              //!< When to advertise next.
+    uint64_t m_directoryExpiresMs = 0;           //!< When our copy of the directory goes stale.
+    int m_registryFd = -1;                       //!< Socket used when acting as the registry.
+    std::map<std::string, Entry> m_entries;      //!< Registry: endpoint -> devices.
+    std::map<std::string, std::string> m_directory;  //!< Member: device -> endpoint.
+    std::vector<std::unique_ptr<Peer>> m_peers;  //!< Links requests are forwarded over.
+    uint64_t m_numForwarded = 0;                 //!< Requests forwarded to peers.
+    uint64_t m_numRelayed = 0;                   //!< Responses relayed back to clients.
+    uint64_t m_numTimedOut = 0;                  //!< Forwarded requests which were never answered.
+    uint64_t m_numUnmatched = 0;                 //!< Peer packets which didn't answer anything.
+};
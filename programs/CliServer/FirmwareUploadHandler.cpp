@@ -0,0 +1,228 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   FirmwareUploadHandler.cpp
+ *
+ *   @brief  Receives firmware images using a windowed, pipelined protocol.
+ *
+ ****************************************************************************/
+
+#include "FirmwareUploadHandler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Crc32.h"
+#include "Log.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+FirmwareUploadHandler::~FirmwareUploadHandler() {
+    this->abandon();
+}
+
+bool FirmwareUploadHandler::handlePacket(Packet const& cmd, Packet* rsp) {
+    switch (cmd.getCommand()) {
+        case ServerCommand::FW_BEGIN: {
+            this->begin(cmd, rsp);
+            return true;
+        }
+        case ServerCommand::FW_DATA: {
+            this->data(cmd, rsp);
+            return true;
+        }
+        case ServerCommand::FW_STATUS: {
+            this->status(cmd, rsp);
+            return true;
+        }
+        case ServerCommand::FW_FINISH: {
+            this->finish(cmd, rsp);
+            return true;
+        }
+    }
+    return false;
+}
+
+void FirmwareUploadHandler::begin(Packet const& cmd, Packet* rsp) {
+    PacketReader reader(cmd);
+    auto size = reader.read<uint32_t>();
+    auto chunkSize = reader.read<uint8_t>();
+    auto crc = reader.read<uint32_t>();
+
+    if (this->m_fileName.empty()) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return;
+    }
+    // FW_DATA needs room for the chunk index in front of the chunk.
+    uint32_t numChunks = chunkSize == 0 ? 0 : (size + chunkSize - 1) / chunkSize;
+    if (!reader.ok() || size == 0 || size > MAX_IMAGE_SIZE || chunkSize == 0 ||
+        chunkSize + sizeof(uint16_t) > PacketWriter::maxLength(cmd) || numChunks > UINT16_MAX) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+
+    this->abandon();
+
+    std::string partialName = this->m_fileName + ".partial";
+    this->m_fd = open(partialName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (this->m_fd < 0) {
+        Log::error("Unable to create '%s': %s", partialName.c_str(), strerror(errno));
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::OS);
+        return;
+    }
+    if (ftruncate(this->m_fd, size) < 0) {
+        Log::error("Unable to size '%s': %s", partialName.c_str(), strerror(errno));
+        this->abandon();
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::OS);
+        return;
+    }
+    void* image = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->m_fd, 0);
+    if (image == MAP_FAILED) {
+        Log::error("Unable to map '%s': %s", partialName.c_str(), strerror(errno));
+        this->abandon();
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::OS);
+        return;
+    }
+
+    this->m_image = static_cast<uint8_t*>(image);
+    this->m_size = size;
+    this->m_chunkSize = chunkSize;
+    this->m_numChunks = static_cast<uint16_t>(numChunks);
+    this->m_expectedCrc = crc;
+    this->m_received.assign(numChunks, false);
+    this->m_ackIndex = 0;
+    this->m_numReceived = 0;
+
+    Log::info("Firmware upload started: %u bytes in %u chunks", size, numChunks);
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(WINDOW_SIZE);
+    writer.write(this->m_numChunks);
+}
+
+void FirmwareUploadHandler::data(Packet const& cmd, Packet* rsp) {
+    if (this->m_image == nullptr) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return;
+    }
+    PacketReader reader(cmd);
+    auto chunkIndex = reader.read<uint16_t>();
+    if (!reader.ok() || chunkIndex >= this->m_numChunks) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+    size_t offset = static_cast<size_t>(chunkIndex) * this->m_chunkSize;
+    size_t len = std::min<size_t>(this->m_chunkSize, this->m_size - offset);
+
+    // Chunks outside of the window, duplicates, and short chunks are dropped.
+    // The acknowledgement tells the uploader what we still need.
+    if (chunkIndex < this->m_ackIndex + WINDOW_SIZE && !this->m_received[chunkIndex] &&
+        reader.remaining() == len) {
+        memcpy(&this->m_image[offset], reader.current(), len);
+        this->m_received[chunkIndex] = true;
+        this->m_numReceived++;
+        this->advanceAck();
+    }
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    this->writeAck(&writer);
+}
+
+void FirmwareUploadHandler::status(Packet const& cmd, Packet* rsp) {
+    if (this->m_image == nullptr) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return;
+    }
+    uint32_t bytesReceived = 0;
+    for (uint16_t chunk = 0; chunk < this->m_numChunks; chunk++) {
+        if (this->m_received[chunk]) {
+            size_t offset = static_cast<size_t>(chunk) * this->m_chunkSize;
+            bytesReceived += std::min<size_t>(this->m_chunkSize, this->m_size - offset);
+        }
+    }
+    PacketWriter writer(rsp, cmd.getCommand());
+    this->writeAck(&writer);
+    writer.write(bytesReceived);
+    writer.write(this->m_size);
+}
+
+void FirmwareUploadHandler::finish(Packet const& cmd, Packet* rsp) {
+    if (this->m_image == nullptr) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return;
+    }
+    if (this->m_numReceived != this->m_numChunks) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+    uint32_t crc = Crc32::calc(this->m_image, this->m_size);
+    if (crc != this->m_expectedCrc) {
+        Log::error(
+            "Firmware CRC mismatch: got 0x%08x, expected 0x%08x", crc, this->m_expectedCrc);
+        this->abandon();
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::CRC);
+        return;
+    }
+
+    std::string partialName = this->m_fileName + ".partial";
+    if (msync(this->m_image, this->m_size, MS_SYNC) < 0 ||
+        rename(partialName.c_str(), this->m_fileName.c_str()) < 0) {
+        Log::error("Unable to commit '%s': %s", this->m_fileName.c_str(), strerror(errno));
+        this->abandon();
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::OS);
+        return;
+    }
+    Log::info("Firmware upload complete: %u bytes, CRC 0x%08x", this->m_size, crc);
+
+    munmap(this->m_image, this->m_size);
+    this->m_image = nullptr;
+    close(this->m_fd);
+    this->m_fd = -1;
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(crc);
+}
+
+void FirmwareUploadHandler::writeAck(PacketWriter* writer) const {
+    uint32_t bitmap = 0;
+    for (uint32_t bit = 0; bit < 32; bit++) {
+        uint32_t chunk = this->m_ackIndex + 1 + bit;
+        if (chunk < this->m_numChunks && this->m_received[chunk]) {
+            bitmap |= 1u << bit;
+        }
+    }
+    writer->write(this->m_ackIndex);
+    writer->write(bitmap);
+    writer->write(this->m_numReceived);
+}
+
+void FirmwareUploadHandler::advanceAck() {
+    while (this->m_ackIndex < this->m_numChunks && this->m_received[this->m_ackIndex]) {
+        this->m_ackIndex++;
+    }
+}
+
+void FirmwareUploadHandler::abandon() {
+    if (this->m_image != nullptr) {
+        munmap(this->m_image, this->m_size);
+        this->m_image = nullptr;
+    }
+    if (this->m_fd >= 0) {
+        close(this->m_fd);
+        this->m_fd = -1;
+        unlink((this->m_fileName + ".partial").c_str());
+    }
+}
@@ -0,0 +1,100 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   FirmwareUploadHandler.h
+ *
+ *   @brief  Receives firmware images using a windowed, pipelined protocol.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+
+class PacketWriter;
+
+//! @brief Handles the FW_BEGIN, FW_DATA, FW_STATUS and FW_FINISH commands.
+//!
+//! @details Rather than waiting for each chunk to be acknowledged before
+//!          sending the next one, the uploader may have up to WINDOW_SIZE
+//!          chunks in flight. Every FW_DATA response carries a selective
+//!          acknowledgement:
+//!
+//!              uint16_t ackIndex     (first chunk not yet received)
+//!              uint32_t ackBitmap    (bit n set: chunk ackIndex + 1 + n received)
+//!              uint16_t numReceived
+//!
+//!          so the uploader only needs to retransmit the chunks which were
+//!          actually lost. The image is written through a shared mapping of
+//!          "<file>.partial", and once FW_FINISH has verified the CRC-32 of
+//!          the whole image the file is renamed into place.
+//!
+//!          FW_BEGIN:  uint32_t size, uint8_t chunkSize, uint32_t crc
+//!                     -> uint16_t windowSize, uint16_t numChunks
+//!          FW_DATA:   uint16_t chunkIndex, chunk data -> ack
+//!          FW_STATUS: -> ack, uint32_t bytesReceived, uint32_t size
+//!          FW_FINISH: -> uint32_t crc
+class FirmwareUploadHandler : public IPacketHandler {
+ public:
+    //! Maximum number of chunks which may be in flight past ackIndex.
+    static constexpr uint16_t WINDOW_SIZE = 33;
+
+    //! Largest image which may be uploaded.
+    static constexpr uint32_t MAX_IMAGE_SIZE = 64 * 1024 * 1024;
+
+    //! @brief Constructor.
+    FirmwareUploadHandler() = default;
+
+    //! @brief Destructor. Abandons any upload in progress.
+    ~FirmwareUploadHandler() override;
+
+    FirmwareUploadHandler(FirmwareUploadHandler const&) = delete;
+    FirmwareUploadHandler& operator=(FirmwareUploadHandler const&) = delete;
+
+    //! @brief Sets the file that uploaded images are written to.
+    //! @details Uploads are rejected until a file has been set.
+    void setFileName(
+        char const* fileName  //!< [in] File to write the firmware image to.
+    ) {
+        this->m_fileName = fileName;
+    }
+
+    //! @brief Handles the firmware upload commands.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    void begin(Packet const& cmd, Packet* rsp);
+    void data(Packet const& cmd, Packet* rsp);
+    void status(Packet const& cmd, Packet* rsp);
+    void finish(Packet const& cmd, Packet* rsp);
+    void writeAck(PacketWriter* writer) const;
+    void advanceAck();
+    void abandon();
+
+    std::string m_fileName;             //!< File the image is written to.
+    int m_fd = -1;                      //!< File descriptor of the partial image.
+    uint8_t* m_image = nullptr;         //!< Mapping of the partial image.
+    uint32_t m_size = 0;                //!< Size of the image, in bytes.
+    uint8_t m_chunkSize = 0;            //!< Bytes per chunk.
+    uint16_t m_numChunks = 0;           //!< Number of chunks in the image.
+    uint32_t m_expectedCrc = 0;         //!< CRC-32 that the image should have.
+    std::vector<bool> m_received;       //!< Which chunks have been received.
+    uint16_t m_ackIndex = 0;            //!< First chunk not yet received.
+    uint16_t m_numReceived = 0;         //!< Number of distinct chunks received.
+};
@@ -0,0 +1,130 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   FlowControl.cpp
+ *
+ *   @brief  Configures serial flow control and throttles writes on overruns.
+ *
+ ****************************************************************************/
+
+#include "FlowControl.h"
+
+#include <errno.h>
+#include <linux/serial.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#include <algorithm>
+
+#include "Log.h"
+#include "Metrics.h"
+
+bool FlowControl::setMode(char const* modeStr) {
+    if (strcmp(modeStr, "none") == 0) {
+        this->m_mode = Mode::NONE;
+    } else if (strcmp(modeStr, "rtscts") == 0) {
+        this->m_mode = Mode::RTSCTS;
+    } else if (strcmp(modeStr, "xonxoff") == 0) {
+        Log::error("XON/XOFF would drop the 0x11 and 0x13 bytes in binary packets, use rtscts");
+        return false;
+    } else {
+        return false;
+    }
+    this->m_enabled = true;
+    return true;
+}
+
+bool FlowControl::apply(int fd) {
+    if (!this->m_enabled) {
+        return true;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        Log::error("Unable to get serial attributes: %s", strerror(errno));
+        return false;
+    }
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    switch (this->m_mode) {
+        case Mode::NONE: {
+            break;
+        }
+        case Mode::RTSCTS: {
+            tio.c_cflag |= CRTSCTS;
+            break;
+        }
+    }
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        Log::error("Unable to set flow control: %s", strerror(errno));
+        return false;
+    }
+
+    // The counters belong to the port, so they carry on across a reopen.
+    this->m_haveCounters = this->readCounters(fd, &this->m_lastOverruns, &this->m_lastLineErrors);
+    if (!this->m_haveCounters) {
+        Log::warning("Serial driver doesn't report overruns; write throttling is disabled");
+    }
+    return true;
+}
+
+void FlowControl::poll(int fd) {
+    if (!this->m_haveCounters) {
+        return;
+    }
+    uint32_t overruns;
+    uint32_t lineErrors;
+    if (!this->readCounters(fd, &overruns, &lineErrors)) {
+        return;
+    }
+    uint32_t newOverruns = overruns - this->m_lastOverruns;
+    this->m_overruns += newOverruns;
+    this->m_lineErrors += lineErrors - this->m_lastLineErrors;
+    this->m_lastOverruns = overruns;
+    this->m_lastLineErrors = lineErrors;
+
+    if (newOverruns > 0) {
+        uint64_t gapUs = std::clamp(this->m_gapUs * 2, MIN_GAP_US, MAX_GAP_US);
+        if (this->m_gapUs == 0) {
+            Log::warning("Serial overruns detected, throttling writes");
+        }
+        this->m_gapUs = gapUs;
+    } else if (this->m_gapUs != 0) {
+        this->m_gapUs /= 2;
+        if (this->m_gapUs < MIN_GAP_US) {
+            Log::info("No more serial overruns, no longer throttling writes");
+            this->m_gapUs = 0;
+        }
+    }
+}
+
+uint64_t FlowControl::waitUs(uint64_t nowNs) const {
+    uint64_t nextWriteNs = this->m_lastWriteNs + this->m_gapUs * 1000;
+    if (this->m_gapUs == 0 || nowNs >= nextWriteNs) {
+        return 0;
+    }
+    return (nextWriteNs - nowNs + 999) / 1000;
+}
+
+void FlowControl::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_serial_overruns_total", this->m_overruns);
+    metrics->set("cliserver_serial_line_errors_total", this->m_lineErrors);
+    metrics->set("cliserver_serial_write_gap_us", this->m_gapUs);
+}
+
+bool FlowControl::readCounters(int fd, uint32_t* overruns, uint32_t* lineErrors) {
+    struct serial_icounter_struct counters;
+    if (ioctl(fd, TIOCGICOUNT, &counters) < 0) {
+        return false;
+    }
+    *overruns = static_cast<uint32_t>(counters.overrun + counters.buf_overrun);
+    *lineErrors = static_cast<uint32_t>(counters.frame + counters.parity);
+    return true;
+}
@@ -0,0 +1,101 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   FlowControl.h
+ *
+ *   @brief  Configures serial flow control and throttles writes on overruns.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+class Metrics;
+
+//! @brief Flow control and overrun handling for a serial port.
+//!
+//! @details LinuxSerialBus only sets the baud rate, so the flow control mode
+//!          is applied to the serial port after each time it's opened.
+//!
+//!          Software (XON/XOFF) flow control isn't supported. Packets are
+//!          binary, so the driver would swallow every 0x11 and 0x13 byte in
+//!          them. Applying either mode turns IXON and IXOFF off.
+//!
+//!          The kernel's interrupt counters (TIOCGICOUNT) are checked every
+//!          poll. New hardware or buffer overruns mean bytes were dropped, so
+//!          a gap is inserted between the packets written by the server. The
+//!          gap starts at MIN_GAP_US and doubles with each poll that sees
+//!          more overruns, up to MAX_GAP_US. It halves with each poll that
+//!          doesn't, and is removed once it drops below MIN_GAP_US.
+class FlowControl {
+ public:
+    //! How the flow of data is controlled.
+    enum class Mode : uint8_t {
+        NONE,     //!< No flow control.
+        RTSCTS,   //!< Hardware flow control using the RTS and CTS lines.
+    };
+
+    //! Smallest gap inserted between writes once overruns are seen.
+    static constexpr uint64_t MIN_GAP_US = 500;
+
+    //! Largest gap inserted between writes.
+    static constexpr uint64_t MAX_GAP_US = 50000;
+
+    //! @brief Sets the flow control mode.
+    //! @returns false if the mode wasn't recognized.
+    bool setMode(
+        char const* modeStr  //!< [in] Either "none" or "rtscts".
+    );
+
+    //! @returns true if flow control was configured.
+    bool isEnabled() const { return this->m_enabled; }
+
+    //! @brief Applies the flow control mode to a newly opened serial port.
+    //! @returns false if the serial port couldn't be configured.
+    bool apply(
+        int fd  //!< [in] File descriptor of the serial port.
+    );
+
+    //! @brief Checks for overruns and adjusts the write gap.
+    void poll(
+        int fd  //!< [in] File descriptor of the serial port.
+    );
+
+    //! @returns the number of microseconds until the next write is allowed.
+    uint64_t waitUs(
+        uint64_t nowNs  //!< [in] Current time (monotonic nanoseconds).
+    ) const;
+
+    //! @brief Records that a packet was written.
+    void noteWrite(
+        uint64_t nowNs  //!< [in] Current time (monotonic nanoseconds).
+    ) {
+        this->m_lastWriteNs = nowNs;
+    }
+
+    //! @brief Publishes the error counters and the current write gap.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    bool readCounters(int fd, uint32_t* overruns, uint32_t* lineErrors);
+
+    bool m_enabled = false;         //!< Has flow control been configured?
+    Mode m_mode = Mode::NONE;       //!< Flow control mode.
+    bool m_haveCounters = false;    //!< Does the driver support TIOCGICOUNT?
+    uint32_t m_lastOverruns = 0;    //!< Overrun counter at the last poll.
+    uint32_t m_lastLineErrors = 0;  //!< Frame and parity counter at the last poll.
+    uint64_t m_overruns = 0;        //!< Overruns seen since startup.
+    uint64_t m_lineErrors = 0;      //!< Frame and parity errors seen since startup.
+    uint64_t m_gapUs = 0;           //!< Gap inserted between writes.
+    uint64_t m_lastWriteNs = 0;     //!< When the last packet was written.
+};
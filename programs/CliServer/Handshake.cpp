@@ -0,0 +1,75 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Handshake.cpp
+ *
+ *   @brief  Negotiates protocol capabilities with the client.
+ *
+ ****************************************************************************/
+
+#include "Handshake.h"
+
+#include <algorithm>
+
+#include "Log.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+void Handshake::reset() {
+    this->m_current = LEGACY;
+    this->m_negotiated = false;
+    PacketWriter::setLimit(LEGACY.maxPacketSize);
+}
+
+ServerError Handshake::admit(Packet const& cmd, size_t numOutstanding) const {
+    if (!this->m_negotiated) {
+        return ServerError::NONE;
+    }
+    if (cmd.getLength() > this->m_current.maxPacketSize) {
+        return ServerError::TOO_BIG;
+    }
+    if (numOutstanding >= this->m_current.window) {
+        return ServerError::OVERLOADED;
+    }
+    return ServerError::NONE;
+}
+
+bool Handshake::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::HELLO) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    uint8_t version = reader.read<uint8_t>();
+    Capabilities proposed;
+    proposed.maxPacketSize = reader.read<uint16_t>();
+    proposed.window = reader.read<uint8_t>();
+    proposed.features = reader.read<uint8_t>();
+    if (!reader.ok() || version == 0 || proposed.maxPacketSize == 0 || proposed.window == 0) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return true;
+    }
+
+    // Newer clients may have more to say, which this version ignores.
+    this->m_current.maxPacketSize = std::min(proposed.maxPacketSize, this->m_offered.maxPacketSize);
+    this->m_current.window = std::min(proposed.window, this->m_offered.window);
+    this->m_current.features = proposed.features & this->m_offered.features;
+    this->m_negotiated = true;
+    PacketWriter::setLimit(this->m_current.maxPacketSize);
+    Log::info(
+        "Client v%u negotiated packet size %u, window %u, features 0x%02x", version,
+        this->m_current.maxPacketSize, this->m_current.window, this->m_current.features);
+
+    PacketWriter writer(rsp, ServerCommand::HELLO);
+    writer.write(std::min(version, VERSION));
+    writer.write(this->m_current.maxPacketSize);
+    writer.write(this->m_current.window);
+    writer.write(this->m_current.features);
+    return true;
+}
@@ -0,0 +1,116 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Handshake.h
+ *
+ *   @brief  Negotiates protocol capabilities with the client.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Bus.h"
+#include "ServerCommand.h"
+
+//! @brief Optional protocol features which are negotiated per client.
+namespace Feature {
+
+//! Only features which are implemented are defined (and so can be offered).
+//! 0x01, 0x02 and 0x04 are reserved.
+enum : uint8_t {
+    SERVER_TIMING = 0x08,  //!< Each response is followed by a TIMING packet.
+};
+
+}  // namespace Feature
+
+//! @brief Protocol parameters in effect for the current client.
+struct Capabilities {
+    uint16_t maxPacketSize;  //!< Largest packet data either side will send.
+    uint8_t window;          //!< Number of requests the client may have outstanding.
+    uint8_t features;        //!< Feature flags which both sides support.
+
+    //! @returns true if the feature was negotiated.
+    bool has(uint8_t feature) const { return (this->features & feature) != 0; }
+};
+
+//! @brief Handles the HELLO exchange which clients send when they connect.
+//!
+//! @details The client proposes the parameters it can handle and the server
+//!          answers with the values which will actually be used: the smaller
+//!          of the two sizes and windows, and only the features that both
+//!          sides support. Clients which never send HELLO (everything written
+//!          before it existed) get the LEGACY parameters, which describe the
+//!          protocol as it was, so per client features are only ever turned
+//!          on for clients which asked for them.
+//!
+//!          Once negotiated, the limits are enforced: a request bigger than
+//!          the packet size is rejected with TOO_BIG, and a request which
+//!          arrives while window requests are already waiting is rejected
+//!          with OVERLOADED. Responses are never filled beyond the packet
+//!          size either, since the handlers build them with PacketWriter,
+//!          which is limited to it. Legacy clients keep the old behaviour.
+//!
+//!          HELLO: uint8_t version, uint16_t maxPacketSize, uint8_t window,
+//!                 uint8_t features
+//!              -> uint8_t version, uint16_t maxPacketSize, uint8_t window,
+//!                 uint8_t features
+class Handshake : public IPacketHandler {
+ public:
+    //! Version of the HELLO exchange implemented by the server.
+    static constexpr uint8_t VERSION = 1;
+
+    //! Parameters used for clients which don't send HELLO.
+    static constexpr Capabilities LEGACY = {256, 1, 0};
+
+    //! @brief Constructor.
+    Handshake(
+        uint16_t maxPacketSize,  //!< [in] Largest packet the server can handle.
+        uint8_t window           //!< [in] Number of requests the server can queue.
+    )
+        : m_offered{maxPacketSize, window, 0} {}
+
+    //! @brief Adds to the features offered to clients.
+    void offer(
+        uint8_t features  //!< [in] Feature flags to offer.
+    ) {
+        this->m_offered.features |= features;
+    }
+
+    //! @returns the parameters in effect for the current client.
+    Capabilities const& current() const { return this->m_current; }
+
+    //! @returns true if the current client completed the handshake.
+    bool isNegotiated() const { return this->m_negotiated; }
+
+    //! @brief Forgets the negotiated parameters (i.e. the client went away).
+    void reset();
+
+    //! @brief Checks a request against the negotiated limits.
+    //! @returns ServerError::NONE if the request may be queued.
+    ServerError admit(
+        Packet const& cmd,       //!< [in] Request which was parsed.
+        size_t numOutstanding    //!< [in] Requests waiting to be handled.
+    ) const;
+
+    //! @brief Handles the HELLO command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    Capabilities m_offered;               //!< What the server supports.
+    Capabilities m_current = LEGACY;      //!< What is in effect.
+    bool m_negotiated = false;            //!< Has HELLO been received?
+};
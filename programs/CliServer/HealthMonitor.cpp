@@ -0,0 +1,118 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   HealthMonitor.cpp
+ *
+ *   @brief  Tracks whether the other end of the link is alive.
+ *
+ ****************************************************************************/
+
+#include "HealthMonitor.h"
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+void HealthMonitor::noteActivity(uint64_t nowMs) {
+    this->m_lastRxMs = nowMs;
+    this->m_probeOutstanding = false;
+    this->m_consecutiveMisses = 0;
+    if (this->m_state != State::UP) {
+        if (this->m_state == State::SUSPECT || this->m_state == State::DOWN) {
+            Log::info("Link is up again");
+        }
+        this->m_state = State::UP;
+    }
+}
+
+void HealthMonitor::noteLinkDown() {
+    this->m_state = State::DOWN;
+    this->m_probeOutstanding = false;
+}
+
+bool HealthMonitor::isProbeReply(Packet const& cmd) {
+    return cmd.getCommand() == ServerCommand::PROBE && cmd.getLength() >= 1 &&
+           cmd.getData()[0] == PROBE_REPLY;
+}
+
+void HealthMonitor::poll(uint64_t nowMs) {
+    if (!this->isEnabled()) {
+        return;
+    }
+    if (this->m_probeOutstanding) {
+        if (nowMs - this->m_probeSentMs < this->m_idleMs) {
+            return;
+        }
+        this->m_probeOutstanding = false;
+        this->m_consecutiveMisses++;
+        this->m_probesMissed++;
+        State newState = this->m_consecutiveMisses >= MISSES_FOR_DOWN ? State::DOWN : State::SUSPECT;
+        if (newState != this->m_state) {
+            Log::warning(
+                "Link is %s (%u probes unanswered)", newState == State::DOWN ? "down" : "suspect",
+                this->m_consecutiveMisses);
+            this->m_state = newState;
+        }
+    }
+
+    // Only probe when nothing has been heard for the idle interval, so a
+    // busy link never carries any probe traffic.
+    uint64_t lastHeardMs = std::max(this->m_lastRxMs, this->m_probeSentMs);
+    if (nowMs - lastHeardMs < this->m_idleMs) {
+        return;
+    }
+    uint8_t probe[] = {PROBE_REQUEST, ++this->m_seq};
+    // A probe is never queued while the serial device is gone, since it
+    // would only be answered (late) once the device was back.
+    if (!this->m_outbox->sendNow(ServerCommand::PROBE, probe, sizeof(probe))) {
+        return;
+    }
+    this->m_probeSentMs = nowMs;
+    this->m_probeOutstanding = true;
+    this->m_probesSent++;
+}
+
+void HealthMonitor::updateMetrics(Metrics* metrics, uint64_t nowMs) const {
+    metrics->set("cliserver_link_health", static_cast<double>(this->m_state));
+    metrics->set("cliserver_link_idle_ms", static_cast<double>(nowMs - this->m_lastRxMs));
+    metrics->set("cliserver_probes_sent_total", this->m_probesSent);
+    metrics->set("cliserver_probes_missed_total", this->m_probesMissed);
+}
+
+bool HealthMonitor::handlePacket(Packet const& cmd, Packet* rsp) {
+    switch (cmd.getCommand()) {
+        case ServerCommand::PROBE: {
+            // Answer a probe from the other end, echoing its sequence number.
+            PacketReader reader(cmd);
+            reader.read<uint8_t>();
+            auto seq = reader.read<uint8_t>();
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(PROBE_REPLY);
+            writer.write(seq);
+            return true;
+        }
+        case ServerCommand::HEALTH: {
+            uint64_t nowMs = Clock::monotonicNs() / 1000000;
+            uint64_t idleMs = this->m_state == State::UNKNOWN ? 0 : nowMs - this->m_lastRxMs;
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(static_cast<uint8_t>(this->m_state));
+            writer.write(static_cast<uint32_t>(std::min<uint64_t>(idleMs, UINT32_MAX)));
+            writer.write(this->m_probesSent);
+            writer.write(this->m_probesMissed);
+            return true;
+        }
+    }
+    return false;
+}
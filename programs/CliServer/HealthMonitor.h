@@ -0,0 +1,119 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   HealthMonitor.h
+ *
+ *   @brief  Tracks whether the other end of the link is alive.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+#include "Bus.h"
+
+class Metrics;
+class Outbox;
+
+//! @brief Probes the link, but only when it has been idle.
+//!
+//! @details Any traffic received from the other end proves that it's alive,
+//!          so probes are only sent once nothing has been received for the
+//!          idle interval. A probe which isn't answered within another idle
+//!          interval counts as a miss, and MISSES_FOR_DOWN consecutive misses
+//!          mark the link as down.
+//!
+//!          PROBE:  uint8_t kind (PROBE_REQUEST or PROBE_REPLY), uint8_t seq
+//!          HEALTH: -> uint8_t state, uint32_t idleMs, uint32_t probesSent,
+//!                     uint32_t probesMissed
+class HealthMonitor : public IPacketHandler {
+ public:
+    //! Health of the link.
+    enum class State : uint8_t {
+        UNKNOWN = 0,  //!< Nothing has been received yet.
+        UP = 1,       //!< Traffic was received recently.
+        SUSPECT = 2,  //!< At least one probe has gone unanswered.
+        DOWN = 3,     //!< The other end isn't responding.
+    };
+
+    //! Value of the kind byte in a probe sent by us.
+    static constexpr uint8_t PROBE_REQUEST = 0;
+
+    //! Value of the kind byte in the answer to a probe.
+    static constexpr uint8_t PROBE_REPLY = 1;
+
+    //! Number of consecutive unanswered probes before the link is down.
+    static constexpr uint32_t MISSES_FOR_DOWN = 3;
+
+    //! @brief Constructor.
+    explicit HealthMonitor(
+        Outbox* outbox  //!< [in] Used to send probes.
+    )
+        : m_outbox(outbox) {}
+
+    //! @brief Sets how long the link has to be idle before probing.
+    void setIdleInterval(
+        uint32_t idleMs  //!< [in] Idle interval in milliseconds (0 disables probing).
+    ) {
+        this->m_idleMs = idleMs;
+    }
+
+    //! @returns true if probing is enabled.
+    bool isEnabled() const { return this->m_idleMs != 0; }
+
+    //! @returns the current health of the link.
+    State state() const { return this->m_state; }
+
+    //! @brief Records that data was received from the other end.
+    void noteActivity(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Records that the link itself has gone away.
+    void noteLinkDown();
+
+    //! @returns true if cmd is the answer to one of our probes.
+    //! @details These are consumed by the main loop rather than being
+    //!          dispatched, since they mustn't be answered.
+    static bool isProbeReply(
+        Packet const& cmd  //!< [in] Packet which was received.
+    );
+
+    //! @brief Sends probes and detects unanswered ones.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Publishes the health of the link.
+    void updateMetrics(
+        Metrics* metrics,  //!< [out] Where to store the metrics.
+        uint64_t nowMs     //!< [in] Current time (monotonic milliseconds).
+    ) const;
+
+    //! @brief Handles the PROBE and HEALTH commands.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    Outbox* m_outbox;                   //!< Used to send probes.
+    uint32_t m_idleMs = 0;              //!< Idle time before probing.
+    State m_state = State::UNKNOWN;     //!< Current health.
+    uint64_t m_lastRxMs = 0;            //!< When data was last received.
+    uint64_t m_probeSentMs = 0;         //!< When the outstanding probe was sent.
+    bool m_probeOutstanding = false;    //!< Is a probe waiting for an answer?
+    uint8_t m_seq = 0;                  //!< Sequence number of the last probe.
+    uint32_t m_consecutiveMisses = 0;   //!< Unanswered probes in a row.
+    uint32_t m_probesSent = 0;          //!< Total probes sent.
+    uint32_t m_probesMissed = 0;        //!< Total probes which weren't answered.
+};
@@ -0,0 +1,502 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   LeaseManager.cpp
+ *
+ *   @brief  Grants time limited leases on a pool of devices.
+ *
+ ****************************************************************************/
+
+#include "LeaseManager.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "Log.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! @returns true if command has to be wrapped in DEVICE_REQUEST (and needs a lease).
+bool needsLease(uint8_t command) {
+    switch (command) {
+        case ServerCommand::LEASE_ACQUIRE:
+        case ServerCommand::LEASE_RENEW:
+        case ServerCommand::LEASE_RELEASE:
+        case ServerCommand::LEASE_STATUS:
+        case ServerCommand::LOCATE:
+        case ServerCommand::PROBE:
+        case ServerCommand::HEALTH:
+        case ServerCommand::HELLO:
+        case ServerCommand::BAUD:
+        case ServerCommand::PING:
+        case ServerCommand::ROUTE:
+            return false;
+    }
+    return true;
+}
+
+//! @returns true if a shared lease is enough for command.
+bool isReadOnly(uint8_t command) {
+    switch (command) {
+        case ServerCommand::DELTA_DUMP:
+        case ServerCommand::FW_STATUS:
+        case ServerCommand::REG_READ:
+        case ServerCommand::HISTORY:
+            return true;
+    }
+    return false;
+}
+
+}  // namespace
+
+bool LeaseManager::addDevice(char const* name) {
+    if (this->m_devices.size() >= GROUP_FLAG) {
+        return false;
+    }
+    this->m_devices.emplace_back();
+    this->m_devices.back().name = name;
+    return true;
+}
+
+bool LeaseManager::addGroup(char const* spec) {
+    char const* equals = strchr(spec, '=');
+    if (equals == nullptr || equals == spec || this->m_groups.size() >= GROUP_FLAG) {
+        return false;
+    }
+    Group group;
+    group.name.assign(spec, equals - spec);
+
+    char const* name = equals + 1;
+    while (*name != '\0') {
+        char const* comma = strchrnul(name, ',');
+        std::string memberName(name, comma - name);
+        auto device = std::find_if(
+            this->m_devices.begin(), this->m_devices.end(),
+            [&memberName](Device const& dev) { return dev.name == memberName; });
+        if (device == this->m_devices.end()) {
+            Log::error("Group %s: unknown device '%s'", group.name.c_str(), memberName.c_str());
+            return false;
+        }
+        group.members.push_back(device - this->m_devices.begin());
+        name = *comma == ',' ? comma + 1 : comma;
+    }
+    if (group.members.empty()) {
+        return false;
+    }
+    this->m_groups.push_back(std::move(group));
+    return true;
+}
+
+void LeaseManager::poll(uint64_t nowMs) {
+    for (auto& device : this->m_devices) {
+        auto expired = [nowMs](Lease const& lease) { return lease.deadlineMs <= nowMs; };
+        for (auto const& lease : device.holders) {
+            if (expired(lease)) {
+                Log::info("Lease on %s for client %u expired", device.name.c_str(), lease.clientId);
+            }
+        }
+        device.holders.erase(
+            std::remove_if(device.holders.begin(), device.holders.end(), expired),
+            device.holders.end());
+        device.waiting.erase(
+            std::remove_if(device.waiting.begin(), device.waiting.end(), expired),
+            device.waiting.end());
+    }
+    for (size_t idx = 0; idx < this->m_devices.size(); idx++) {
+        this->grantWaiting(idx, nowMs);
+    }
+}
+
+bool LeaseManager::handlePacket(Packet const& cmd, Packet* rsp) {
+    uint64_t nowMs = Clock::monotonicNs() / 1000000;
+    switch (cmd.getCommand()) {
+        case ServerCommand::LEASE_ACQUIRE: {
+            this->poll(nowMs);
+            this->acquire(cmd, rsp, nowMs);
+            return true;
+        }
+        case ServerCommand::LEASE_RENEW: {
+            this->poll(nowMs);
+            this->renew(cmd, rsp, nowMs);
+            return true;
+        }
+        case ServerCommand::LEASE_RELEASE: {
+            this->release(cmd, rsp, nowMs);
+            return true;
+        }
+        case ServerCommand::LEASE_STATUS: {
+            this->poll(nowMs);
+            this->status(cmd, rsp);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t LeaseManager::targetCommand(Packet const& cmd) {
+    if (cmd.getCommand() != ServerCommand::DEVICE_REQUEST) {
+        return cmd.getCommand();
+    }
+    PacketReader reader(cmd);
+    reader.skip(sizeof(uint32_t) + sizeof(uint8_t));
+    auto command = reader.read<uint8_t>();
+    return reader.ok() ? command : cmd.getCommand();
+}
+
+ServerError LeaseManager::authorize(Packet* cmd, uint64_t nowMs) {
+    if (cmd->getCommand() != ServerCommand::DEVICE_REQUEST) {
+        return needsLease(cmd->getCommand()) ? ServerError::NOT_LEASED : ServerError::NONE;
+    }
+    PacketReader reader(*cmd);
+    auto clientId = reader.read<uint32_t>();
+    auto deviceByte = reader.read<uint8_t>();
+    auto command = reader.read<uint8_t>();
+    std::vector<size_t> members;
+    if (!reader.ok() || command == ServerCommand::DEVICE_REQUEST || !this->lookup(deviceByte, &members)) {
+        return ServerError::BAD_REQUEST;
+    }
+
+    this->poll(nowMs);
+    bool readOnly = isReadOnly(command);
+    size_t numHeld = 0;
+    for (size_t idx : members) {
+        Device const& device = this->m_devices[idx];
+        auto held = std::find_if(
+            device.holders.begin(), device.holders.end(),
+            [clientId](Lease const& lease) { return lease.clientId == clientId; });
+        if (held != device.holders.end() && (readOnly || held->mode == Mode::EXCLUSIVE)) {
+            numHeld++;
+        }
+    }
+    if (readOnly ? numHeld == 0 : numHeld != members.size()) {
+        return ServerError::NOT_LEASED;
+    }
+
+    size_t len = reader.remaining();
+    memmove(cmd->getData(), reader.current(), len);
+    cmd->setCommand(command);
+    cmd->setLength(len);
+    return ServerError::NONE;
+}
+
+bool LeaseManager::lookup(uint8_t device, std::vector<size_t>* members) const {
+    members->clear();
+    if ((device & GROUP_FLAG) == 0) {
+        if (device >= this->m_devices.size()) {
+            return false;
+        }
+        members->push_back(device);
+        return true;
+    }
+    size_t groupIdx = device & ~GROUP_FLAG;
+    if (groupIdx >= this->m_groups.size()) {
+        return false;
+    }
+    *members = this->m_groups[groupIdx].members;
+    return true;
+}
+
+bool LeaseManager::conflicts(Device const& device, Lease const& request) const {
+    auto byClient = [&request](Lease const& lease) { return lease.clientId == request.clientId; };
+    auto differs = [&request](Lease const& lease) {
+        return lease.mode != request.mode || lease.group != request.group;
+    };
+    auto held = std::find_if(device.holders.begin(), device.holders.end(), byClient);
+    if (held != device.holders.end()) {
+        // An exclusive lease already allows everything a shared one does.
+        return differs(*held) && !(held->mode == Mode::EXCLUSIVE && request.mode == Mode::SHARED);
+    }
+    auto waiting = std::find_if(device.waiting.begin(), device.waiting.end(), byClient);
+    return waiting != device.waiting.end() && differs(*waiting);
+}
+
+void LeaseManager::enqueue(Device* device, Lease const& request, uint64_t nowMs) {
+    auto byClient = [&request](Lease const& lease) { return lease.clientId == request.clientId; };
+    if (std::any_of(device->holders.begin(), device->holders.end(), byClient)) {
+        return;
+    }
+    auto waiting = std::find_if(device->waiting.begin(), device->waiting.end(), byClient);
+    if (waiting == device->waiting.end()) {
+        device->waiting.push_back(request);
+        waiting = device->waiting.end() - 1;
+    }
+    waiting->deadlineMs = nowMs + WAITER_TIMEOUT_MS;
+}
+
+LeaseManager::Result LeaseManager::result(Device const& device, uint32_t clientId, uint64_t nowMs) const {
+    auto byClient = [clientId](Lease const& lease) { return lease.clientId == clientId; };
+    auto held = std::find_if(device.holders.begin(), device.holders.end(), byClient);
+    if (held != device.holders.end()) {
+        return Result{State::GRANTED, 0, static_cast<uint32_t>(held->deadlineMs - nowMs)};
+    }
+    auto waiting = std::find_if(device.waiting.begin(), device.waiting.end(), byClient);
+    return Result{State::QUEUED, static_cast<uint16_t>(waiting - device.waiting.begin() + 1), 0};
+}
+
+size_t LeaseManager::pickMember(Group const& group, uint32_t clientId) const {
+    // Stick with a member the client already holds or is waiting on.
+    auto byClient = [clientId](Lease const& lease) { return lease.clientId == clientId; };
+    for (size_t member : group.members) {
+        Device const& device = this->m_devices[member];
+        if (std::any_of(device.holders.begin(), device.holders.end(), byClient) ||
+            std::any_of(device.waiting.begin(), device.waiting.end(), byClient)) {
+            return member;
+        }
+    }
+
+    // Otherwise pick the member with the least outstanding work. Members
+    // which can't grant a shared lease right now are only used as a last
+    // resort.
+    size_t best = group.members.front();
+    size_t bestLoad = SIZE_MAX;
+    for (size_t member : group.members) {
+        Device const& device = this->m_devices[member];
+        bool blocked = !device.waiting.empty() ||
+                       (!device.holders.empty() && device.holders.front().mode == Mode::EXCLUSIVE);
+        size_t load = device.holders.size() + device.waiting.size() + (blocked ? 0x10000 : 0);
+        if (load < bestLoad) {
+            best = member;
+            bestLoad = load;
+        }
+    }
+    return best;
+}
+
+void LeaseManager::acquire(Packet const& cmd, Packet* rsp, uint64_t nowMs) {
+    PacketReader reader(cmd);
+    auto clientId = reader.read<uint32_t>();
+    auto deviceByte = reader.read<uint8_t>();
+    auto mode = static_cast<Mode>(reader.read<uint8_t>());
+    auto durationMs = std::min(reader.read<uint32_t>(), MAX_LEASE_MS);
+    std::vector<size_t> members;
+    if (!reader.ok() || !this->lookup(deviceByte, &members) || members.empty() ||
+        (mode != Mode::SHARED && mode != Mode::EXCLUSIVE) || durationMs == 0) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+    bool isGroup = (deviceByte & GROUP_FLAG) != 0;
+    Lease request{clientId, mode, durationMs, 0, -1};
+    if (isGroup && mode == Mode::EXCLUSIVE) {
+        request.group = static_cast<int16_t>(deviceByte & ~GROUP_FLAG);
+    }
+
+    uint8_t member = ALL_MEMBERS;
+    if (isGroup && mode == Mode::SHARED) {
+        size_t picked = this->pickMember(this->m_groups[deviceByte & ~GROUP_FLAG], clientId);
+        members.assign(1, picked);
+        member = static_cast<uint8_t>(picked);
+    }
+
+    for (size_t idx : members) {
+        if (this->conflicts(this->m_devices[idx], request)) {
+            PacketWriter::error(rsp, cmd.getCommand(), ServerError::CONFLICT);
+            return;
+        }
+    }
+
+    // Queue on every member before granting anything, so that a group lease
+    // is granted on all of its members together.
+    for (size_t idx : members) {
+        this->enqueue(&this->m_devices[idx], request, nowMs);
+    }
+    for (size_t idx : members) {
+        this->grantWaiting(idx, nowMs);
+    }
+
+    Result total{State::GRANTED, 0, UINT32_MAX};
+    for (size_t idx : members) {
+        Result one = this->result(this->m_devices[idx], clientId, nowMs);
+        if (one.state == State::QUEUED) {
+            total.state = State::QUEUED;
+            total.position = std::max(total.position, one.position);
+        } else {
+            total.remainingMs = std::min(total.remainingMs, one.remainingMs);
+        }
+    }
+    if (total.state == State::QUEUED) {
+        total.remainingMs = 0;
+    }
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(static_cast<uint8_t>(total.state));
+    writer.write(total.position);
+    writer.write(total.remainingMs);
+    if (isGroup) {
+        writer.write(member);
+    }
+}
+
+void LeaseManager::renew(Packet const& cmd, Packet* rsp, uint64_t nowMs) {
+    PacketReader reader(cmd);
+    auto clientId = reader.read<uint32_t>();
+    auto deviceByte = reader.read<uint8_t>();
+    auto durationMs = std::min(reader.read<uint32_t>(), MAX_LEASE_MS);
+    std::vector<size_t> members;
+    if (!reader.ok() || !this->lookup(deviceByte, &members)) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+
+    auto byClient = [clientId](Lease const& lease) { return lease.clientId == clientId; };
+    std::vector<Lease*> held;
+    bool anyWaiting = false;
+    for (size_t idx : members) {
+        Device& device = this->m_devices[idx];
+        auto lease = std::find_if(device.holders.begin(), device.holders.end(), byClient);
+        if (lease != device.holders.end()) {
+            held.push_back(&*lease);
+            anyWaiting = anyWaiting || !device.waiting.empty();
+        }
+    }
+    if (held.empty()) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::STALE);
+        return;
+    }
+
+    // Don't let a holder extend its lease while someone else is waiting,
+    // otherwise the queue would never get serviced. The leases of a group
+    // are extended together so that they keep expiring together.
+    uint32_t remainingMs = UINT32_MAX;
+    for (Lease* lease : held) {
+        if (!anyWaiting) {
+            lease->deadlineMs = nowMs + durationMs;
+        }
+        remainingMs = std::min(remainingMs, static_cast<uint32_t>(lease->deadlineMs - nowMs));
+    }
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(remainingMs);
+}
+
+void LeaseManager::release(Packet const& cmd, Packet* rsp, uint64_t nowMs) {
+    PacketReader reader(cmd);
+    auto clientId = reader.read<uint32_t>();
+    auto deviceByte = reader.read<uint8_t>();
+    std::vector<size_t> members;
+    if (!reader.ok() || !this->lookup(deviceByte, &members)) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+    auto byClient = [clientId](Lease const& lease) { return lease.clientId == clientId; };
+
+    // Releasing any part of a group lease releases all of it.
+    std::vector<size_t> groupMembers;
+    for (size_t idx : members) {
+        Device const& device = this->m_devices[idx];
+        auto held = std::find_if(device.holders.begin(), device.holders.end(), byClient);
+        auto waiting = std::find_if(device.waiting.begin(), device.waiting.end(), byClient);
+        int16_t group = held != device.holders.end()       ? held->group
+                        : waiting != device.waiting.end() ? waiting->group
+                                                          : -1;
+        if (group >= 0) {
+            auto const& extra = this->m_groups[group].members;
+            groupMembers.insert(groupMembers.end(), extra.begin(), extra.end());
+        }
+    }
+    members.insert(members.end(), groupMembers.begin(), groupMembers.end());
+    std::sort(members.begin(), members.end());
+    members.erase(std::unique(members.begin(), members.end()), members.end());
+
+    for (size_t idx : members) {
+        Device& device = this->m_devices[idx];
+        device.holders.erase(
+            std::remove_if(device.holders.begin(), device.holders.end(), byClient),
+            device.holders.end());
+        device.waiting.erase(
+            std::remove_if(device.waiting.begin(), device.waiting.end(), byClient),
+            device.waiting.end());
+    }
+    for (size_t idx : members) {
+        this->grantWaiting(idx, nowMs);
+    }
+
+    PacketWriter writer(rsp, cmd.getCommand());
+}
+
+void LeaseManager::status(Packet const& cmd, Packet* rsp) {
+    PacketReader reader(cmd);
+    auto deviceByte = reader.read<uint8_t>();
+    std::vector<size_t> members;
+    if (!reader.ok() || !this->lookup(deviceByte, &members)) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return;
+    }
+    Mode mode = Mode::SHARED;
+    size_t numHolders = 0;
+    size_t numWaiting = 0;
+    for (size_t idx : members) {
+        Device const& device = this->m_devices[idx];
+        if (!device.holders.empty() && device.holders.front().mode == Mode::EXCLUSIVE) {
+            mode = Mode::EXCLUSIVE;
+        }
+        numHolders += device.holders.size();
+        numWaiting += device.waiting.size();
+    }
+    std::string const& name = (deviceByte & GROUP_FLAG) != 0
+                                  ? this->m_groups[deviceByte & ~GROUP_FLAG].name
+                                  : this->m_devices[deviceByte].name;
+
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write(static_cast<uint8_t>(mode));
+    writer.write(static_cast<uint8_t>(std::min<size_t>(numHolders, UINT8_MAX)));
+    writer.write(static_cast<uint16_t>(std::min<size_t>(numWaiting, UINT16_MAX)));
+    writer.append(name.data(), std::min(name.size(), writer.remaining()));
+}
+
+bool LeaseManager::canGrant(Device const& device, Lease const& next) const {
+    if (next.mode == Mode::EXCLUSIVE) {
+        return device.holders.empty();
+    }
+    return device.holders.empty() || device.holders.front().mode != Mode::EXCLUSIVE;
+}
+
+void LeaseManager::grantFront(Device* device, uint64_t nowMs) {
+    Lease lease = device->waiting.front();
+    lease.deadlineMs = nowMs + lease.durationMs;
+    device->holders.push_back(lease);
+    device->waiting.pop_front();
+    Log::info(
+        "Granted %s lease on %s to client %u",
+        lease.mode == Mode::EXCLUSIVE ? "exclusive" : "shared", device->name.c_str(),
+        lease.clientId);
+}
+
+void LeaseManager::grantWaiting(size_t deviceIdx, uint64_t nowMs) {
+    Device* device = &this->m_devices[deviceIdx];
+    while (!device->waiting.empty()) {
+        Lease const& next = device->waiting.front();
+        if (!this->canGrant(*device, next)) {
+            break;
+        }
+        if (next.group < 0) {
+            this->grantFront(device, nowMs);
+            continue;
+        }
+
+        // A group lease is granted on every member at once, once it's at the
+        // front of each member's queue and each member is free.
+        auto const& members = this->m_groups[next.group].members;
+        uint32_t clientId = next.clientId;
+        bool ready = std::all_of(members.begin(), members.end(), [this, clientId](size_t idx) {
+            Device const& member = this->m_devices[idx];
+            return !member.waiting.empty() && member.waiting.front().clientId == clientId &&
+                   this->canGrant(member, member.waiting.front());
+        });
+        if (!ready) {
+            break;
+        }
+        for (size_t idx : members) {
+            this->grantFront(&this->m_devices[idx], nowMs);
+        }
+    }
+}
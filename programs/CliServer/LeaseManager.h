@@ -0,0 +1,206 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   LeaseManager.h
+ *
+ *   @brief  Grants time limited leases on a pool of devices.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Bus.h"
+#include "ServerCommand.h"
+
+//! @brief Hands out shared or exclusive leases on devices.
+//!
+//! @details Clients identify themselves with a 32-bit client id. A client
+//!          which can't be granted a lease straight away is placed in a FIFO
+//!          queue for the device and polls by repeating LEASE_ACQUIRE. Shared
+//!          leases are only granted while no exclusive request is waiting
+//!          ahead of them, so exclusive requests can't be starved by a steady
+//!          stream of shared ones.
+//!
+//!          Identical devices can be put into a group, which is addressed by
+//!          setting GROUP_FLAG in the device byte. A shared (read-only) lease
+//!          on a group is placed on the member with the fewest outstanding
+//!          leases and waiters, which spreads readers across the group. An
+//!          exclusive (write) lease on a group is a lease on every member,
+//!          and is granted, renewed and released on all of them at once:
+//!          it's only granted when it's at the front of every member's queue
+//!          and every member is free. A request is queued on all of its
+//!          members in one step, so any two requests are in the same order
+//!          on every device they share and can't end up waiting on each
+//!          other.
+//!
+//!          A client which already holds (or is waiting for) a lease can
+//!          repeat its request to poll, but can't change the kind of lease
+//!          in place: a request with a different mode or group is answered
+//!          with CONFLICT, and the client has to release the lease first.
+//!          The one exception is asking for a shared lease while holding an
+//!          exclusive one, which is already satisfied. Upgrading in place
+//!          would let two shared holders which both upgrade wait on each
+//!          other forever.
+//!
+//!          Once devices have been added, requests which touch a device
+//!          have to be wrapped in DEVICE_REQUEST, which names the client and
+//!          the device (or group), and are only dispatched if the client
+//!          holds a suitable lease. Read-only commands need a lease (of
+//!          either kind) on the device or on any member of the group, and
+//!          everything else needs an exclusive lease on the device or on
+//!          every member of the group. Bare requests are only accepted for
+//!          commands which don't touch a device (the lease commands, HELLO,
+//!          HEALTH and so on).
+//!
+//!          LEASE_ACQUIRE: uint32_t clientId, uint8_t device, uint8_t mode,
+//!                         uint32_t durationMs
+//!                         -> uint8_t state, uint16_t queuePosition, uint32_t remainingMs
+//!                            (groups add uint8_t member, ALL_MEMBERS for exclusive)
+//!          LEASE_RENEW:   uint32_t clientId, uint8_t device, uint32_t durationMs
+//!                         -> uint32_t remainingMs
+//!          LEASE_RELEASE: uint32_t clientId, uint8_t device
+//!          LEASE_STATUS:  uint8_t device
+//!                         -> uint8_t mode, uint8_t numHolders, uint16_t numWaiting, name
+//!          DEVICE_REQUEST: uint32_t clientId, uint8_t device, uint8_t command, data
+//!                         -> response to command
+class LeaseManager : public IPacketHandler {
+ public:
+    //! Type of lease being requested.
+    enum class Mode : uint8_t {
+        SHARED = 0,     //!< Any number of shared leases may be held at once.
+        EXCLUSIVE = 1,  //!< Only one exclusive lease may be held at once.
+    };
+
+    //! Result of a LEASE_ACQUIRE request.
+    enum class State : uint8_t {
+        GRANTED = 0,  //!< The lease is held.
+        QUEUED = 1,   //!< The client is waiting for the lease.
+    };
+
+    //! Longest lease which will be granted.
+    static constexpr uint32_t MAX_LEASE_MS = 10 * 60 * 1000;
+
+    //! Waiting clients which haven't polled within this time lose their place.
+    static constexpr uint32_t WAITER_TIMEOUT_MS = 5000;
+
+    //! Set in the device byte of a request to refer to a group.
+    static constexpr uint8_t GROUP_FLAG = 0x80;
+
+    //! Member returned when an exclusive lease covers the whole group.
+    static constexpr uint8_t ALL_MEMBERS = 0xff;
+
+    //! @brief Adds a device to the pool.
+    //! @details Devices are referred to by their index, which has to stay
+    //!          below GROUP_FLAG.
+    //! @returns false if the pool is full.
+    bool addDevice(
+        char const* name  //!< [in] Name of the device.
+    );
+
+    //! @brief Adds a group of identical devices.
+    //! @details spec has the form "name=device1,device2,..." where each
+    //!          device has already been added with addDevice.
+    //! @returns false if spec is malformed or refers to an unknown device.
+    bool addGroup(
+        char const* spec  //!< [in] Group specification.
+    );
+
+    //! @returns true if any devices have been added.
+    bool hasDevices() const { return !this->m_devices.empty(); }
+
+    //! @returns the number of devices in the pool.
+    size_t numDevices() const { return this->m_devices.size(); }
+
+    //! @returns the name of a device in the pool.
+    std::string const& deviceName(size_t idx) const { return this->m_devices[idx].name; }
+
+    //! @brief Expires leases and waiters, and grants leases to waiting clients.
+    //! @details Called periodically from the main loop.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Checks that the sender of a request holds the lease it needs.
+    //! @details A DEVICE_REQUEST which is allowed is unwrapped in place, so
+    //!          cmd can then be dispatched as usual.
+    //! @returns ServerError::NONE if the request may be dispatched.
+    ServerError authorize(
+        Packet* cmd,     //!< [in,out] Request to check.
+        uint64_t nowMs   //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @returns the command which a request will run as, which is the
+    //!          wrapped command for DEVICE_REQUEST.
+    static uint8_t targetCommand(
+        Packet const& cmd  //!< [in] Request to look at.
+    );
+
+    //! @brief Handles the lease commands.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! A lease which is held, or a request which is waiting.
+    struct Lease {
+        uint32_t clientId;      //!< Client holding (or waiting for) the lease.
+        Mode mode;              //!< Type of lease.
+        uint32_t durationMs;    //!< Requested duration of the lease.
+        uint64_t deadlineMs;    //!< Expiry time (held) or poll deadline (waiting).
+        int16_t group;          //!< Group of an exclusive group lease, or -1.
+    };
+
+    //! A device in the pool.
+    struct Device {
+        std::string name;               //!< Name of the device.
+        std::vector<Lease> holders;     //!< Leases currently held.
+        std::deque<Lease> waiting;      //!< Requests waiting, oldest first.
+    };
+
+    //! A group of identical devices.
+    struct Group {
+        std::string name;               //!< Name of the group.
+        std::vector<size_t> members;    //!< Indices of the member devices.
+    };
+
+    //! Outcome of acquiring a lease on a single device.
+    struct Result {
+        State state;            //!< Was the lease granted?
+        uint16_t position;      //!< Position in the queue (1 = next).
+        uint32_t remainingMs;   //!< Time left on a granted lease.
+    };
+
+    //! @brief Finds the devices referred to by the device byte of a request.
+    //! @returns false if the device byte doesn't refer to a device or group.
+    bool lookup(uint8_t device, std::vector<size_t>* members) const;
+
+    bool conflicts(Device const& device, Lease const& request) const;
+    void enqueue(Device* device, Lease const& request, uint64_t nowMs);
+    Result result(Device const& device, uint32_t clientId, uint64_t nowMs) const;
+    size_t pickMember(Group const& group, uint32_t clientId) const;
+    void acquire(Packet const& cmd, Packet* rsp, uint64_t nowMs);
+    void renew(Packet const& cmd, Packet* rsp, uint64_t nowMs);
+    void release(Packet const& cmd, Packet* rsp, uint64_t nowMs);
+    void status(Packet const& cmd, Packet* rsp);
+    bool canGrant(Device const& device, Lease const& next) const;
+    void grantFront(Device* device, uint64_t nowMs);
+    void grantWaiting(size_t deviceIdx, uint64_t nowMs);
+
+    std::vector<Device> m_devices;  //!< Devices in the pool.
+    std::vector<Group> m_groups;    //!< Groups of identical devices.
+};
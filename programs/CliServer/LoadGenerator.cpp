@@ -0,0 +1,103 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   LoadGenerator.cpp
+ *
+ *   @brief  Generates request traffic for benchmarking.
+ *
+ ****************************************************************************/
+
+#include "LoadGenerator.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "Log.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+bool LoadGenerator::configure(char const* configStr) {
+    char* end;
+    unsigned long count = strtoul(configStr, &end, 0);
+    unsigned long window = 1;
+    if (*end == ':') {
+        window = strtoul(end + 1, &end, 0);
+    }
+    if (*end != '\0' || count == 0 || count > UINT32_MAX || window == 0 || window > UINT8_MAX) {
+        return false;
+    }
+    this->m_count = static_cast<uint32_t>(count);
+    this->m_window = static_cast<uint32_t>(window);
+    return true;
+}
+
+bool LoadGenerator::isReply(Packet const& cmd) {
+    return cmd.getCommand() == ServerCommand::PING && cmd.getLength() >= 1 &&
+           cmd.getData()[0] == REPLY;
+}
+
+void LoadGenerator::handleReply(Packet const& cmd) {
+    (void)cmd;
+    if (this->m_completed < this->m_sent) {
+        this->m_completed++;
+    }
+}
+
+void LoadGenerator::pump(uint64_t nowMs) {
+    if (!this->isEnabled()) {
+        return;
+    }
+    if (this->m_sent == 0) {
+        this->m_startMs = nowMs;
+        this->m_lastReplyMs = nowMs;
+    }
+    if (this->m_completed != this->m_lastCompleted) {
+        this->m_lastCompleted = this->m_completed;
+        this->m_lastReplyMs = nowMs;
+    } else if (this->m_completed < this->m_sent && nowMs - this->m_lastReplyMs >= RETRY_MS) {
+        this->m_lost += this->m_sent - this->m_completed;
+        this->m_completed = this->m_sent;
+        this->m_lastCompleted = this->m_completed;
+        this->m_lastReplyMs = nowMs;
+    }
+
+    uint8_t request[1 + sizeof(uint32_t) + PAYLOAD_LEN] = {REQUEST};
+    while (this->m_sent < this->m_count && this->m_sent - this->m_completed < this->m_window) {
+        uint32_t seq = this->m_sent++;
+        for (size_t i = 0; i < sizeof(seq); i++) {
+            request[1 + i] = static_cast<uint8_t>(seq >> (8 * i));
+        }
+        this->m_outbox->send(ServerCommand::PING, request, sizeof(request));
+    }
+}
+
+void LoadGenerator::report(uint64_t nowMs) const {
+    uint64_t elapsedMs = nowMs - this->m_startMs;
+    Log::info(
+        "bench: %" PRIu32 " requests (%" PRIu32 " lost) in %" PRIu64 " ms, %.0f requests/s",
+        this->m_count, this->m_lost, elapsedMs,
+        elapsedMs == 0 ? 0.0 : this->m_count * 1000.0 / elapsedMs);
+}
+
+bool LoadGenerator::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::PING) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    if (reader.read<uint8_t>() != REQUEST || !reader.ok()) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return true;
+    }
+    PacketWriter writer(rsp, ServerCommand::PING);
+    writer.write(REPLY);
+    writer.append(reader.current(), reader.remaining());
+    return true;
+}
@@ -0,0 +1,106 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   LoadGenerator.h
+ *
+ *   @brief  Generates request traffic for benchmarking.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+#include "Bus.h"
+
+class Outbox;
+
+//! @brief Sends a fixed number of PING requests as fast as they're answered.
+//!
+//! @details Every CliServer answers PING, so one CliServer running with
+//!          --bench can drive another one over any transport. Up to
+//!          `window` requests are kept outstanding, so a window larger than
+//!          one exercises pipelining. If nothing comes back for
+//!          RETRY_MS the outstanding requests are counted as lost and new
+//!          ones are sent, so a lost packet can't stall the run.
+//!
+//!          PING: uint8_t kind (REQUEST or REPLY), uint32_t seq, payload
+class LoadGenerator : public IPacketHandler {
+ public:
+    //! Value of the kind byte of a request.
+    static constexpr uint8_t REQUEST = 0;
+
+    //! Value of the kind byte of a reply.
+    static constexpr uint8_t REPLY = 1;
+
+    //! Number of payload bytes in each request.
+    static constexpr size_t PAYLOAD_LEN = 32;
+
+    //! Time without a reply after which outstanding requests are lost.
+    static constexpr uint64_t RETRY_MS = 1000;
+
+    //! @brief Constructor.
+    explicit LoadGenerator(
+        Outbox* outbox  //!< [in] Used to send requests.
+    )
+        : m_outbox(outbox) {}
+
+    //! @brief Configures the run.
+    //! @returns false if the configuration couldn't be parsed.
+    bool configure(
+        char const* configStr  //!< [in] "COUNT" or "COUNT:WINDOW".
+    );
+
+    //! @returns true if a run was configured.
+    bool isEnabled() const { return this->m_count != 0; }
+
+    //! @returns true once every request has been answered (or lost).
+    bool isDone() const { return this->isEnabled() && this->m_completed >= this->m_count; }
+
+    //! @returns true if cmd is the answer to one of our requests.
+    //! @details These are consumed by the main loop (by calling handleReply)
+    //!          rather than being dispatched, since they mustn't be answered.
+    static bool isReply(
+        Packet const& cmd  //!< [in] Packet which was received.
+    );
+
+    //! @brief Processes the answer to one of our requests.
+    void handleReply(
+        Packet const& cmd  //!< [in] Packet for which isReply returned true.
+    );
+
+    //! @brief Sends requests until the window is full.
+    void pump(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Logs the results of the run.
+    void report(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    ) const;
+
+    //! @brief Handles the PING command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    Outbox* m_outbox;               //!< Used to send requests.
+    uint32_t m_count = 0;           //!< Number of requests in the run.
+    uint32_t m_window = 1;          //!< Maximum number of outstanding requests.
+    uint32_t m_sent = 0;            //!< Requests sent so far.
+    uint32_t m_completed = 0;       //!< Requests answered or lost so far.
+    uint32_t m_lost = 0;            //!< Requests which were never answered.
+    uint64_t m_startMs = 0;         //!< When the first request was sent.
+    uint32_t m_lastCompleted = 0;   //!< m_completed at the last pump.
+    uint64_t m_lastReplyMs = 0;     //!< When a pump last saw progress (or the run started).
+};
@@ -0,0 +1,40 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Metrics.cpp
+ *
+ *   @brief  Named counters and gauges, written out in Prometheus text format.
+ *
+ ****************************************************************************/
+
+#include "Metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Log.h"
+
+bool Metrics::write(char const* fileName) const {
+    std::string tmpName = std::string(fileName) + ".tmp";
+    FILE* file = fopen(tmpName.c_str(), "w");
+    if (file == nullptr) {
+        Log::error("Unable to open metrics file '%s': %s", tmpName.c_str(), strerror(errno));
+        return false;
+    }
+    for (auto const& [name, value] : this->m_values) {
+        fprintf(file, "%s %.17g\n", name.c_str(), value);
+    }
+    if (fclose(file) != 0 || rename(tmpName.c_str(), fileName) != 0) {
+        Log::error("Unable to write metrics file '%s': %s", fileName, strerror(errno));
+        return false;
+    }
+    return true;
+}
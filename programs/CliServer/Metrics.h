@@ -0,0 +1,56 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Metrics.h
+ *
+ *   @brief  Named counters and gauges, written out in Prometheus text format.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+//! @brief Collection of named metrics.
+//!
+//! @details The metrics are periodically written to a file using the
+//!          Prometheus text exposition format, which the node_exporter
+//!          textfile collector (or anything else) can pick up.
+class Metrics {
+ public:
+    //! @brief Sets the value of a gauge.
+    void set(
+        char const* name,  //!< [in] Name of the metric (may include {labels}).
+        double value       //!< [in] New value.
+    ) {
+        this->m_values[name] = value;
+    }
+
+    //! @brief Adds to the value of a counter.
+    void add(
+        char const* name,  //!< [in] Name of the metric (may include {labels}).
+        double delta = 1   //!< [in] Amount to add.
+    ) {
+        this->m_values[name] += delta;
+    }
+
+    //! @brief Writes all of the metrics to a file.
+    //! @details The file is replaced atomically so readers never see a
+    //!          partially written file.
+    //! @returns true if the file was written.
+    bool write(
+        char const* fileName  //!< [in] File to write.
+    ) const;
+
+ private:
+    std::map<std::string, double> m_values;  //!< Metric name -> value.
+};
@@ -0,0 +1,123 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Outbox.cpp
+ *
+ *   @brief  Sends packets originated by the server, queueing them while the
+ *           link is down.
+ *
+ ****************************************************************************/
+
+#include "Outbox.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "FlowControl.h"
+#include "Log.h"
+
+Outbox::Outbox(IBus* bus, PacketQueue* queue)
+    : m_bus(bus), m_queue(queue), m_packet(LEN(m_packetData), m_packetData) {}
+
+void Outbox::setOnline(bool online) {
+    this->m_online = online;
+    if (!online) {
+        this->m_held.erase(
+            std::remove_if(
+                this->m_held.begin(), this->m_held.end(), [](Held const& held) { return held.live; }),
+            this->m_held.end());
+    }
+    this->poll();
+}
+
+bool Outbox::send(uint8_t command, uint8_t const* data, size_t len) {
+    // Anything already queued has to go out first to preserve ordering.
+    // Held packets are always older than queued ones (apart from those sent
+    // with sendNow), since packets are only held while the queue is empty.
+    if (!this->m_online || !this->m_queue->isEmpty()) {
+        if (!this->m_queue->push(command, data, len)) {
+            return false;
+        }
+        this->poll();
+        return true;
+    }
+    if (this->m_held.empty() && this->write(command, data, len)) {
+        return true;
+    }
+    if (this->m_held.size() >= MAX_HELD) {
+        return false;
+    }
+    this->m_held.push_back(Held{command, std::vector<uint8_t>(data, data + len), false});
+    return true;
+}
+
+bool Outbox::sendNow(uint8_t command, uint8_t const* data, size_t len) {
+    if (!this->m_online) {
+        return false;
+    }
+    if (this->m_held.empty() && this->m_queue->isEmpty() && this->write(command, data, len)) {
+        return true;
+    }
+    if (this->m_held.size() >= MAX_HELD) {
+        return false;
+    }
+    this->m_held.push_back(Held{command, std::vector<uint8_t>(data, data + len), true});
+    return true;
+}
+
+void Outbox::poll() {
+    if (!this->m_online) {
+        return;
+    }
+    while (!this->m_held.empty()) {
+        Held const& held = this->m_held.front();
+        if (!this->write(held.command, held.data.data(), held.data.size())) {
+            return;
+        }
+        this->m_held.pop_front();
+    }
+    if (this->m_queue->isEmpty()) {
+        return;
+    }
+    size_t numSent = this->m_queue->drain(
+        [this](uint8_t command, uint8_t const* data, size_t len) {
+            return this->write(command, data, len);
+        });
+    if (numSent > 0) {
+        Log::info("Sent %zu queued packets", numSent);
+    }
+}
+
+bool Outbox::write(uint8_t command, uint8_t const* data, size_t len) {
+    if (len > PacketWriter::maxLength(this->m_packet)) {
+        Log::error("Dropping %zu byte packet for command 0x%02x", len, command);
+        return true;
+    }
+    if (this->m_flowControl != nullptr && this->m_flowControl->waitUs(Clock::monotonicNs()) > 0) {
+        return false;
+    }
+    this->m_packet.setCommand(command);
+    memcpy(this->m_packetData, data, len);
+    this->m_packet.setLength(len);
+    if (this->m_bus->writePacket(this->m_packet) != Packet::Error::NONE) {
+        return false;
+    }
+    if (this->m_capture != nullptr && this->m_capture->isOpen()) {
+        this->m_capture->writePacket(
+            this->m_captureInterface, Clock::realtimeNs(), PcapngWriter::Direction::OUTBOUND, command,
+            data, len);
+    }
+    if (this->m_flowControl != nullptr) {
+        this->m_flowControl->noteWrite(Clock::monotonicNs());
+    }
+    return true;
+}
@@ -0,0 +1,127 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Outbox.h
+ *
+ *   @brief  Sends packets originated by the server, queueing them while the
+ *           link is down.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "Bus.h"
+#include "PacketData.h"
+#include "PacketQueue.h"
+#include "PcapngWriter.h"
+
+class FlowControl;
+
+//! @brief Sends packets which the server originates (as opposed to responses).
+//!
+//! @details While the link is offline (i.e. the serial device is resetting)
+//!          packets are stored in the PacketQueue, and they are sent as soon
+//!          as the link comes back. Without a queue, packets sent while
+//!          offline are dropped. Packets which are only worth sending
+//!          straight away (probes and trigger actions) are sent with sendNow
+//!          instead, which drops them while offline rather than delivering
+//!          them late.
+//!
+//!          Writes also go through the FlowControl write gap. Packets which
+//!          can't be written yet (or whose write failed) are held in memory,
+//!          and poll() sends them, oldest first, as the gap allows.
+class Outbox {
+ public:
+    //! Largest packet data which is sent.
+    static constexpr size_t MAX_DATA_LEN = MAX_PACKET_DATA_LEN;
+
+    //! Largest number of packets held while writes are throttled.
+    static constexpr size_t MAX_HELD = 64;
+
+    //! @brief Constructor.
+    Outbox(
+        IBus* bus,          //!< [in] Bus used to send packets.
+        PacketQueue* queue  //!< [in] Queue used while offline (may be closed).
+    );
+
+    //! @brief Records each packet which is written in a capture file.
+    void setCapture(
+        PcapngWriter* capture,  //!< [in] Capture file (may be closed).
+        uint32_t interfaceId    //!< [in] Interface returned from PcapngWriter::addInterface.
+    ) {
+        this->m_capture = capture;
+        this->m_captureInterface = interfaceId;
+    }
+
+    //! @brief Spaces writes out using the FlowControl write gap.
+    void setFlowControl(
+        FlowControl* flowControl  //!< [in] Throttles writes.
+    ) {
+        this->m_flowControl = flowControl;
+    }
+
+    //! @returns true if the link is up.
+    bool isOnline() const { return this->m_online; }
+
+    //! @brief Records whether the link is up, sending queued packets when it comes up.
+    void setOnline(
+        bool online  //!< [in] true if the link is up.
+    );
+
+    //! @brief Sends a packet, or queues it if the link is down.
+    //! @returns false if the packet had to be dropped.
+    bool send(
+        uint8_t command,      //!< [in] Command byte of the packet.
+        uint8_t const* data,  //!< [in] Packet data.
+        size_t len            //!< [in] Number of bytes of packet data.
+    );
+
+    //! @brief Sends a packet which is stale once the link has gone down.
+    //! @details The packet is held (ahead of anything queued) if the write
+    //!          gap doesn't allow it yet, but it's dropped if the link is, or
+    //!          goes, offline before it's written.
+    //! @returns false if the packet had to be dropped.
+    bool sendNow(
+        uint8_t command,      //!< [in] Command byte of the packet.
+        uint8_t const* data,  //!< [in] Packet data.
+        size_t len            //!< [in] Number of bytes of packet data.
+    );
+
+    //! @returns true if packets are waiting to be sent while the link is up.
+    bool hasPending() const { return !this->m_held.empty() || (this->m_online && !this->m_queue->isEmpty()); }
+
+    //! @brief Sends whatever is waiting, as far as the write gap allows.
+    void poll();
+
+ private:
+    //! A packet waiting for the write gap.
+    struct Held {
+        uint8_t command;            //!< Command byte of the packet.
+        std::vector<uint8_t> data;  //!< Packet data.
+        bool live;                  //!< Drop the packet if the link goes down?
+    };
+
+    bool write(uint8_t command, uint8_t const* data, size_t len);
+
+    IBus* m_bus;                    //!< Bus used to send packets.
+    PacketQueue* m_queue;           //!< Queue used while offline.
+    bool m_online = true;           //!< Is the link up?
+    FlowControl* m_flowControl = nullptr;  //!< Throttles writes.
+    std::deque<Held> m_held;        //!< Packets waiting for the write gap, oldest first.
+    uint8_t m_packetData[MAX_DATA_LEN];  //!< Storage for m_packet.
+    Packet m_packet;                //!< Packet used to write each packet.
+    PcapngWriter* m_capture = nullptr;  //!< Where written packets are captured.
+    uint32_t m_captureInterface = 0;    //!< Capture interface of the bus.
+};
@@ -0,0 +1,153 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PacketData.h
+ *
+ *   @brief  Helpers for parsing and building little endian packet data.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "Bus.h"
+#include "ServerCommand.h"
+
+//! Largest packet data which the server sends or receives.
+constexpr size_t MAX_PACKET_DATA_LEN = 256;
+
+//! @brief Extracts little endian values from the data portion of a packet.
+//!
+//! @details Reads past the end of the data fail and leave the reader in an
+//!          error state, so a sequence of reads can be checked once at the end.
+class PacketReader {
+ public:
+    //! @brief Constructor.
+    explicit PacketReader(Packet const& packet)
+        : m_data(packet.getData()), m_len(packet.getLength()) {}
+
+    //! @brief Constructor.
+    PacketReader(uint8_t const* data, size_t len) : m_data(data), m_len(len) {}
+
+    //! @returns true if all reads so far have succeeded.
+    bool ok() const { return this->m_ok; }
+
+    //! @returns the number of bytes which haven't been read yet.
+    size_t remaining() const { return this->m_len - this->m_pos; }
+
+    //! @returns a pointer to the next unread byte.
+    uint8_t const* current() const { return &this->m_data[this->m_pos]; }
+
+    //! @brief Reads a value (little endian) from the packet.
+    //! @returns the value read, or 0 if there wasn't enough data.
+    template <typename T>
+    T read() {
+        if (this->remaining() < sizeof(T)) {
+            this->m_ok = false;
+            this->m_pos = this->m_len;
+            return 0;
+        }
+        T val = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            val |= static_cast<T>(static_cast<T>(this->m_data[this->m_pos++]) << (8 * i));
+        }
+        return val;
+    }
+
+    //! @brief Skips over bytes in the packet.
+    void skip(size_t len) {
+        if (this->remaining() < len) {
+            this->m_ok = false;
+            len = this->remaining();
+        }
+        this->m_pos += len;
+    }
+
+ private:
+    uint8_t const* m_data;  //!< Data being parsed.
+    size_t m_len;           //!< Number of bytes of data.
+    size_t m_pos = 0;       //!< Index of the next byte to read.
+    bool m_ok = true;       //!< Set to false when a read runs past the end.
+};
+
+//! @brief Appends little endian values to the data portion of a packet.
+//!
+//! @details Packets are never filled beyond the packet size negotiated with
+//!          the current client (see Handshake), even if the buffer is larger.
+class PacketWriter {
+ public:
+    //! @brief Constructor. Sets the command and clears the packet data.
+    PacketWriter(Packet* packet, uint8_t command) : m_packet(packet) {
+        packet->setCommand(command);
+        packet->setLength(0);
+    }
+
+    //! @returns true if all writes so far have fit in the packet.
+    bool ok() const { return this->m_ok; }
+
+    //! @brief Sets the largest packet data the current client accepts.
+    static void setLimit(
+        size_t limit  //!< [in] Negotiated packet size.
+    ) {
+        s_limit = limit;
+    }
+
+    //! @returns the most data which packet may be given.
+    static size_t maxLength(
+        Packet const& packet  //!< [in] Packet which will be sent.
+    ) {
+        return std::min(packet.getMaxLength(), s_limit);
+    }
+
+    //! @returns the number of bytes which can still be appended.
+    size_t remaining() const {
+        size_t maxLen = maxLength(*this->m_packet);
+        size_t len = this->m_packet->getLength();
+        return len < maxLen ? maxLen - len : 0;
+    }
+
+    //! @brief Appends a value (little endian) to the packet.
+    template <typename T>
+    void write(T val) {
+        uint8_t bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++) {
+            bytes[i] = static_cast<uint8_t>(val >> (8 * i));
+        }
+        this->append(bytes, sizeof(bytes));
+    }
+
+    //! @brief Appends raw bytes to the packet.
+    void append(void const* data, size_t len) {
+        if (this->remaining() < len) {
+            this->m_ok = false;
+            return;
+        }
+        size_t pktLen = this->m_packet->getLength();
+        memcpy(&this->m_packet->getData()[pktLen], data, len);
+        this->m_packet->setLength(pktLen + len);
+    }
+
+    //! @brief Replaces the packet contents with an ERROR response.
+    static void error(Packet* packet, uint8_t command, ServerError err) {
+        PacketWriter writer(packet, ServerCommand::ERROR);
+        writer.write(command);
+        writer.write(static_cast<uint8_t>(err));
+    }
+
+ private:
+    static inline size_t s_limit = MAX_PACKET_DATA_LEN;  //!< Negotiated packet size.
+
+    Packet* m_packet;  //!< Packet being built.
+    bool m_ok = true;  //!< Set to false when a write doesn't fit.
+};
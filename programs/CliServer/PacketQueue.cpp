@@ -0,0 +1,189 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PacketQueue.cpp
+ *
+ *   @brief  Persistent, memory mapped queue of packets.
+ *
+ ****************************************************************************/
+
+#include "PacketQueue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Log.h"
+
+namespace {
+
+constexpr uint32_t QUEUE_MAGIC = 0x51505144;  // "DQPQ"
+constexpr uint32_t QUEUE_VERSION = 1;
+
+//! Number of bytes in front of the data in each record.
+constexpr size_t RECORD_HDR_LEN = 3;
+
+}  // namespace
+
+//! Layout of the start of the queue file.
+struct PacketQueue::Header {
+    uint32_t magic;     //!< QUEUE_MAGIC
+    uint32_t version;   //!< QUEUE_VERSION
+    uint64_t capacity;  //!< Size of the record area.
+    uint64_t head;      //!< Offset of the oldest record.
+    uint64_t tail;      //!< Offset where the next record will be written.
+};
+
+PacketQueue::~PacketQueue() {
+    this->close();
+}
+
+bool PacketQueue::open(char const* fileName, size_t capacity) {
+    this->close();
+
+    this->m_fd = ::open(fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (this->m_fd < 0) {
+        Log::error("Unable to open queue file '%s': %s", fileName, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(this->m_fd, &st) < 0) {
+        Log::error("Unable to stat queue file '%s': %s", fileName, strerror(errno));
+        this->close();
+        return false;
+    }
+
+    // Reuse the existing queue (and its capacity) if the file has a valid header.
+    Header existing = {};
+    bool valid = false;
+    if (static_cast<size_t>(st.st_size) >= sizeof(Header) &&
+        pread(this->m_fd, &existing, sizeof(existing), 0) == sizeof(existing)) {
+        valid = existing.magic == QUEUE_MAGIC && existing.version == QUEUE_VERSION &&
+                static_cast<size_t>(st.st_size) == sizeof(Header) + existing.capacity &&
+                existing.tail >= existing.head && existing.tail - existing.head <= existing.capacity;
+    }
+    if (valid) {
+        capacity = existing.capacity;
+    } else if (ftruncate(this->m_fd, 0) < 0 || ftruncate(this->m_fd, sizeof(Header) + capacity) < 0) {
+        Log::error("Unable to size queue file '%s': %s", fileName, strerror(errno));
+        this->close();
+        return false;
+    }
+
+    this->m_mapLen = sizeof(Header) + capacity;
+    void* map = mmap(nullptr, this->m_mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, this->m_fd, 0);
+    if (map == MAP_FAILED) {
+        Log::error("Unable to map queue file '%s': %s", fileName, strerror(errno));
+        this->close();
+        return false;
+    }
+    this->m_header = static_cast<Header*>(map);
+    this->m_records = static_cast<uint8_t*>(map) + sizeof(Header);
+
+    if (valid) {
+        if (!this->isEmpty()) {
+            Log::info("Queue '%s' holds %zu bytes from a previous run", fileName, this->bytesUsed());
+        }
+    } else {
+        this->m_header->magic = QUEUE_MAGIC;
+        this->m_header->version = QUEUE_VERSION;
+        this->m_header->capacity = capacity;
+        this->m_header->head = 0;
+        this->m_header->tail = 0;
+    }
+    return true;
+}
+
+void PacketQueue::close() {
+    if (this->m_header != nullptr) {
+        munmap(this->m_header, this->m_mapLen);
+        this->m_header = nullptr;
+        this->m_records = nullptr;
+    }
+    if (this->m_fd >= 0) {
+        ::close(this->m_fd);
+        this->m_fd = -1;
+    }
+}
+
+bool PacketQueue::isEmpty() const {
+    return !this->isOpen() || this->m_header->head == this->m_header->tail;
+}
+
+size_t PacketQueue::bytesUsed() const {
+    return this->isOpen() ? this->m_header->tail - this->m_header->head : 0;
+}
+
+bool PacketQueue::push(uint8_t command, uint8_t const* data, size_t len) {
+    if (!this->isOpen() || len > UINT16_MAX) {
+        return false;
+    }
+    size_t recordLen = RECORD_HDR_LEN + len;
+    if (this->bytesUsed() + recordLen > this->m_header->capacity) {
+        return false;
+    }
+    uint8_t hdr[RECORD_HDR_LEN] = {
+        static_cast<uint8_t>(len),
+        static_cast<uint8_t>(len >> 8),
+        command,
+    };
+    uint64_t tail = this->m_header->tail;
+    this->copyIn(tail, hdr, sizeof(hdr));
+    this->copyIn(tail + sizeof(hdr), data, len);
+
+    // Only publish the record once it has been completely written.
+    this->m_header->tail = tail + recordLen;
+    return true;
+}
+
+size_t PacketQueue::drain(SendFn const& send) {
+    size_t numSent = 0;
+    uint8_t data[UINT16_MAX];
+    while (!this->isEmpty()) {
+        uint64_t head = this->m_header->head;
+        uint8_t hdr[RECORD_HDR_LEN];
+        this->copyOut(head, hdr, sizeof(hdr));
+        size_t len = hdr[0] | (hdr[1] << 8);
+        this->copyOut(head + sizeof(hdr), data, len);
+        if (!send(hdr[2], data, len)) {
+            break;
+        }
+        this->m_header->head = head + RECORD_HDR_LEN + len;
+        numSent++;
+    }
+    if (this->isEmpty()) {
+        // Restart at the beginning so the offsets don't grow forever.
+        this->m_header->head = 0;
+        this->m_header->tail = 0;
+    }
+    return numSent;
+}
+
+void PacketQueue::copyIn(uint64_t offset, void const* src, size_t len) {
+    size_t capacity = this->m_header->capacity;
+    size_t pos = offset % capacity;
+    size_t firstLen = std::min(len, capacity - pos);
+    memcpy(&this->m_records[pos], src, firstLen);
+    memcpy(this->m_records, static_cast<uint8_t const*>(src) + firstLen, len - firstLen);
+}
+
+void PacketQueue::copyOut(uint64_t offset, void* dst, size_t len) const {
+    size_t capacity = this->m_header->capacity;
+    size_t pos = offset % capacity;
+    size_t firstLen = std::min(len, capacity - pos);
+    memcpy(dst, &this->m_records[pos], firstLen);
+    memcpy(static_cast<uint8_t*>(dst) + firstLen, this->m_records, len - firstLen);
+}
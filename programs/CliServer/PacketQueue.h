@@ -0,0 +1,97 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PacketQueue.h
+ *
+ *   @brief  Persistent, memory mapped queue of packets.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+//! @brief A FIFO of packets stored in a memory mapped file.
+//!
+//! @details The file holds a small header followed by a circular log of
+//!          records. Records are only ever appended at the tail and consumed
+//!          from the head, and the head and tail are stored as ever increasing
+//!          byte offsets, so the queue survives a restart of the server.
+//!
+//!          Each record is stored as:
+//!              uint16_t dataLen
+//!              uint8_t  command
+//!              uint8_t  data[dataLen]
+class PacketQueue {
+ public:
+    //! Default size of the record area.
+    static constexpr size_t DEFAULT_CAPACITY = 1024 * 1024;
+
+    //! Called for each queued packet by drain. Returns false to stop draining.
+    using SendFn = std::function<bool(uint8_t command, uint8_t const* data, size_t len)>;
+
+    //! @brief Constructor.
+    PacketQueue() = default;
+
+    //! @brief Destructor. Unmaps the queue file.
+    ~PacketQueue();
+
+    PacketQueue(PacketQueue const&) = delete;
+    PacketQueue& operator=(PacketQueue const&) = delete;
+
+    //! @brief Opens (or creates) the queue file.
+    //! @details If the file already contains a queue, then any packets
+    //!          queued by a previous run are preserved.
+    //! @returns true if the queue was opened successfully.
+    bool open(
+        char const* fileName,               //!< [in] Name of the queue file.
+        size_t capacity = DEFAULT_CAPACITY  //!< [in] Size of the record area, in bytes.
+    );
+
+    //! @brief Unmaps and closes the queue file.
+    void close();
+
+    //! @returns true if the queue file is open.
+    bool isOpen() const { return this->m_header != nullptr; }
+
+    //! @returns true if there are no queued packets.
+    bool isEmpty() const;
+
+    //! @returns the number of bytes used by queued records.
+    size_t bytesUsed() const;
+
+    //! @brief Appends a packet to the end of the queue.
+    //! @returns false if the queue is full (the packet is dropped).
+    bool push(
+        uint8_t command,       //!< [in] Command byte of the packet.
+        uint8_t const* data,   //!< [in] Packet data.
+        size_t len             //!< [in] Number of bytes of packet data.
+    );
+
+    //! @brief Passes queued packets to send, oldest first.
+    //! @details Packets are removed from the queue once send returns true.
+    //! @returns the number of packets removed from the queue.
+    size_t drain(
+        SendFn const& send  //!< [in] Function used to send each packet.
+    );
+
+ private:
+    struct Header;
+
+    void copyIn(uint64_t offset, void const* src, size_t len);
+    void copyOut(uint64_t offset, void* dst, size_t len) const;
+
+    int m_fd = -1;                  //!< File descriptor of the queue file.
+    Header* m_header = nullptr;     //!< Mapping of the queue file.
+    uint8_t* m_records = nullptr;   //!< Start of the record area.
+    size_t m_mapLen = 0;            //!< Number of bytes mapped.
+};
@@ -0,0 +1,216 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PcapngWriter.cpp
+ *
+ *   @brief  Writes packet traffic to a pcapng file which can be loaded into
+ *           Wireshark.
+ *
+ ****************************************************************************/
+
+#include "PcapngWriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "Log.h"
+
+namespace {
+
+// Block types (see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng)
+constexpr uint32_t BLOCK_SECTION_HEADER = 0x0A0D0D0A;
+constexpr uint32_t BLOCK_INTERFACE_DESCRIPTION = 0x00000001;
+constexpr uint32_t BLOCK_ENHANCED_PACKET = 0x00000006;
+
+constexpr uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+
+// Option codes
+constexpr uint16_t OPT_ENDOFOPT = 0;
+constexpr uint16_t OPT_IF_NAME = 2;
+constexpr uint16_t OPT_IF_TSRESOL = 9;
+constexpr uint16_t OPT_EPB_FLAGS = 2;
+
+//! Timestamp resolution of 10^-9 seconds.
+constexpr uint8_t TSRESOL_NANOSECONDS = 9;
+
+//! @returns len rounded up to a multiple of 4.
+constexpr size_t pad4(size_t len) {
+    return (len + 3) & ~static_cast<size_t>(3);
+}
+
+}  // namespace
+
+PcapngWriter::~PcapngWriter() {
+    this->close();
+}
+
+bool PcapngWriter::open(char const* fileName) {
+    this->close();
+
+    this->m_fd = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (this->m_fd < 0) {
+        Log::error("Unable to open capture file '%s': %s", fileName, strerror(errno));
+        return false;
+    }
+    this->m_numInterfaces = 0;
+    this->m_buffer.reserve(FLUSH_THRESHOLD * 2);
+
+    {
+        std::lock_guard<std::mutex> lock(this->m_mutex);
+
+        // Section Header Block with no options.
+        constexpr uint32_t blockLen = 28;
+        this->appendU32(BLOCK_SECTION_HEADER);
+        this->appendU32(blockLen);
+        this->appendU32(BYTE_ORDER_MAGIC);
+        this->appendU16(1);  // Major version
+        this->appendU16(0);  // Minor version
+        this->appendU32(0xffffffff);  // Section length (unknown)
+        this->appendU32(0xffffffff);
+        this->appendU32(blockLen);
+        this->m_done = false;
+    }
+    this->m_thread = std::thread(&PcapngWriter::writerThread, this);
+    return true;
+}
+
+void PcapngWriter::close() {
+    if (!this->isOpen()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->m_mutex);
+        this->m_done = true;
+    }
+    this->m_cond.notify_one();
+    this->m_thread.join();
+    ::close(this->m_fd);
+    this->m_fd = -1;
+}
+
+uint32_t PcapngWriter::addInterface(char const* name) {
+    std::lock_guard<std::mutex> lock(this->m_mutex);
+
+    size_t nameLen = strlen(name);
+    uint32_t blockLen = 20 + 4 + pad4(nameLen) + 4 + 4 + 4;
+
+    this->appendU32(BLOCK_INTERFACE_DESCRIPTION);
+    this->appendU32(blockLen);
+    this->appendU16(LINK_TYPE);
+    this->appendU16(0);  // Reserved
+    this->appendU32(0);  // Snap length (no limit)
+    this->appendOption(OPT_IF_NAME, name, nameLen);
+    this->appendOption(OPT_IF_TSRESOL, &TSRESOL_NANOSECONDS, sizeof(TSRESOL_NANOSECONDS));
+    this->appendOption(OPT_ENDOFOPT, nullptr, 0);
+    this->appendU32(blockLen);
+
+    return this->m_numInterfaces++;
+}
+
+void PcapngWriter::writePacket(
+    uint32_t interfaceId,
+    uint64_t timestampNs,
+    Direction direction,
+    uint8_t command,
+    uint8_t const* data,
+    size_t dataLen) {
+    if (!this->isOpen()) {
+        return;
+    }
+    uint32_t frameLen = 1 + dataLen;
+    uint32_t blockLen = 28 + pad4(frameLen) + 8 + 4 + 4;
+    uint32_t flags = static_cast<uint32_t>(direction);
+    bool wakeWriter;
+    {
+        std::lock_guard<std::mutex> lock(this->m_mutex);
+
+        this->appendU32(BLOCK_ENHANCED_PACKET);
+        this->appendU32(blockLen);
+        this->appendU32(interfaceId);
+        this->appendU32(static_cast<uint32_t>(timestampNs >> 32));
+        this->appendU32(static_cast<uint32_t>(timestampNs));
+        this->appendU32(frameLen);  // Captured length
+        this->appendU32(frameLen);  // Original length
+        this->appendBytes(&command, 1);
+        this->appendBytes(data, dataLen);
+        this->appendPadding(pad4(frameLen) - frameLen);
+        this->appendOption(OPT_EPB_FLAGS, &flags, sizeof(flags));
+        this->appendOption(OPT_ENDOFOPT, nullptr, 0);
+        this->appendU32(blockLen);
+
+        wakeWriter = this->m_buffer.size() >= FLUSH_THRESHOLD;
+    }
+    if (wakeWriter) {
+        this->m_cond.notify_one();
+    }
+}
+
+void PcapngWriter::appendU16(uint16_t val) {
+    this->appendBytes(reinterpret_cast<uint8_t const*>(&val), sizeof(val));
+}
+
+void PcapngWriter::appendU32(uint32_t val) {
+    this->appendBytes(reinterpret_cast<uint8_t const*>(&val), sizeof(val));
+}
+
+void PcapngWriter::appendBytes(uint8_t const* data, size_t len) {
+    this->m_buffer.insert(this->m_buffer.end(), data, data + len);
+}
+
+void PcapngWriter::appendPadding(size_t len) {
+    this->m_buffer.insert(this->m_buffer.end(), len, 0);
+}
+
+void PcapngWriter::appendOption(uint16_t code, void const* data, uint16_t len) {
+    this->appendU16(code);
+    this->appendU16(len);
+    this->appendBytes(static_cast<uint8_t const*>(data), len);
+    this->appendPadding(pad4(len) - len);
+}
+
+void PcapngWriter::writerThread() {
+    std::vector<uint8_t> writeBuffer;
+    writeBuffer.reserve(FLUSH_THRESHOLD * 2);
+
+    bool done = false;
+    while (!done) {
+        {
+            std::unique_lock<std::mutex> lock(this->m_mutex);
+
+            // Wake up periodically so that a mostly idle capture still makes
+            // it to disk in a timely fashion.
+            this->m_cond.wait_for(lock, std::chrono::seconds(1), [this] {
+                return this->m_done || this->m_buffer.size() >= FLUSH_THRESHOLD;
+            });
+            done = this->m_done;
+            writeBuffer.swap(this->m_buffer);
+        }
+
+        uint8_t const* data = writeBuffer.data();
+        size_t len = writeBuffer.size();
+        while (len > 0) {
+            ssize_t bytesWritten = ::write(this->m_fd, data, len);
+            if (bytesWritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                Log::error("Write to capture file failed: %s", strerror(errno));
+                break;
+            }
+            data += bytesWritten;
+            len -= bytesWritten;
+        }
+        writeBuffer.clear();
+    }
+}
@@ -0,0 +1,103 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PcapngWriter.h
+ *
+ *   @brief  Writes packet traffic to a pcapng file which can be loaded into
+ *           Wireshark.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! @brief Writes packets into a pcapng capture file.
+//!
+//! @details Each transport is recorded as its own pcapng interface using the
+//!          LINKTYPE_USER0 link type with nanosecond timestamps. Each captured
+//!          frame consists of the command byte followed by the packet data.
+//!          The direction of the packet is recorded in the epb_flags option.
+//!
+//!          Blocks are assembled into an in-memory buffer and a background
+//!          thread writes the buffer to disk using large writes, so that
+//!          capturing doesn't add file I/O to the packet path.
+class PcapngWriter {
+ public:
+    //! Link type used for the captured frames (LINKTYPE_USER0).
+    static constexpr uint16_t LINK_TYPE = 147;
+
+    //! Number of buffered bytes which will cause the writer thread to wake up.
+    static constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    //! Direction that a captured packet travelled.
+    enum class Direction : uint8_t {
+        INBOUND = 1,   //!< Packet was received by the server.
+        OUTBOUND = 2,  //!< Packet was sent by the server.
+    };
+
+    //! @brief Constructor.
+    PcapngWriter() = default;
+
+    //! @brief Destructor. Flushes any buffered data and closes the file.
+    ~PcapngWriter();
+
+    PcapngWriter(PcapngWriter const&) = delete;
+    PcapngWriter& operator=(PcapngWriter const&) = delete;
+
+    //! @brief Creates the capture file and starts the writer thread.
+    //! @returns true if the file was opened successfully.
+    bool open(
+        char const* fileName  //!< [in] Name of the capture file to create.
+    );
+
+    //! @brief Flushes buffered data, stops the writer thread and closes the file.
+    void close();
+
+    //! @returns true if a capture file is currently open.
+    bool isOpen() const { return this->m_fd >= 0; }
+
+    //! @brief Adds an interface description block.
+    //! @returns the interface id to pass to writePacket.
+    uint32_t addInterface(
+        char const* name  //!< [in] Name of the interface (i.e. "socket").
+    );
+
+    //! @brief Adds a packet to the capture.
+    void writePacket(
+        uint32_t interfaceId,  //!< [in] Interface returned from addInterface.
+        uint64_t timestampNs,  //!< [in] Time the packet was seen (Clock::realtimeNs).
+        Direction direction,   //!< [in] Direction the packet travelled.
+        uint8_t command,       //!< [in] Command byte from the packet.
+        uint8_t const* data,   //!< [in] Packet data.
+        size_t dataLen         //!< [in] Number of bytes of packet data.
+    );
+
+ private:
+    void appendU16(uint16_t val);
+    void appendU32(uint32_t val);
+    void appendBytes(uint8_t const* data, size_t len);
+    void appendPadding(size_t len);
+    void appendOption(uint16_t code, void const* data, uint16_t len);
+    void writerThread();
+
+    int m_fd = -1;                          //!< File descriptor of the capture file.
+    uint32_t m_numInterfaces = 0;           //!< Number of interfaces added so far.
+    std::vector<uint8_t> m_buffer;          //!< Blocks waiting to be written.
+    std::mutex m_mutex;                     //!< Protects m_buffer and m_done.
+    std::condition_variable m_cond;         //!< Used to wake up the writer thread.
+    bool m_done = false;                    //!< Tells the writer thread to exit.
+    std::thread m_thread;                   //!< Background writer thread.
+};
@@ -0,0 +1,51 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PiMutex.h
+ *
+ *   @brief  Mutex which is safe to share with a SCHED_FIFO thread.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <pthread.h>
+
+//! @brief A mutex using priority inheritance.
+//!
+//! @details While a realtime thread is waiting for the mutex, whichever
+//!          thread holds it runs at the realtime thread's priority, so a
+//!          normal priority holder can't be preempted part way through
+//!          (for example in the middle of a device write) and leave the
+//!          realtime thread waiting indefinitely.
+//!
+//!          Can be used with std::lock_guard like std::mutex.
+class PiMutex {
+ public:
+    PiMutex() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+        pthread_mutex_init(&this->m_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    ~PiMutex() { pthread_mutex_destroy(&this->m_mutex); }
+
+    PiMutex(PiMutex const&) = delete;
+    PiMutex& operator=(PiMutex const&) = delete;
+
+    void lock() { pthread_mutex_lock(&this->m_mutex); }
+
+    void unlock() { pthread_mutex_unlock(&this->m_mutex); }
+
+ private:
+    pthread_mutex_t m_mutex;  //!< The underlying mutex.
+};
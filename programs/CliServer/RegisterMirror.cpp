@@ -0,0 +1,281 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RegisterMirror.cpp
+ *
+ *   @brief  Mirror of a device control table with coalesced write-back.
+ *
+ ****************************************************************************/
+
+#include "RegisterMirror.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "Log.h"
+#include "Metrics.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+RegisterMirror::~RegisterMirror() {
+    if (this->m_fd >= 0) {
+        ::close(this->m_fd);
+    }
+}
+
+bool RegisterMirror::open(char const* fileName) {
+    this->m_fd = ::open(fileName, O_RDWR | O_CLOEXEC);
+    if (this->m_fd < 0) {
+        Log::error("Unable to open mirror device '%s': %s", fileName, strerror(errno));
+        return false;
+    }
+    ssize_t len = pread(this->m_fd, this->m_table.data(), this->m_table.size(), 0);
+    if (len < 0 || static_cast<size_t>(len) != this->m_table.size()) {
+        Log::error(
+            "Unable to read %zu bytes from mirror device '%s': %s", this->m_table.size(), fileName,
+            len < 0 ? strerror(errno) : "too small");
+        return false;
+    }
+    return true;
+}
+
+bool RegisterMirror::setFlushPolicy(char const* policy) {
+    if (strcmp(policy, "immediate") == 0) {
+        this->m_policy = FlushPolicy::IMMEDIATE;
+    } else if (strcmp(policy, "sync") == 0) {
+        this->m_policy = FlushPolicy::SYNC;
+    } else if (strncmp(policy, "periodic:", 9) == 0) {
+        this->m_policy = FlushPolicy::PERIODIC;
+        this->m_flushIntervalMs = strtoul(&policy[9], nullptr, 0);
+        if (this->m_flushIntervalMs == 0) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void RegisterMirror::poll(uint64_t nowMs) {
+    if (!this->needsPoll() || nowMs < this->m_nextFlushMs) {
+        return;
+    }
+    this->m_nextFlushMs = nowMs + this->m_flushIntervalMs;
+    this->flush();
+}
+
+size_t RegisterMirror::flush() {
+    std::lock_guard<PiMutex> lock(this->m_mutex);
+    return this->flushLocked();
+}
+
+size_t RegisterMirror::flushLocked() {
+    if (this->m_fd < 0) {
+        this->m_dirty.clear();
+        return 0;
+    }
+    size_t numWrites = 0;
+
+    auto it = this->m_dirty.begin();
+    while (it != this->m_dirty.end()) {
+        // Merge following ranges while the gap is small.
+        size_t start = it->first;
+        size_t end = it->second;
+        for (++it; it != this->m_dirty.end() && it->first - end <= GAP_BYTES; ++it) {
+            end = it->second;
+        }
+        this->writeRange(start, end);
+        numWrites++;
+    }
+    this->m_dirty.clear();
+    return numWrites;
+}
+
+bool RegisterMirror::writeRange(size_t start, size_t end) {
+    ssize_t len = pwrite(this->m_fd, &this->m_table[start], end - start, start);
+    this->m_numDeviceWrites++;
+    if (len < 0 || static_cast<size_t>(len) != end - start) {
+        if (this->m_numDeviceErrors++ == 0) {
+            Log::error("Mirror write of %zu bytes at %zu failed: %s", end - start, start, strerror(errno));
+        }
+        return false;
+    }
+    return true;
+}
+
+void RegisterMirror::updateMetrics(Metrics* metrics) const {
+    std::lock_guard<PiMutex> lock(this->m_mutex);
+    metrics->set("cliserver_mirror_writes_total", this->m_numWrites);
+    metrics->set("cliserver_mirror_device_reads_total", this->m_numDeviceReads);
+    metrics->set("cliserver_mirror_device_writes_total", this->m_numDeviceWrites);
+    metrics->set("cliserver_mirror_device_errors_total", this->m_numDeviceErrors);
+    metrics->set("cliserver_mirror_dirty_ranges", this->m_dirty.size());
+}
+
+bool RegisterMirror::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (!this->isEnabled()) {
+        return false;
+    }
+    switch (cmd.getCommand()) {
+        case ServerCommand::REG_READ: {
+            PacketReader reader(cmd);
+            auto address = reader.read<uint16_t>();
+            auto length = reader.read<uint8_t>();
+            if (!reader.ok() || address + length > this->m_table.size()) {
+                PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+                return true;
+            }
+            std::lock_guard<PiMutex> lock(this->m_mutex);
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.append(&this->m_table[address], length);
+            return true;
+        }
+        case ServerCommand::REG_WRITE: {
+            PacketReader reader(cmd);
+            auto address = reader.read<uint16_t>();
+            if (!reader.ok() || !this->write(address, reader.current(), reader.remaining())) {
+                PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+                return true;
+            }
+            PacketWriter writer(rsp, cmd.getCommand());
+            return true;
+        }
+        case ServerCommand::REG_SYNC: {
+            size_t numWrites = this->flush();
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(static_cast<uint16_t>(numWrites));
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RegisterMirror::read(size_t address, uint8_t* data, size_t length) {
+    if (address + length > this->m_table.size()) {
+        return false;
+    }
+    std::lock_guard<PiMutex> lock(this->m_mutex);
+    if (this->m_fd >= 0) {
+        ssize_t len = pread(this->m_fd, data, length, address);
+        this->m_numDeviceReads++;
+        if (len < 0 || static_cast<size_t>(len) != length) {
+            this->m_numDeviceErrors++;
+            return false;
+        }
+        // Copy the fresh values into the mirror, except where a write
+        // hasn't been flushed yet.
+        size_t pos = address;
+        size_t end = address + length;
+        auto it = this->m_dirty.upper_bound(pos);
+        if (it != this->m_dirty.begin() && std::prev(it)->second > pos) {
+            --it;
+        }
+        for (; pos < end; ++it) {
+            size_t cleanEnd = it == this->m_dirty.end() ? end : std::min(end, it->first);
+            if (cleanEnd > pos) {
+                memcpy(&this->m_table[pos], &data[pos - address], cleanEnd - pos);
+            }
+            if (it == this->m_dirty.end()) {
+                break;
+            }
+            pos = std::max(pos, it->second);
+        }
+    }
+    memcpy(data, &this->m_table[address], length);
+    return true;
+}
+
+bool RegisterMirror::write(size_t address, uint8_t const* data, size_t length) {
+    if (address + length > this->m_table.size()) {
+        return false;
+    }
+    std::lock_guard<PiMutex> lock(this->m_mutex);
+    this->m_numWrites++;
+
+    // Only bytes which actually change need to go to the device.
+    for (size_t i = 0; i < length; i++) {
+        if (this->m_table[address + i] != data[i]) {
+            size_t start = address + i;
+            while (i < length && this->m_table[address + i] != data[i]) {
+                this->m_table[address + i] = data[i];
+                i++;
+            }
+            this->markDirty(start, address + i);
+        }
+    }
+    if (this->m_policy == FlushPolicy::IMMEDIATE) {
+        this->flushLocked();
+    }
+    return true;
+}
+
+bool RegisterMirror::writeThrough(size_t address, uint8_t const* data, size_t length) {
+    if (address + length > this->m_table.size()) {
+        return false;
+    }
+    std::lock_guard<PiMutex> lock(this->m_mutex);
+    this->m_numWrites++;
+
+    // The changed bytes go out in a single write, from the first one which
+    // changed to the last.
+    size_t start = length;
+    size_t end = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (this->m_table[address + i] != data[i]) {
+            this->m_table[address + i] = data[i];
+            start = std::min(start, i);
+            end = i + 1;
+        }
+    }
+    if (start < end && this->m_fd >= 0) {
+        this->writeRange(address + start, address + end);
+        this->markClean(address + start, address + end);
+    }
+    return true;
+}
+
+void RegisterMirror::markDirty(size_t start, size_t end) {
+    // Absorb any ranges which overlap or touch [start, end).
+    auto it = this->m_dirty.upper_bound(start);
+    if (it != this->m_dirty.begin() && std::prev(it)->second >= start) {
+        --it;
+    }
+    while (it != this->m_dirty.end() && it->first <= end) {
+        start = std::min(start, it->first);
+        end = std::max(end, it->second);
+        it = this->m_dirty.erase(it);
+    }
+    this->m_dirty[start] = end;
+}
+
+void RegisterMirror::markClean(size_t start, size_t end) {
+    // Trim (or split) any ranges which overlap [start, end).
+    auto it = this->m_dirty.upper_bound(start);
+    if (it != this->m_dirty.begin() && std::prev(it)->second > start) {
+        --it;
+    }
+    while (it != this->m_dirty.end() && it->first < end) {
+        size_t rangeStart = it->first;
+        size_t rangeEnd = it->second;
+        it = this->m_dirty.erase(it);
+        if (rangeStart < start) {
+            this->m_dirty[rangeStart] = start;
+        }
+        if (rangeEnd > end) {
+            this->m_dirty[end] = rangeEnd;
+        }
+    }
+}
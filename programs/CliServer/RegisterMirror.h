@@ -0,0 +1,177 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RegisterMirror.h
+ *
+ *   @brief  Mirror of a device control table with coalesced write-back.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "Bus.h"
+#include "PiMutex.h"
+
+class Metrics;
+
+//! @brief Keeps a copy of the device's control table.
+//!
+//! @details The control table is a file (typically a device node or sysfs
+//!          attribute, such as a UIO region or an EEPROM) which is read
+//!          into the mirror when it's opened. Reads are answered from the
+//!          mirror. Writes update the mirror and mark the bytes dirty. When
+//!          the mirror is flushed, the dirty ranges are merged (ranges
+//!          separated by a gap of GAP_BYTES or less are written as one,
+//!          rewriting the clean bytes in between from the mirror) and
+//!          written to the device with as few writes as possible.
+//!
+//!          Without a device the mirror just holds local state, and
+//!          flushing only forgets which bytes were dirty.
+//!
+//!          The control loop uses the mirror from its own (SCHED_FIFO)
+//!          thread, so the table is only touched with m_mutex held. Device
+//!          reads and writes happen with the mutex held, so it's a
+//!          priority inheritance mutex: a normal priority holder is boosted
+//!          while the control loop waits for it.
+//!
+//!          REG_READ:  uint16_t address, uint8_t length -> data
+//!          REG_WRITE: uint16_t address, data
+//!          REG_SYNC:  -> uint16_t numWrites
+class RegisterMirror : public IPacketHandler {
+ public:
+    //! When dirty registers are written back to the device.
+    enum class FlushPolicy {
+        IMMEDIATE,  //!< After every REG_WRITE.
+        PERIODIC,   //!< Every flush interval.
+        SYNC,       //!< Only on REG_SYNC.
+    };
+
+    //! Clean gaps of this many bytes (or fewer) are rewritten rather than
+    //! starting a new write, since each write costs more.
+    static constexpr size_t GAP_BYTES = 4;
+
+    //! Default size of the control table.
+    static constexpr size_t DEFAULT_SIZE = 256;
+
+    RegisterMirror() = default;
+
+    //! @brief Destructor. Closes the device.
+    ~RegisterMirror() override;
+
+    RegisterMirror(RegisterMirror const&) = delete;
+    RegisterMirror& operator=(RegisterMirror const&) = delete;
+
+    //! @brief Sets the size of the control table (and enables the mirror).
+    void setSize(
+        size_t size  //!< [in] Number of bytes in the control table.
+    ) {
+        this->m_table.assign(size, 0);
+    }
+
+    //! @returns true if the mirror has been enabled.
+    bool isEnabled() const { return !this->m_table.empty(); }
+
+    //! @returns the number of bytes in the control table.
+    size_t size() const { return this->m_table.size(); }
+
+    //! @returns true if the mirror is backed by a device.
+    bool hasDevice() const { return this->m_fd >= 0; }
+
+    //! @brief Opens the device holding the control table and loads the mirror from it.
+    //! @details Must be called after setSize.
+    //! @returns false if the device can't be opened or is too small.
+    bool open(
+        char const* fileName  //!< [in] Device (or file) holding the control table.
+    );
+
+    //! @brief Parses a flush policy of the form "immediate", "sync" or "periodic:MS".
+    //! @returns false if the policy isn't recognized.
+    bool setFlushPolicy(
+        char const* policy  //!< [in] Policy string from the command line.
+    );
+
+    //! @returns true if the mirror needs to be polled periodically.
+    bool needsPoll() const { return this->isEnabled() && this->m_policy == FlushPolicy::PERIODIC; }
+
+    //! @brief Flushes the mirror when using the periodic policy.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Reads registers from the device, refreshing the mirror.
+    //! @details Registers with unflushed writes keep their mirrored value.
+    //!          Without a device the mirrored values are returned.
+    //! @returns false if the range is outside the table or the read failed.
+    bool read(
+        size_t address,  //!< [in] First register to read.
+        uint8_t* data,   //!< [out] Register values.
+        size_t length    //!< [in] Number of registers to read.
+    );
+
+    //! @brief Updates registers, marking the ones which change as dirty.
+    //! @details Flushes straight away when using FlushPolicy::IMMEDIATE.
+    //! @returns false if the range is outside the table.
+    bool write(
+        size_t address,       //!< [in] First register to write.
+        uint8_t const* data,  //!< [in] New register values.
+        size_t length         //!< [in] Number of registers to write.
+    );
+
+    //! @brief Updates registers and writes the ones which change straight
+    //!        to the device.
+    //! @details Used by the control loop, whose outputs go out every cycle
+    //!          whatever the flush policy. Only the range written becomes
+    //!          clean: other dirty ranges wait for the flush policy.
+    //! @returns false if the range is outside the table.
+    bool writeThrough(
+        size_t address,       //!< [in] First register to write.
+        uint8_t const* data,  //!< [in] New register values.
+        size_t length         //!< [in] Number of registers to write.
+    );
+
+    //! @brief Writes all of the dirty ranges back to the device.
+    //! @returns the number of writes made.
+    size_t flush();
+
+    //! @brief Publishes the mirror statistics.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+    //! @brief Handles the REG_READ, REG_WRITE and REG_SYNC commands.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    size_t flushLocked();
+    bool writeRange(size_t start, size_t end);
+    void markDirty(size_t start, size_t end);
+    void markClean(size_t start, size_t end);
+
+    mutable PiMutex m_mutex;                    //!< Protects everything below.
+    int m_fd = -1;                              //!< Device holding the control table.
+    std::vector<uint8_t> m_table;               //!< Mirror of the control table.
+    std::map<size_t, size_t> m_dirty;           //!< Dirty ranges: start -> end (exclusive).
+    FlushPolicy m_policy = FlushPolicy::IMMEDIATE;  //!< When to write back.
+    uint32_t m_flushIntervalMs = 0;             //!< Interval for FlushPolicy::PERIODIC.
+    uint64_t m_nextFlushMs = 0;                 //!< When to do the next periodic flush.
+    uint64_t m_numWrites = 0;                   //!< Writes (REG_WRITE or write) received.
+    uint64_t m_numDeviceReads = 0;              //!< Reads made from the device.
+    uint64_t m_numDeviceWrites = 0;             //!< Writes made to the device.
+    uint64_t m_numDeviceErrors = 0;             //!< Reads or writes of the device which failed.
+};
@@ -0,0 +1,123 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RequestQueue.cpp
+ *
+ *   @brief  Queue of parsed requests with CoDel based load shedding.
+ *
+ ****************************************************************************/
+
+#include "RequestQueue.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "LeaseManager.h"
+#include "Metrics.h"
+
+bool RequestQueue::push(
+    Packet const& cmd,
+    TraceContext const& trace,
+    uint64_t rxStartNs,
+    uint64_t rxDoneNs,
+    uint64_t queuedNs) {
+    // A DEVICE_REQUEST is as urgent as the command it wraps.
+    bool lowPriority = this->m_lowPriority.test(LeaseManager::targetCommand(cmd));
+    size_t numQueued = this->m_interactive.size() + this->m_lowPriorityQueue.size();
+    if (numQueued >= (lowPriority ? MAX_LOW_PRIORITY_QUEUED : MAX_QUEUED)) {
+        this->m_numRejected++;
+        return false;
+    }
+    auto& queue = lowPriority ? this->m_lowPriorityQueue : this->m_interactive;
+    queue.emplace_back();
+    Entry& entry = queue.back();
+    entry.command = cmd.getCommand();
+    entry.length = std::min(cmd.getLength(), MAX_DATA_LEN);
+    memcpy(entry.data.data(), cmd.getData(), entry.length);
+    entry.rxStartNs = rxStartNs;
+    entry.rxDoneNs = rxDoneNs;
+    entry.queuedNs = queuedNs;
+    entry.trace = trace;
+    entry.lowPriority = lowPriority;
+    return true;
+}
+
+bool RequestQueue::pop(uint64_t nowNs, Entry* entry, Verdict* verdict) {
+    auto& queue = this->m_interactive.empty() ? this->m_lowPriorityQueue : this->m_interactive;
+    if (queue.empty()) {
+        // An empty queue means we've caught up, which ends any shedding episode.
+        this->m_firstAboveNs = 0;
+        this->m_shedding = false;
+        return false;
+    }
+    *entry = queue.front();
+    queue.pop_front();
+
+    uint64_t sojournNs = nowNs > entry->queuedNs ? nowNs - entry->queuedNs : 0;
+    this->m_lastSojournNs = sojournNs;
+    *verdict = Verdict::HANDLE;
+    if (this->m_targetNs == 0) {
+        return true;
+    }
+
+    bool okToShed = this->okToShed(sojournNs, nowNs);
+    bool shed = false;
+    if (this->m_shedding) {
+        if (!okToShed) {
+            this->m_shedding = false;
+        } else if (nowNs >= this->m_shedNextNs) {
+            shed = true;
+            this->m_count++;
+            this->m_shedNextNs = this->controlLaw(this->m_shedNextNs);
+        }
+    } else if (okToShed) {
+        shed = true;
+        this->m_shedding = true;
+
+        // If we were shedding recently, start off near the rate we left at.
+        // m_shedNextNs may still be in the future, hence the signed delta.
+        int64_t sinceLastNs = static_cast<int64_t>(nowNs - this->m_shedNextNs);
+        bool recent = sinceLastNs < static_cast<int64_t>(8 * this->m_intervalNs);
+        this->m_count = (this->m_count > 2 && recent) ? this->m_count - 2 : 1;
+        this->m_shedNextNs = this->controlLaw(nowNs);
+    }
+
+    // Interactive requests are never shed, they just keep the clock running.
+    if (shed && entry->lowPriority) {
+        *verdict = Verdict::SHED;
+        this->m_numShed++;
+    }
+    return true;
+}
+
+void RequestQueue::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_queue_length", this->m_interactive.size() + this->m_lowPriorityQueue.size());
+    metrics->set("cliserver_queue_delay_ms", this->m_lastSojournNs / 1e6);
+    metrics->set("cliserver_requests_shed_total", this->m_numShed);
+    metrics->set("cliserver_requests_rejected_total", this->m_numRejected);
+}
+
+bool RequestQueue::okToShed(uint64_t sojournNs, uint64_t nowNs) {
+    if (sojournNs < this->m_targetNs) {
+        this->m_firstAboveNs = 0;
+        return false;
+    }
+    if (this->m_firstAboveNs == 0) {
+        this->m_firstAboveNs = nowNs + this->m_intervalNs;
+        return false;
+    }
+    return nowNs >= this->m_firstAboveNs;
+}
+
+uint64_t RequestQueue::controlLaw(uint64_t timeNs) const {
+    return timeNs + static_cast<uint64_t>(this->m_intervalNs / std::sqrt(static_cast<double>(this->m_count)));
+}
@@ -0,0 +1,142 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RequestQueue.h
+ *
+ *   @brief  Queue of parsed requests with CoDel based load shedding.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "Bus.h"
+#include "PacketData.h"
+#include "Tracer.h"
+
+class Metrics;
+
+//! @brief Holds requests between being parsed and being handled.
+//!
+//! @details Requests are split into interactive and low priority requests
+//!          (by command, looking inside DEVICE_REQUEST), and interactive
+//!          requests are always handled first.
+//!
+//!          When a target delay is set, the time each request spends in the
+//!          queue is tracked using the CoDel algorithm (RFC 8289). Once the
+//!          queueing delay has stayed above the target for a whole interval,
+//!          low priority requests are shed at an increasing rate until the
+//!          delay drops again. A shed request is answered immediately with
+//!          an OVERLOADED error instead of being handled. CoDel runs on the
+//!          monotonic clock, so stepping the wall clock can't start or end
+//!          a shedding episode.
+class RequestQueue {
+ public:
+    //! Largest packet which can be queued.
+    static constexpr size_t MAX_DATA_LEN = MAX_PACKET_DATA_LEN;
+
+    //! Requests arriving when this many are queued are rejected.
+    static constexpr size_t MAX_QUEUED = 64;
+
+    //! Low priority requests arriving when this many are queued are rejected,
+    //! which keeps the rest of the queue free for interactive requests.
+    static constexpr size_t MAX_LOW_PRIORITY_QUEUED = MAX_QUEUED / 2;
+
+    //! Default CoDel interval.
+    static constexpr uint64_t DEFAULT_INTERVAL_NS = 100000000;
+
+    //! A queued request.
+    struct Entry {
+        uint8_t command;                            //!< Command byte.
+        size_t length;                              //!< Number of bytes of data.
+        std::array<uint8_t, MAX_DATA_LEN> data;     //!< Packet data.
+        uint64_t rxStartNs;                         //!< When the first byte arrived.
+        uint64_t rxDoneNs;                          //!< When the packet was parsed (queued).
+        uint64_t queuedNs;                          //!< When it was queued (Clock::monotonicNs).
+        TraceContext trace;                         //!< Trace the request belongs to.
+        bool lowPriority;                           //!< May this request be shed?
+    };
+
+    //! What to do with a request taken from the queue.
+    enum class Verdict {
+        HANDLE,  //!< Handle the request normally.
+        SHED,    //!< Reject the request with an OVERLOADED error.
+    };
+
+    //! @brief Sets the target queueing delay.
+    void setTarget(
+        uint64_t targetNs,                          //!< [in] Target delay (0 disables shedding).
+        uint64_t intervalNs = DEFAULT_INTERVAL_NS   //!< [in] CoDel interval.
+    ) {
+        this->m_targetNs = targetNs;
+        this->m_intervalNs = intervalNs;
+    }
+
+    //! @brief Marks a command as low priority (sheddable).
+    void setLowPriority(
+        uint8_t command  //!< [in] Command to mark.
+    ) {
+        this->m_lowPriority.set(command);
+    }
+
+    //! @returns true if no requests are queued.
+    bool isEmpty() const { return this->m_interactive.empty() && this->m_lowPriorityQueue.empty(); }
+
+    //! @returns the number of requests queued.
+    size_t size() const { return this->m_interactive.size() + this->m_lowPriorityQueue.size(); }
+
+    //! @brief Adds a parsed packet to the queue.
+    //! @returns false if the queue is full and the request should be
+    //!          rejected with an OVERLOADED error.
+    bool push(
+        Packet const& cmd,          //!< [in] Packet which was parsed.
+        TraceContext const& trace,  //!< [in] Trace started when the packet arrived.
+        uint64_t rxStartNs,         //!< [in] When the first byte arrived (Clock::realtimeNs).
+        uint64_t rxDoneNs,          //!< [in] When the packet was parsed (Clock::realtimeNs).
+        uint64_t queuedNs           //!< [in] When the packet was parsed (Clock::monotonicNs).
+    );
+
+    //! @brief Takes the next request from the queue.
+    //! @returns false if the queue is empty.
+    bool pop(
+        uint64_t nowNs,      //!< [in] Current time (Clock::monotonicNs).
+        Entry* entry,        //!< [out] The request.
+        Verdict* verdict     //!< [out] Whether to handle or shed the request.
+    );
+
+    //! @brief Publishes the queue statistics.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    bool okToShed(uint64_t sojournNs, uint64_t nowNs);
+    uint64_t controlLaw(uint64_t timeNs) const;
+
+    std::bitset<256> m_lowPriority;             //!< Commands which may be shed.
+    std::deque<Entry> m_interactive;            //!< Interactive requests.
+    std::deque<Entry> m_lowPriorityQueue;       //!< Low priority requests.
+
+    uint64_t m_targetNs = 0;                    //!< Target queueing delay.
+    uint64_t m_intervalNs = DEFAULT_INTERVAL_NS;  //!< CoDel interval.
+    uint64_t m_firstAboveNs = 0;                //!< When the delay will have been above target for an interval.
+    uint64_t m_shedNextNs = 0;                  //!< When to shed the next request.
+    uint32_t m_count = 0;                       //!< Requests shed in this shedding episode.
+    bool m_shedding = false;                    //!< Are we in a shedding episode?
+
+    uint64_t m_lastSojournNs = 0;               //!< Queueing delay of the last request.
+    uint64_t m_numShed = 0;                     //!< Total requests shed.
+    uint64_t m_numRejected = 0;                 //!< Total requests rejected because the queue was full.
+};
@@ -0,0 +1,50 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ResponseTracker.h
+ *
+ *   @brief  Notices commands which no packet handler answered.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include "Bus.h"
+
+//! @brief Records whether a command got as far as the last handler.
+//!
+//! @details The bus offers each command to its handlers in the order they
+//!          were added, and writes the response of the first one which
+//!          handles it. Added last, the tracker is only reached by commands
+//!          which nothing else handled, so it tells the main loop whether
+//!          IBus::handlePacket wrote a response.
+class ResponseTracker : public IPacketHandler {
+ public:
+    //! @brief Forgets the previous command. Call before IBus::handlePacket.
+    void reset() { this->m_reached = false; }
+
+    //! @returns true if a handler answered the command since reset.
+    bool wasAnswered() const { return !this->m_reached; }
+
+    //! @brief Notes that no other handler took the command.
+    //! @returns false, so the bus carries on as if it weren't there.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override {
+        (void)cmd;
+        (void)rsp;
+        this->m_reached = true;
+        return false;
+    }
+
+ private:
+    bool m_reached = false;  //!< Did the last command reach the tracker?
+};
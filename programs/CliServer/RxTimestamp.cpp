@@ -0,0 +1,98 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RxTimestamp.cpp
+ *
+ *   @brief  Finds out when the data waiting on the bus actually arrived.
+ *
+ ****************************************************************************/
+
+#include "RxTimestamp.h"
+
+#include <errno.h>
+#include <linux/serial.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "Log.h"
+#include "Metrics.h"
+
+void RxTimestamp::attach(int fd) {
+    this->m_kernelStamps = false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return;
+    }
+    if (S_ISSOCK(st.st_mode)) {
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+            Log::warning("Unable to enable receive timestamps: %s", strerror(errno));
+            return;
+        }
+        this->m_kernelStamps = true;
+        return;
+    }
+
+    // Not all serial drivers support this, and the timestamps still work
+    // without it, so failures are ignored.
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0 && (serial.flags & ASYNC_LOW_LATENCY) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+}
+
+uint64_t RxTimestamp::arrivalNs(int fd, uint64_t wakeNs) {
+    if (this->m_kernelStamps) {
+        uint8_t byte;
+        struct iovec iov = {&byte, sizeof(byte)};
+        alignas(struct cmsghdr) uint8_t control[CMSG_SPACE(sizeof(struct timespec))];
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_PEEK | MSG_DONTWAIT) > 0) {
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+                    continue;
+                }
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                uint64_t rxNs = static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+                if (rxNs > wakeNs) {
+                    // The clock was stepped back since the data arrived.
+                    this->m_numStepped++;
+                } else if (rxNs != 0) {
+                    uint64_t delayUs = (wakeNs - rxNs) / 1000;
+                    this->m_numKernel++;
+                    this->m_wakeDelaySumUs += delayUs;
+                    this->m_wakeDelayMaxUs = std::max(this->m_wakeDelayMaxUs, delayUs);
+                    return rxNs;
+                }
+            }
+        }
+    }
+    this->m_numWake++;
+    return wakeNs;
+}
+
+void RxTimestamp::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_rx_kernel_stamps_total", this->m_numKernel);
+    metrics->set("cliserver_rx_wake_stamps_total", this->m_numWake);
+    metrics->set("cliserver_rx_stepped_stamps_total", this->m_numStepped);
+    metrics->set("cliserver_rx_wake_delay_us_sum", this->m_wakeDelaySumUs);
+    metrics->set("cliserver_rx_wake_delay_us_max", this->m_wakeDelayMaxUs);
+}
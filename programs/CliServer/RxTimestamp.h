@@ -0,0 +1,68 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RxTimestamp.h
+ *
+ *   @brief  Finds out when the data waiting on the bus actually arrived.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+class Metrics;
+
+//! @brief Timestamps received data as close to its arrival as possible.
+//!
+//! @details A timestamp taken when a byte is parsed includes the time it
+//!          took the server to be scheduled after poll returned (and
+//!          anything else the main loop did first), which is exactly the
+//!          delay that latency measurements need to expose.
+//!
+//!          For sockets, SO_TIMESTAMPNS is enabled and the kernel's receive
+//!          timestamp of the next unread byte is read (with MSG_PEEK, so the
+//!          bus still reads the data itself). Asking as each packet starts
+//!          gives each packet the timestamp of the segment it started in.
+//!          A timestamp later than the wakeup means the clock was stepped
+//!          back in between, so it's counted and the wakeup time is used
+//!          instead. TTYs don't keep receive
+//!          timestamps, so the best available is the time that poll
+//!          returned. The serial driver's low latency mode is also requested,
+//!          so that received bytes are pushed to the tty without waiting for
+//!          a timer.
+//!
+//!          All timestamps use the same clock as Clock::realtimeNs.
+class RxTimestamp {
+ public:
+    //! @brief Sets up timestamping on a newly opened bus.
+    void attach(
+        int fd  //!< [in] Socket or serial port used by the bus.
+    );
+
+    //! @returns when the next unread byte on fd arrived.
+    uint64_t arrivalNs(
+        int fd,         //!< [in] Socket or serial port used by the bus.
+        uint64_t wakeNs  //!< [in] When poll returned (Clock::realtimeNs).
+    );
+
+    //! @brief Publishes how long the server took to wake up for received data.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    bool m_kernelStamps = false;    //!< Is SO_TIMESTAMPNS enabled?
+    uint64_t m_numKernel = 0;       //!< Arrivals timestamped by the kernel.
+    uint64_t m_numWake = 0;         //!< Arrivals timestamped when poll returned.
+    uint64_t m_numStepped = 0;      //!< Kernel stamps discarded because the clock was stepped.
+    uint64_t m_wakeDelaySumUs = 0;  //!< Total delay from kernel receive to wakeup.
+    uint64_t m_wakeDelayMaxUs = 0;  //!< Largest delay from kernel receive to wakeup.
+};
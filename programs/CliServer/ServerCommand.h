@@ -0,0 +1,99 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ServerCommand.h
+ *
+ *   @brief  Commands implemented by the CliServer packet handlers.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+//! @brief Commands handled by CliServer itself (on top of the core commands).
+//!
+//! @details These live in their own range so that they don't collide with
+//!          the commands implemented by CorePacketHandler.
+namespace ServerCommand {
+
+enum : uint8_t {
+    ERROR = 0x40,        //!< Response sent when a server command fails.
+    DELTA_DUMP = 0x41,   //!< Dump memory, only returning changed blocks.
+    FW_BEGIN = 0x42,     //!< Start a firmware upload.
+    FW_DATA = 0x43,      //!< A chunk of firmware data.
+    FW_STATUS = 0x44,    //!< Report the progress of a firmware upload.
+    FW_FINISH = 0x45,    //!< Verify and commit a firmware upload.
+    LEASE_ACQUIRE = 0x46,  //!< Request (or poll for) a lease on a device.
+    LEASE_RENEW = 0x47,    //!< Extend a lease which is held.
+    LEASE_RELEASE = 0x48,  //!< Give up a lease (or a place in the queue).
+    LEASE_STATUS = 0x49,   //!< Report who holds a device.
+    LOCATE = 0x4a,         //!< Find which server owns a device.
+    PROBE = 0x4b,          //!< Liveness probe sent when the link is idle.
+    HEALTH = 0x4c,         //!< Report the health of the link.
+    REG_READ = 0x4d,       //!< Read from the register mirror.
+    REG_WRITE = 0x4e,      //!< Write to the register mirror (or the device).
+    REG_SYNC = 0x4f,       //!< Write dirty registers back to the device now.
+    HELLO = 0x50,          //!< Negotiate protocol capabilities.
+    BAUD = 0x51,           //!< Change, test and confirm the serial baud rate.
+    PING = 0x52,           //!< Benchmark request which is answered with its own data.
+    SAMPLE = 0x53,         //!< Telemetry sample pushed by the device (not answered).
+    HISTORY = 0x54,        //!< Query recent telemetry samples.
+    TRIGGER = 0x55,        //!< Add or remove a reactive trigger.
+    TIMING = 0x56,         //!< Server timing which follows a response (not answered).
+    DEVICE_REQUEST = 0x57, //!< Request for a leased device, naming the client.
+    ROUTE = 0x58,          //!< Request to forward to another server in the federation.
+};
+
+}  // namespace ServerCommand
+
+//! @brief Error codes returned in the data of an ERROR response.
+enum class ServerError : uint8_t {
+    NONE = 0,          //!< No error.
+    BAD_REQUEST = 1,   //!< Request was malformed.
+    FAULT = 2,         //!< Memory couldn't be accessed.
+    STALE = 3,         //!< Request refers to state the server no longer has.
+    NOT_AVAILABLE = 4, //!< The feature isn't enabled or has no session.
+    OS = 5,            //!< An operating system call failed.
+    CRC = 6,           //!< Verification of the transferred data failed.
+    OVERLOADED = 7,    //!< Request was shed because the server is overloaded.
+    NOT_LEASED = 8,    //!< The client doesn't hold the lease the request needs.
+    TOO_BIG = 9,       //!< Request is bigger than the negotiated packet size.
+    CONFLICT = 10,     //!< Request conflicts with a lease the client already has.
+};
+
+//! @returns a string representation of a ServerError.
+inline char const* as_str(ServerError err) {
+    switch (err) {
+        case ServerError::NONE:
+            return "NONE";
+        case ServerError::BAD_REQUEST:
+            return "BAD_REQUEST";
+        case ServerError::FAULT:
+            return "FAULT";
+        case ServerError::STALE:
+            return "STALE";
+        case ServerError::NOT_AVAILABLE:
+            return "NOT_AVAILABLE";
+        case ServerError::OS:
+            return "OS";
+        case ServerError::CRC:
+            return "CRC";
+        case ServerError::OVERLOADED:
+            return "OVERLOADED";
+        case ServerError::NOT_LEASED:
+            return "NOT_LEASED";
+        case ServerError::TOO_BIG:
+            return "TOO_BIG";
+        case ServerError::CONFLICT:
+            return "CONFLICT";
+    }
+    return "???";
+}
@@ -0,0 +1,68 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ServerTiming.cpp
+ *
+ *   @brief  Tells clients where the time went while handling their requests.
+ *
+ ****************************************************************************/
+
+#include "ServerTiming.h"
+
+#include <algorithm>
+
+#include "Handshake.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! @returns the time from startNs to endNs in microseconds, clamped to fit.
+uint32_t elapsedUs(uint64_t startNs, uint64_t endNs) {
+    if (startNs == 0 || endNs <= startNs) {
+        return 0;
+    }
+    return static_cast<uint32_t>(std::min<uint64_t>((endNs - startNs) / 1000, UINT32_MAX));
+}
+
+}  // namespace
+
+void ServerTiming::send(
+    RequestQueue::Entry const& request,
+    uint64_t handleStartNs,
+    uint64_t txDoneNs,
+    TraceContext const& trace) {
+    if (!this->m_handshake.current().has(Feature::SERVER_TIMING)) {
+        return;
+    }
+    uint8_t data[sizeof(uint8_t) + sizeof(uint64_t) + 3 * sizeof(uint32_t) + 3 * sizeof(uint64_t)];
+    Packet packet(sizeof(data), data);
+    PacketWriter writer(&packet, ServerCommand::TIMING);
+    writer.write(request.command);
+    writer.write(request.rxStartNs);
+    writer.write(elapsedUs(request.rxStartNs, request.rxDoneNs));
+    writer.write(elapsedUs(request.rxDoneNs, handleStartNs));
+    writer.write(elapsedUs(handleStartNs, txDoneNs));
+    writer.write(trace.traceIdHi);
+    writer.write(trace.traceIdLo);
+    writer.write(trace.rootSpanId);
+    if (!writer.ok()) {
+        // The client negotiated a packet size too small to hold it.
+        return;
+    }
+    this->m_outbox->send(ServerCommand::TIMING, packet.getData(), packet.getLength());
+    this->m_numSent++;
+}
+
+void ServerTiming::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_timing_packets_total", this->m_numSent);
+}
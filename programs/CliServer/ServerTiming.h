@@ -0,0 +1,74 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   ServerTiming.h
+ *
+ *   @brief  Tells clients where the time went while handling their requests.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+#include "RequestQueue.h"
+#include "Tracer.h"
+
+class Handshake;
+class Metrics;
+class Outbox;
+
+//! @brief Sends a TIMING packet after each response, for clients which asked.
+//!
+//! @details Clients opt in by including Feature::SERVER_TIMING in their
+//!          HELLO. The response itself is unchanged (it's written by the
+//!          handler), so the timing follows it as a separate packet, which
+//!          clients that didn't negotiate the feature never see. Requests
+//!          which aren't answered don't get a TIMING packet either.
+//!
+//!          TIMING: uint8_t command, uint64_t rxNs, uint32_t linkUs,
+//!                  uint32_t queuedUs, uint32_t handlerUs, uint64_t traceIdHi,
+//!                  uint64_t traceIdLo, uint64_t spanId
+//!
+//!          command is the command of the request, rxNs is when the first
+//!          byte of the request arrived (Clock::realtimeNs), linkUs is how
+//!          long the request took to arrive, queuedUs is how long it waited
+//!          in the request queue and handlerUs is how long it took to handle
+//!          it and write the response. The trace and span ids are those of
+//!          the request span exported by the Tracer (all zero if the request
+//!          wasn't traced), so that client side measurements can be joined
+//!          with the server's spans.
+class ServerTiming {
+ public:
+    //! @brief Constructor.
+    ServerTiming(
+        Outbox* outbox,              //!< [in] Used to send the TIMING packets.
+        Handshake const& handshake   //!< [in] Says whether the client wants them.
+    )
+        : m_outbox(outbox), m_handshake(handshake) {}
+
+    //! @brief Sends the timing of a request, if the client negotiated it.
+    void send(
+        RequestQueue::Entry const& request,  //!< [in] Request which was answered.
+        uint64_t handleStartNs,              //!< [in] When handling started (Clock::realtimeNs).
+        uint64_t txDoneNs,                   //!< [in] When the response was written.
+        TraceContext const& trace            //!< [in] Trace of the request.
+    );
+
+    //! @brief Publishes the number of TIMING packets sent.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    Outbox* m_outbox;               //!< Used to send the TIMING packets.
+    Handshake const& m_handshake;   //!< Negotiated features.
+    uint64_t m_numSent = 0;         //!< TIMING packets sent.
+};
@@ -0,0 +1,261 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Telemetry.cpp
+ *
+ *   @brief  Streams device samples to subscribers at the rate each one wants.
+ *
+ ****************************************************************************/
+
+#include "Telemetry.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Clock.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+#include "Udp.h"
+
+namespace {
+
+//! Largest subscription datagram we'll accept.
+constexpr size_t MAX_REQUEST = 64;
+
+//! @brief Appends a value (little endian) to a datagram.
+template <typename T>
+void append(std::vector<uint8_t>* buf, T val) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        buf->push_back(static_cast<uint8_t>(val >> (8 * i)));
+    }
+}
+
+//! Subscriber lists are shrunk once they're using less than this fraction of their capacity.
+constexpr size_t SHRINK_RATIO = 4;
+
+}  // namespace
+
+Telemetry::~Telemetry() {
+    if (this->m_fd >= 0) {
+        close(this->m_fd);
+    }
+}
+
+bool Telemetry::serve(char const* port) {
+    this->m_fd = Udp::open(port, true);
+    return this->m_fd >= 0;
+}
+
+void Telemetry::processInput() {
+    char buf[MAX_REQUEST + 1];
+    Address from;
+    memset(&from, 0, sizeof(from));
+    socklen_t fromLen = sizeof(from);
+    ssize_t len = recvfrom(this->m_fd, buf, MAX_REQUEST, 0, &from.sa, &fromLen);
+    if (len <= 0 || (from.sa.sa_family != AF_INET && from.sa.sa_family != AF_INET6)) {
+        return;
+    }
+    buf[len] = '\0';
+    if (buf[0] == 'S' && buf[1] == ' ') {
+        char* end;
+        unsigned long rateHz = strtoul(&buf[2], &end, 10);
+        if (end != &buf[2]) {
+            this->subscribe(from, static_cast<uint32_t>(std::min(rateHz, 0xfffful)));
+        }
+    } else if (buf[0] == 'U') {
+        this->unsubscribe(from);
+    }
+}
+
+bool Telemetry::consume(Packet const& cmd, uint64_t rxNs) {
+    if (cmd.getCommand() != ServerCommand::SAMPLE) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    size_t numFields = reader.read<uint8_t>();
+    if (!reader.ok() || numFields == 0 || numFields > MAX_FIELDS ||
+        reader.remaining() != numFields * sizeof(int32_t)) {
+        return true;
+    }
+    int32_t values[MAX_FIELDS];
+    for (size_t i = 0; i < numFields; i++) {
+        values[i] = reader.read<int32_t>();
+    }
+    this->m_samples++;
+    for (auto sink : this->m_sinks) {
+        sink->addSample(rxNs, values, numFields);
+    }
+
+    for (auto& [rateHz, group] : this->m_groups) {
+        if (group.numSamples > 0 &&
+            (group.fields.size() != numFields || rxNs >= group.startNs + group.periodNs)) {
+            this->flush(rateHz, &group);
+        }
+        if (group.numSamples == 0) {
+            group.startNs = group.periodNs == 0 ? rxNs : rxNs - rxNs % group.periodNs;
+            group.fields.resize(numFields);
+            for (size_t i = 0; i < numFields; i++) {
+                group.fields[i] = Field{values[i], values[i], 0, values[i]};
+            }
+        }
+        for (size_t i = 0; i < numFields; i++) {
+            Field& field = group.fields[i];
+            field.min = std::min(field.min, values[i]);
+            field.max = std::max(field.max, values[i]);
+            field.sum += values[i];
+            field.last = values[i];
+        }
+        group.numSamples++;
+        if (group.periodNs == 0) {
+            this->flush(rateHz, &group);
+        }
+    }
+    return true;
+}
+
+void Telemetry::poll(uint64_t nowMs) {
+    // Close out periods which ended without a newer sample arriving.
+    uint64_t nowNs = Clock::realtimeNs();
+    for (auto it = this->m_groups.begin(); it != this->m_groups.end();) {
+        RateGroup& group = it->second;
+        if (group.numSamples > 0 && nowNs >= group.startNs + group.periodNs) {
+            this->flush(it->first, &group);
+        }
+        auto& subscribers = group.subscribers;
+        subscribers.erase(
+            std::remove_if(
+                subscribers.begin(), subscribers.end(),
+                [nowMs](Subscriber const& sub) { return sub.expiresMs <= nowMs; }),
+            subscribers.end());
+        if (subscribers.empty()) {
+            it = this->m_groups.erase(it);
+        } else {
+            // Give back the memory left behind when a crowd of subscribers leaves.
+            if (subscribers.size() < subscribers.capacity() / SHRINK_RATIO) {
+                subscribers.shrink_to_fit();
+            }
+            ++it;
+        }
+    }
+}
+
+void Telemetry::updateMetrics(Metrics* metrics) const {
+    size_t numSubscribers = 0;
+    size_t subscriberBytes = 0;
+    for (auto const& [rateHz, group] : this->m_groups) {
+        numSubscribers += group.subscribers.size();
+        subscriberBytes += group.subscribers.capacity() * sizeof(Subscriber);
+    }
+    metrics->set("cliserver_telemetry_subscribers", numSubscribers);
+    metrics->set("cliserver_telemetry_subscriber_bytes", subscriberBytes);
+    metrics->set("cliserver_telemetry_samples_total", this->m_samples);
+    metrics->set("cliserver_telemetry_datagrams_encoded_total", this->m_datagrams);
+    metrics->set("cliserver_telemetry_datagrams_sent_total", this->m_sends);
+}
+
+int Telemetry::compare(Address const& lhs, Address const& rhs) {
+    // Only the fields which identify the sender are compared, since the
+    // rest of the sockaddr (sin_zero, sin6_flowinfo) needn't match.
+    if (lhs.sa.sa_family != rhs.sa.sa_family) {
+        return lhs.sa.sa_family < rhs.sa.sa_family ? -1 : 1;
+    }
+    if (lhs.sa.sa_family == AF_INET) {
+        if (lhs.in.sin_port != rhs.in.sin_port) {
+            return ntohs(lhs.in.sin_port) < ntohs(rhs.in.sin_port) ? -1 : 1;
+        }
+        return memcmp(&lhs.in.sin_addr, &rhs.in.sin_addr, sizeof(lhs.in.sin_addr));
+    }
+    if (lhs.in6.sin6_port != rhs.in6.sin6_port) {
+        return ntohs(lhs.in6.sin6_port) < ntohs(rhs.in6.sin6_port) ? -1 : 1;
+    }
+    if (lhs.in6.sin6_scope_id != rhs.in6.sin6_scope_id) {
+        return lhs.in6.sin6_scope_id < rhs.in6.sin6_scope_id ? -1 : 1;
+    }
+    return memcmp(&lhs.in6.sin6_addr, &rhs.in6.sin6_addr, sizeof(lhs.in6.sin6_addr));
+}
+
+std::vector<Telemetry::Subscriber>::iterator Telemetry::find(
+    std::vector<Subscriber>* subscribers,
+    Address const& addr) {
+    return std::lower_bound(
+        subscribers->begin(), subscribers->end(), addr, [](Subscriber const& sub, Address const& key) {
+            return compare(sub.addr, key) < 0;
+        });
+}
+
+void Telemetry::subscribe(Address const& from, uint32_t rateHz) {
+    uint64_t expiresMs = Clock::monotonicNs() / 1000000 + SUBSCRIPTION_TTL_MS;
+
+    // Renewing at the same rate is by far the most common case.
+    auto it = this->m_groups.find(rateHz);
+    if (it != this->m_groups.end()) {
+        auto& subscribers = it->second.subscribers;
+        auto sub = find(&subscribers, from);
+        if (sub != subscribers.end() && compare(sub->addr, from) == 0) {
+            sub->expiresMs = expiresMs;
+            return;
+        }
+    }
+    this->unsubscribe(from);
+
+    RateGroup& group = this->m_groups[rateHz];
+    if (group.subscribers.empty()) {
+        group.periodNs = (rateHz == 0 || rateHz > MAX_RATE_HZ) ? 0 : 1000000000ull / rateHz;
+        group.numSamples = 0;
+    }
+    group.subscribers.insert(find(&group.subscribers, from), Subscriber{from, expiresMs});
+}
+
+void Telemetry::unsubscribe(Address const& from) {
+    for (auto it = this->m_groups.begin(); it != this->m_groups.end(); ++it) {
+        auto& subscribers = it->second.subscribers;
+        auto sub = find(&subscribers, from);
+        if (sub != subscribers.end() && compare(sub->addr, from) == 0) {
+            subscribers.erase(sub);
+            if (subscribers.empty()) {
+                this->m_groups.erase(it);
+            }
+            return;
+        }
+    }
+}
+
+void Telemetry::flush(uint32_t rateHz, RateGroup* group) {
+    // Encoded once, no matter how many subscribers share the rate.
+    std::vector<uint8_t>& buf = this->m_datagram;
+    buf.clear();
+    append(&buf, VERSION);
+    append(&buf, static_cast<uint8_t>(group->fields.size()));
+    append(&buf, static_cast<uint16_t>(rateHz));
+    append(&buf, group->startNs);
+    append(&buf, group->numSamples);
+    for (auto const& field : group->fields) {
+        append(&buf, field.min);
+        append(&buf, field.max);
+        append(&buf, static_cast<int32_t>(field.sum / static_cast<int64_t>(group->numSamples)));
+        append(&buf, field.last);
+    }
+    this->m_datagrams++;
+
+    for (auto const& sub : group->subscribers) {
+        // A subscriber which can't keep up just misses datagrams.
+        (void)sendto(
+            this->m_fd, buf.data(), buf.size(), MSG_DONTWAIT,
+            &sub.addr.sa, sub.addr.sa.sa_family == AF_INET ? sizeof(sub.addr.in) : sizeof(sub.addr.in6));
+        this->m_sends++;
+    }
+    group->numSamples = 0;
+}
@@ -0,0 +1,175 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Telemetry.h
+ *
+ *   @brief  Streams device samples to subscribers at the rate each one wants.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "Bus.h"
+
+class Metrics;
+
+//! @brief Receives every sample which the device sends.
+class ISampleSink {
+ public:
+    virtual ~ISampleSink() = default;
+
+    //! @brief Called for each valid SAMPLE packet.
+    virtual void addSample(
+        uint64_t rxNs,          //!< [in] When the sample was received (Clock::realtimeNs).
+        int32_t const* values,  //!< [in] Value of each field.
+        size_t numFields        //!< [in] Number of fields.
+    ) = 0;
+};
+
+//! @brief Aggregates SAMPLE packets and streams them to UDP subscribers.
+//!
+//! @details The device sends SAMPLE packets continuously. They're consumed
+//!          by the server rather than answered. Subscribers ask for an
+//!          output rate, and each sample is folded into one aggregate per
+//!          requested rate. The aggregate holds the min, max, mean and last
+//!          value of each field over the output period. When a period ends,
+//!          the aggregate is encoded into a single datagram, which is sent to
+//!          every subscriber at that rate. A rate of 0 gets every sample
+//!          unaggregated.
+//!
+//!          Most subscribers are monitoring tools which stay subscribed for
+//!          a long time at a low rate, and there may be tens of thousands of
+//!          them, so each one is just a compact address and an expiry time,
+//!          kept sorted by address. Aggregates and the encode buffer belong
+//!          to the rate, not the subscriber.
+//!
+//!          There's no pool of packet buffers to share between idle
+//!          connections: the server has a single bus connection, which owns
+//!          its packet buffers, and subscribers never send packets, so
+//!          there's never a partial packet to hold for one.
+//!
+//!          Subscribers send text datagrams to the telemetry port, and must
+//!          repeat the subscription within SUBSCRIPTION_TTL_MS to keep it:
+//!              S <rateHz>    subscribe (or change rate)
+//!              U             unsubscribe
+//!
+//!          SAMPLE:    uint8_t numFields, int32_t value[numFields]
+//!          Datagram:  uint8_t VERSION, uint8_t numFields, uint16_t rateHz,
+//!                     uint64_t startNs, uint32_t numSamples, then for each
+//!                     field int32_t min, max, mean, last
+class Telemetry {
+ public:
+    //! Version byte at the start of each datagram.
+    static constexpr uint8_t VERSION = 1;
+
+    //! Subscriptions which aren't repeated within this time are dropped.
+    static constexpr uint64_t SUBSCRIPTION_TTL_MS = 10000;
+
+    //! Largest number of fields in a sample.
+    static constexpr size_t MAX_FIELDS = 32;
+
+    //! Highest output rate which is aggregated (faster gets every sample).
+    static constexpr uint32_t MAX_RATE_HZ = 100000;
+
+    //! @brief Destructor. Closes the socket.
+    ~Telemetry();
+
+    //! @brief Listens for subscribers on the given UDP port.
+    //! @returns true if the port could be bound.
+    bool serve(
+        char const* port  //!< [in] UDP port (or "host:port") to listen on.
+    );
+
+    //! @returns true if telemetry is being streamed.
+    bool isEnabled() const { return this->m_fd >= 0; }
+
+    //! @returns the socket which subscribers send to.
+    int socket() const { return this->m_fd; }
+
+    //! @brief Reads any pending subscription datagram.
+    void processInput();
+
+    //! @brief Adds a sink which is passed every sample.
+    void addSink(
+        ISampleSink& sink  //!< [in] Sink to add.
+    ) {
+        this->m_sinks.push_back(&sink);
+    }
+
+    //! @brief Aggregates a SAMPLE packet and passes it on to the sinks.
+    //! @returns true if cmd was a SAMPLE packet (which mustn't be answered).
+    bool consume(
+        Packet const& cmd,  //!< [in] Packet which was received.
+        uint64_t rxNs       //!< [in] When the packet was received (Clock::realtimeNs).
+    );
+
+    //! @brief Sends aggregates whose period has ended and expires subscribers.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+    //! @brief Publishes the number of subscribers (and the memory they use) and datagrams sent.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+ private:
+    //! Aggregate of a single field over an output period.
+    struct Field {
+        int32_t min;  //!< Smallest value.
+        int32_t max;  //!< Largest value.
+        int64_t sum;  //!< Sum of the values (for the mean).
+        int32_t last; //!< Most recent value.
+    };
+
+    //! An IPv4 or IPv6 address, without the padding of sockaddr_storage.
+    union Address {
+        struct sockaddr sa;      //!< Generic view (for the family).
+        struct sockaddr_in in;   //!< IPv4 address.
+        struct sockaddr_in6 in6; //!< IPv6 address.
+    };
+
+    //! A subscriber.
+    struct Subscriber {
+        Address addr;            //!< Where to send datagrams.
+        uint64_t expiresMs;      //!< When the subscription lapses.
+    };
+
+    //! Subscribers which share an output rate, and their aggregate.
+    struct RateGroup {
+        uint64_t periodNs = 0;             //!< Output period (0 for every sample).
+        uint64_t startNs = 0;              //!< Start of the current period.
+        uint32_t numSamples = 0;           //!< Samples in the current aggregate.
+        std::vector<Field> fields;         //!< Aggregate of each field.
+        std::vector<Subscriber> subscribers;  //!< Who gets the datagrams (sorted by address).
+    };
+
+    static int compare(Address const& lhs, Address const& rhs);
+    static std::vector<Subscriber>::iterator find(std::vector<Subscriber>* subscribers, Address const& addr);
+    void subscribe(Address const& from, uint32_t rateHz);
+    void unsubscribe(Address const& from);
+    void flush(uint32_t rateHz, RateGroup* group);
+
+    int m_fd = -1;                            //!< Socket subscribers send to.
+    std::vector<ISampleSink*> m_sinks;        //!< Also passed every sample.
+    std::map<uint32_t, RateGroup> m_groups;   //!< Subscribers by rate (Hz).
+    std::vector<uint8_t> m_datagram;          //!< Reused buffer for encoding.
+    uint64_t m_samples = 0;                   //!< Samples received.
+    uint64_t m_datagrams = 0;                 //!< Datagrams encoded.
+    uint64_t m_sends = 0;                     //!< Datagrams sent (to all subscribers).
+};
@@ -0,0 +1,225 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   TelemetryHistory.cpp
+ *
+ *   @brief  Keeps recent telemetry samples so clients can backfill them.
+ *
+ ****************************************************************************/
+
+#include "TelemetryHistory.h"
+
+#include <algorithm>
+
+#include "Metrics.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! Bytes per point in a response.
+constexpr size_t POINT_LEN = sizeof(uint64_t) + sizeof(int32_t);
+
+void putVarint(std::vector<uint8_t>* column, int64_t delta) {
+    // Zigzag encoding keeps small negative deltas small.
+    uint64_t val = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+    while (val >= 0x80) {
+        column->push_back(static_cast<uint8_t>(val) | 0x80);
+        val >>= 7;
+    }
+    column->push_back(static_cast<uint8_t>(val));
+}
+
+int64_t getVarint(uint8_t const** pos) {
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*pos)++;
+        val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while ((byte & 0x80) != 0);
+    return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+//! @brief Collects points for a response, averaging them when downsampling.
+class PointWriter {
+ public:
+    PointWriter(PacketWriter* writer, uint64_t startNs, uint64_t stepNs, size_t maxPoints)
+        : m_writer(writer), m_stepNs(stepNs), m_maxPoints(maxPoints), m_stepStartNs(startNs) {}
+
+    //! @returns false once the response is full (nextStartNs has been set).
+    bool add(uint64_t timeNs, int32_t value) {
+        if (this->m_stepNs == 0) {
+            return this->emit(timeNs, value, timeNs);
+        }
+        if (timeNs >= this->m_stepStartNs + this->m_stepNs) {
+            if (!this->finishStep()) {
+                return false;
+            }
+            this->m_stepStartNs = timeNs - (timeNs - this->m_stepStartNs) % this->m_stepNs;
+        }
+        this->m_sum += value;
+        this->m_count++;
+        return true;
+    }
+
+    //! @returns false if the final step didn't fit.
+    bool finishStep() {
+        if (this->m_count == 0) {
+            return true;
+        }
+        int32_t mean = static_cast<int32_t>(this->m_sum / this->m_count);
+        if (!this->emit(this->m_stepStartNs, mean, this->m_stepStartNs)) {
+            return false;
+        }
+        this->m_sum = 0;
+        this->m_count = 0;
+        return true;
+    }
+
+    uint8_t numPoints() const { return static_cast<uint8_t>(this->m_numPoints); }
+    uint64_t nextStartNs() const { return this->m_nextStartNs; }
+
+ private:
+    bool emit(uint64_t timeNs, int32_t value, uint64_t resumeNs) {
+        if (this->m_numPoints >= this->m_maxPoints) {
+            this->m_nextStartNs = resumeNs;
+            return false;
+        }
+        this->m_writer->write(timeNs);
+        this->m_writer->write(value);
+        this->m_numPoints++;
+        return true;
+    }
+
+    PacketWriter* m_writer;
+    uint64_t m_stepNs;
+    size_t m_maxPoints;
+    size_t m_numPoints = 0;
+    uint64_t m_nextStartNs = 0;
+    uint64_t m_stepStartNs;
+    int64_t m_sum = 0;
+    int64_t m_count = 0;
+};
+
+}  // namespace
+
+void TelemetryHistory::addSample(uint64_t rxNs, int32_t const* values, size_t numFields) {
+    if (!this->isEnabled()) {
+        return;
+    }
+    while (!this->m_blocks.empty() && this->m_blocks.front().lastNs + this->m_retentionNs < rxNs) {
+        this->m_blocks.pop_front();
+    }
+
+    if (this->m_blocks.empty() || this->m_blocks.back().numSamples >= BLOCK_SAMPLES ||
+        this->m_blocks.back().fields.size() != numFields || rxNs < this->m_blocks.back().lastNs) {
+        Block& block = this->m_blocks.emplace_back();
+        block.firstNs = rxNs;
+        block.lastNs = rxNs;
+        block.lastValues.assign(numFields, 0);
+        block.fields.resize(numFields);
+        block.timestamps.reserve(BLOCK_SAMPLES);
+        for (auto& column : block.fields) {
+            column.reserve(BLOCK_SAMPLES);
+        }
+    }
+    Block& block = this->m_blocks.back();
+    putVarint(&block.timestamps, static_cast<int64_t>(rxNs - block.lastNs));
+    block.lastNs = rxNs;
+    for (size_t i = 0; i < numFields; i++) {
+        putVarint(&block.fields[i], static_cast<int64_t>(values[i]) - block.lastValues[i]);
+        block.lastValues[i] = values[i];
+    }
+    block.numSamples++;
+}
+
+void TelemetryHistory::updateMetrics(Metrics* metrics) const {
+    size_t numSamples = 0;
+    size_t numBytes = 0;
+    for (auto const& block : this->m_blocks) {
+        numSamples += block.numSamples;
+        numBytes += block.timestamps.size();
+        for (auto const& column : block.fields) {
+            numBytes += column.size();
+        }
+    }
+    metrics->set("cliserver_history_samples", numSamples);
+    metrics->set("cliserver_history_bytes", numBytes);
+}
+
+bool TelemetryHistory::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::HISTORY) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    uint8_t field = reader.read<uint8_t>();
+    uint64_t startNs = reader.read<uint64_t>();
+    uint64_t endNs = reader.read<uint64_t>();
+    uint64_t stepNs = reader.read<uint64_t>();
+    if (!reader.ok() || startNs > endNs) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+        return true;
+    }
+    if (!this->isEnabled()) {
+        PacketWriter::error(rsp, cmd.getCommand(), ServerError::NOT_AVAILABLE);
+        return true;
+    }
+
+    // The header is filled in once we know how many points fit.
+    PacketWriter writer(rsp, cmd.getCommand());
+    writer.write<uint8_t>(0);
+    writer.write<uint64_t>(0);
+    size_t maxPoints = writer.remaining() / POINT_LEN;
+    PointWriter points(&writer, startNs, stepNs, std::min<size_t>(maxPoints, UINT8_MAX));
+
+    bool full = false;
+    for (auto const& block : this->m_blocks) {
+        // Blocks are only in time order while the clock is: a step back
+        // starts a new block, so every block has to be checked.
+        if (block.lastNs < startNs || block.firstNs >= endNs || field >= block.fields.size()) {
+            continue;
+        }
+        // Only the timestamps and the requested field are decoded.
+        uint8_t const* timePos = block.timestamps.data();
+        uint8_t const* valuePos = block.fields[field].data();
+        uint64_t timeNs = block.firstNs;
+        int64_t value = 0;
+        for (uint32_t i = 0; i < block.numSamples; i++) {
+            timeNs += getVarint(&timePos);
+            value += getVarint(&valuePos);
+            if (timeNs < startNs) {
+                continue;
+            }
+            if (timeNs >= endNs) {
+                break;
+            }
+            if (!points.add(timeNs, static_cast<int32_t>(value))) {
+                full = true;
+                break;
+            }
+        }
+        if (full) {
+            break;
+        }
+    }
+    if (!full) {
+        points.finishStep();
+    }
+
+    uint8_t* header = rsp->getData();
+    header[0] = points.numPoints();
+    uint64_t nextStartNs = points.nextStartNs();
+    for (size_t i = 0; i < sizeof(nextStartNs); i++) {
+        header[1 + i] = static_cast<uint8_t>(nextStartNs >> (8 * i));
+    }
+    return true;
+}
@@ -0,0 +1,98 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   TelemetryHistory.h
+ *
+ *   @brief  Keeps recent telemetry samples so clients can backfill them.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "Bus.h"
+#include "Telemetry.h"
+
+class Metrics;
+
+//! @brief Stores recent samples in delta encoded columns.
+//!
+//! @details Samples are appended to blocks of up to BLOCK_SAMPLES samples.
+//!          Each block stores the timestamps and each field in separate
+//!          columns. Every entry is the zigzag varint encoded difference from
+//!          the previous entry in the same column, so slowly changing signals
+//!          take a byte or two per sample. Each block starts from absolute
+//!          values, so it can be decoded without its predecessors, and whole
+//!          blocks are dropped once they're older than the retention time.
+//!          A query only decodes the timestamp column and the column of the
+//!          field it asked for.
+//!
+//!          HISTORY: uint8_t field, uint64_t startNs, uint64_t endNs,
+//!                   uint64_t stepNs
+//!               -> uint8_t numPoints, uint64_t nextStartNs,
+//!                  (uint64_t timeNs, int32_t value)[numPoints]
+//!
+//!          A stepNs of 0 returns the raw samples. Otherwise the range is
+//!          divided into steps and each point is the mean of one step (empty
+//!          steps are skipped). A response holds as many points as fit in a
+//!          packet. If nextStartNs isn't 0, the client repeats the query
+//!          starting from there to get the rest.
+class TelemetryHistory : public IPacketHandler, public ISampleSink {
+ public:
+    //! Largest number of samples in a block.
+    static constexpr uint32_t BLOCK_SAMPLES = 256;
+
+    //! @brief Sets how long samples are kept.
+    void setRetention(
+        uint64_t retentionMs  //!< [in] Retention time in milliseconds (0 disables).
+    ) {
+        this->m_retentionNs = retentionMs * 1000000;
+    }
+
+    //! @returns true if history is being kept.
+    bool isEnabled() const { return this->m_retentionNs != 0; }
+
+    //! @brief Appends a sample, dropping blocks which have expired.
+    void addSample(
+        uint64_t rxNs,          //!< [in] When the sample was received (Clock::realtimeNs).
+        int32_t const* values,  //!< [in] Value of each field.
+        size_t numFields        //!< [in] Number of fields.
+    ) override;
+
+    //! @brief Publishes the amount of history retained.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+    //! @brief Handles the HISTORY command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! A run of consecutive samples with the same fields.
+    struct Block {
+        uint64_t firstNs = 0;                      //!< Timestamp of the first sample.
+        uint64_t lastNs = 0;                       //!< Timestamp of the last sample.
+        uint32_t numSamples = 0;                   //!< Samples in the block.
+        std::vector<int32_t> lastValues;           //!< Last value of each field.
+        std::vector<uint8_t> timestamps;           //!< Timestamp deltas.
+        std::vector<std::vector<uint8_t>> fields;  //!< Value deltas, one column per field.
+    };
+
+    std::deque<Block> m_blocks;    //!< Oldest block first.
+    uint64_t m_retentionNs = 0;    //!< How long samples are kept.
+};
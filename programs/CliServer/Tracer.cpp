@@ -0,0 +1,171 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Tracer.cpp
+ *
+ *   @brief  Assigns trace ids to requests and exports spans as OTLP JSON.
+ *
+ ****************************************************************************/
+
+#include "Tracer.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "Log.h"
+
+namespace {
+
+//! SPAN_KIND_SERVER from the OTLP protobuf definitions.
+constexpr int SPAN_KIND_SERVER = 2;
+
+//! SPAN_KIND_INTERNAL from the OTLP protobuf definitions.
+constexpr int SPAN_KIND_INTERNAL = 1;
+
+void appendHex(std::string* str, uint64_t val) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, val);
+    str->append(buf);
+}
+
+void appendU64(std::string* str, uint64_t val) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%" PRIu64, val);
+    str->append(buf);
+}
+
+}  // namespace
+
+Tracer::~Tracer() {
+    this->close();
+}
+
+bool Tracer::open(char const* fileName, double sampleRate, size_t batchSize) {
+    this->close();
+
+    this->m_file = fopen(fileName, "a");
+    if (this->m_file == nullptr) {
+        Log::error("Unable to open trace file '%s': %s", fileName, strerror(errno));
+        return false;
+    }
+    this->m_sampleRate = sampleRate;
+    this->m_batchSize = batchSize > 0 ? batchSize : 1;
+    this->m_spans.reserve(this->m_batchSize);
+    this->m_rng.seed(std::random_device{}());
+    return true;
+}
+
+void Tracer::close() {
+    if (!this->isOpen()) {
+        return;
+    }
+    this->flush();
+    fclose(this->m_file);
+    this->m_file = nullptr;
+}
+
+TraceContext Tracer::startTrace() {
+    TraceContext ctx;
+    if (!this->isOpen()) {
+        return ctx;
+    }
+    ctx.sampled = this->m_sampleRate >= 1.0 || this->m_sampleDist(this->m_rng) < this->m_sampleRate;
+    if (ctx.sampled) {
+        ctx.traceIdHi = this->m_rng();
+        ctx.traceIdLo = this->m_rng();
+        ctx.rootSpanId = this->m_rng();
+    }
+    return ctx;
+}
+
+void Tracer::addSpan(TraceContext const& ctx, char const* name, uint64_t startNs, uint64_t endNs) {
+    if (!ctx.sampled) {
+        return;
+    }
+    this->record(Span{ctx, this->m_rng(), ctx.rootSpanId, name, startNs, endNs, -1});
+}
+
+void Tracer::endTrace(TraceContext const& ctx, uint8_t command, uint64_t startNs, uint64_t endNs) {
+    if (!ctx.sampled) {
+        return;
+    }
+    this->record(Span{ctx, ctx.rootSpanId, 0, "request", startNs, endNs, command});
+}
+
+void Tracer::record(Span const& span) {
+    this->m_spans.push_back(span);
+    if (this->m_spans.size() >= this->m_batchSize) {
+        this->flush();
+    }
+}
+
+void Tracer::poll(uint64_t nowMs) {
+    if (nowMs < this->m_nextFlushMs) {
+        return;
+    }
+    this->m_nextFlushMs = nowMs + FLUSH_INTERVAL_MS;
+    this->flush();
+}
+
+void Tracer::flush() {
+    if (!this->isOpen() || this->m_spans.empty()) {
+        return;
+    }
+
+    std::string& json = this->m_json;
+    json.clear();
+    json.append(
+        "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+        "\"value\":{\"stringValue\":\"CliServer\"}}]},"
+        "\"scopeSpans\":[{\"scope\":{\"name\":\"CliServer\"},\"spans\":[");
+
+    bool first = true;
+    for (auto const& span : this->m_spans) {
+        if (!first) {
+            json.push_back(',');
+        }
+        first = false;
+
+        json.append("{\"traceId\":\"");
+        appendHex(&json, span.ctx.traceIdHi);
+        appendHex(&json, span.ctx.traceIdLo);
+        json.append("\",\"spanId\":\"");
+        appendHex(&json, span.spanId);
+        json.append("\"");
+        if (span.parentSpanId != 0) {
+            json.append(",\"parentSpanId\":\"");
+            appendHex(&json, span.parentSpanId);
+            json.append("\"");
+        }
+        json.append(",\"name\":\"");
+        json.append(span.name);
+        json.append("\",\"kind\":");
+        appendU64(&json, span.parentSpanId == 0 ? SPAN_KIND_SERVER : SPAN_KIND_INTERNAL);
+        json.append(",\"startTimeUnixNano\":\"");
+        appendU64(&json, span.startNs);
+        json.append("\",\"endTimeUnixNano\":\"");
+        appendU64(&json, span.endNs);
+        json.append("\"");
+        if (span.command >= 0) {
+            json.append(",\"attributes\":[{\"key\":\"duino.command\",\"value\":{\"intValue\":\"");
+            appendU64(&json, static_cast<uint64_t>(span.command));
+            json.append("\"}}]");
+        }
+        json.append("}");
+    }
+    json.append("]}]}]}\n");
+
+    if (fwrite(json.data(), 1, json.size(), this->m_file) != json.size()) {
+        Log::error("Write to trace file failed: %s", strerror(errno));
+    }
+    fflush(this->m_file);
+    this->m_spans.clear();
+}
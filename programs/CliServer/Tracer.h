@@ -0,0 +1,123 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Tracer.h
+ *
+ *   @brief  Assigns trace ids to requests and exports spans as OTLP JSON.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+//! @brief Identifies a single traced request.
+struct TraceContext {
+    uint64_t traceIdHi = 0;    //!< Upper 64 bits of the 128 bit trace id.
+    uint64_t traceIdLo = 0;    //!< Lower 64 bits of the 128 bit trace id.
+    uint64_t rootSpanId = 0;   //!< Span id of the request (root) span.
+    bool sampled = false;      //!< Only sampled requests have their spans exported.
+};
+
+//! @brief Collects spans and exports them to a file in OTLP JSON format.
+//!
+//! @details Each line of the output file is a complete OTLP
+//!          ExportTraceServiceRequest containing a batch of spans, which is
+//!          the format used by the OpenTelemetry collector's file exporter.
+//!          Spans are accumulated in memory and written once per batch, or
+//!          by poll once they've been waiting for FLUSH_INTERVAL_MS, so a
+//!          lightly loaded server still exports its spans promptly.
+class Tracer {
+ public:
+    //! Number of spans which are accumulated before being written.
+    static constexpr size_t DEFAULT_BATCH_SIZE = 64;
+
+    //! Longest time (in milliseconds) that a partial batch waits to be written.
+    static constexpr uint64_t FLUSH_INTERVAL_MS = 1000;
+
+    //! @brief Constructor.
+    Tracer() = default;
+
+    //! @brief Destructor. Writes any pending spans and closes the file.
+    ~Tracer();
+
+    Tracer(Tracer const&) = delete;
+    Tracer& operator=(Tracer const&) = delete;
+
+    //! @brief Opens the span export file.
+    //! @returns true if the file was opened successfully.
+    bool open(
+        char const* fileName,                   //!< [in] File to append spans to.
+        double sampleRate,                      //!< [in] Fraction of requests to trace (0.0 - 1.0).
+        size_t batchSize = DEFAULT_BATCH_SIZE   //!< [in] Spans per exported batch.
+    );
+
+    //! @brief Writes any pending spans and closes the file.
+    void close();
+
+    //! @returns true if the span export file is open.
+    bool isOpen() const { return this->m_file != nullptr; }
+
+    //! @brief Starts a new trace, deciding whether it will be sampled.
+    //! @returns the context to pass to addSpan and endTrace.
+    TraceContext startTrace();
+
+    //! @brief Records a child span of the request span.
+    void addSpan(
+        TraceContext const& ctx,  //!< [in] Context returned by startTrace.
+        char const* name,         //!< [in] Name of the span (i.e. "handle").
+        uint64_t startNs,         //!< [in] Start time (Clock::realtimeNs).
+        uint64_t endNs            //!< [in] End time (Clock::realtimeNs).
+    );
+
+    //! @brief Records the request (root) span, which completes the trace.
+    void endTrace(
+        TraceContext const& ctx,  //!< [in] Context returned by startTrace.
+        uint8_t command,          //!< [in] Command byte of the request.
+        uint64_t startNs,         //!< [in] Time the first byte of the request arrived.
+        uint64_t endNs            //!< [in] Time the response was sent.
+    );
+
+    //! @brief Writes all pending spans to the export file.
+    void flush();
+
+    //! @brief Writes the pending spans if they've waited FLUSH_INTERVAL_MS.
+    void poll(
+        uint64_t nowMs  //!< [in] Current time (monotonic milliseconds).
+    );
+
+ private:
+    //! A completed span waiting to be exported.
+    struct Span {
+        TraceContext ctx;         //!< Trace the span belongs to.
+        uint64_t spanId;          //!< Id of this span.
+        uint64_t parentSpanId;    //!< Id of the parent span, or 0 for the root span.
+        char const* name;         //!< Name of the span (must be a string literal).
+        uint64_t startNs;         //!< Start time (ns since the epoch).
+        uint64_t endNs;           //!< End time (ns since the epoch).
+        int command;              //!< Command attribute, or -1 if not set.
+    };
+
+    void record(Span const& span);
+
+    FILE* m_file = nullptr;             //!< Export file.
+    double m_sampleRate = 1.0;          //!< Fraction of requests which are traced.
+    size_t m_batchSize = DEFAULT_BATCH_SIZE;  //!< Spans per exported batch.
+    std::vector<Span> m_spans;          //!< Spans waiting to be exported.
+    uint64_t m_nextFlushMs = 0;         //!< When poll next writes the pending spans.
+    std::string m_json;                 //!< Reused buffer for building the JSON.
+    std::mt19937_64 m_rng;              //!< Generates trace and span ids.
+    std::uniform_real_distribution<double> m_sampleDist{0.0, 1.0};  //!< Sampling decision.
+};
@@ -0,0 +1,204 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Triggers.cpp
+ *
+ *   @brief  Sends packets to the device as soon as a sample meets a condition.
+ *
+ ****************************************************************************/
+
+#include "Triggers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "Log.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! Comparison operators, longest first so that "<=" isn't parsed as "<".
+struct Operator {
+    char const* str;
+    bool (*compare)(int32_t value, int32_t threshold);
+};
+
+constexpr Operator OPERATORS[] = {
+    {"<=", [](int32_t value, int32_t threshold) { return value <= threshold; }},
+    {">=", [](int32_t value, int32_t threshold) { return value >= threshold; }},
+    {"==", [](int32_t value, int32_t threshold) { return value == threshold; }},
+    {"!=", [](int32_t value, int32_t threshold) { return value != threshold; }},
+    {"<", [](int32_t value, int32_t threshold) { return value < threshold; }},
+    {">", [](int32_t value, int32_t threshold) { return value > threshold; }},
+};
+
+char const* skipSpace(char const* str) {
+    while (*str == ' ' || *str == '\t') {
+        str++;
+    }
+    return str;
+}
+
+//! @brief Parses a number within [minVal, maxVal].
+//! @returns false if there was no number, or it was out of range.
+bool parseNumber(char const** str, long minVal, long maxVal, long* val) {
+    char* end;
+    *str = skipSpace(*str);
+    *val = strtol(*str, &end, 0);
+    if (end == *str || *val < minVal || *val > maxVal) {
+        return false;
+    }
+    *str = end;
+    return true;
+}
+
+}  // namespace
+
+int Triggers::add(char const* ruleStr) {
+    Rule rule;
+    rule.inUse = true;
+    char const* pos = ruleStr;
+    long val;
+
+    if (!parseNumber(&pos, 0, UINT8_MAX, &val)) {
+        return -1;
+    }
+    rule.field = static_cast<uint8_t>(val);
+    pos = skipSpace(pos);
+    for (auto const& op : OPERATORS) {
+        size_t len = strlen(op.str);
+        if (strncmp(pos, op.str, len) == 0) {
+            rule.compare = op.compare;
+            pos += len;
+            break;
+        }
+    }
+    if (rule.compare == nullptr || !parseNumber(&pos, INT32_MIN, INT32_MAX, &val)) {
+        return -1;
+    }
+    rule.threshold = static_cast<int32_t>(val);
+    pos = skipSpace(pos);
+    if (strncmp(pos, "->", 2) != 0) {
+        return -1;
+    }
+    pos += 2;
+    if (!parseNumber(&pos, 0, UINT8_MAX, &val)) {
+        return -1;
+    }
+    rule.command = static_cast<uint8_t>(val);
+    while (*skipSpace(pos) != '\0') {
+        if (!parseNumber(&pos, 0, UINT8_MAX, &val)) {
+            return -1;
+        }
+        rule.data.push_back(static_cast<uint8_t>(val));
+    }
+
+    // Reuse the first free slot, so ids stay small.
+    size_t id = 0;
+    while (id < this->m_rules.size() && this->m_rules[id].inUse) {
+        id++;
+    }
+    if (id >= MAX_RULES) {
+        return -1;
+    }
+    if (id == this->m_rules.size()) {
+        this->m_rules.emplace_back();
+    }
+    this->m_rules[id] = std::move(rule);
+    this->reindex();
+    return static_cast<int>(id);
+}
+
+bool Triggers::remove(uint8_t id) {
+    if (id >= this->m_rules.size() || !this->m_rules[id].inUse) {
+        return false;
+    }
+    this->m_rules[id] = Rule();
+    this->reindex();
+    return true;
+}
+
+void Triggers::addSample(uint64_t rxNs, int32_t const* values, size_t numFields) {
+    (void)rxNs;
+    size_t limit = std::min(numFields, this->m_byField.size());
+    for (size_t field = 0; field < limit; field++) {
+        for (uint8_t id : this->m_byField[field]) {
+            Rule& rule = this->m_rules[id];
+            bool matched = rule.compare(values[field], rule.threshold);
+            if (matched && !rule.matched) {
+                if (this->m_outbox->sendNow(rule.command, rule.data.data(), rule.data.size())) {
+                    rule.fired++;
+                } else {
+                    this->m_numDropped++;
+                    Log::warning("Trigger %u dropped while the device is offline", id);
+                }
+            }
+            rule.matched = matched;
+        }
+    }
+}
+
+void Triggers::updateMetrics(Metrics* metrics) const {
+    metrics->set("cliserver_trigger_dropped_total", this->m_numDropped);
+    for (size_t id = 0; id < this->m_rules.size(); id++) {
+        if (this->m_rules[id].inUse) {
+            char name[64];
+            snprintf(name, sizeof(name), "cliserver_trigger_fired_total{rule=\"%zu\"}", id);
+            metrics->set(name, this->m_rules[id].fired);
+        }
+    }
+}
+
+bool Triggers::handlePacket(Packet const& cmd, Packet* rsp) {
+    if (cmd.getCommand() != ServerCommand::TRIGGER) {
+        return false;
+    }
+    PacketReader reader(cmd);
+    uint8_t op = reader.read<uint8_t>();
+    if (reader.ok() && op == ADD) {
+        std::string ruleStr(reinterpret_cast<char const*>(reader.current()), reader.remaining());
+        int id = this->add(ruleStr.c_str());
+        if (id >= 0) {
+            Log::info("Added trigger %d: %s", id, ruleStr.c_str());
+            PacketWriter writer(rsp, cmd.getCommand());
+            writer.write(static_cast<uint8_t>(id));
+            return true;
+        }
+    } else if (reader.ok() && op == REMOVE) {
+        uint8_t id = reader.read<uint8_t>();
+        if (reader.ok() && this->remove(id)) {
+            PacketWriter writer(rsp, cmd.getCommand());
+            return true;
+        }
+    }
+    PacketWriter::error(rsp, cmd.getCommand(), ServerError::BAD_REQUEST);
+    return true;
+}
+
+void Triggers::reindex() {
+    this->m_byField.clear();
+    for (size_t id = 0; id < this->m_rules.size(); id++) {
+        Rule const& rule = this->m_rules[id];
+        if (!rule.inUse) {
+            continue;
+        }
+        if (rule.field >= this->m_byField.size()) {
+            this->m_byField.resize(rule.field + 1);
+        }
+        this->m_byField[rule.field].push_back(static_cast<uint8_t>(id));
+    }
+}
@@ -0,0 +1,120 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Triggers.h
+ *
+ *   @brief  Sends packets to the device as soon as a sample meets a condition.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Bus.h"
+#include "Telemetry.h"
+
+class Metrics;
+class Outbox;
+
+//! @brief Rules of the form "when field F of a sample matches, send packet P".
+//!
+//! @details Rules are written as text:
+//!              FIELD OP VALUE -> CMD [BYTE...]
+//!          where OP is one of < <= > >= == !=, and all numbers may be
+//!          decimal or 0x hex. For example "2 > 1000 -> 0x4e 0x10 0x00 0x01".
+//!
+//!          Each rule is parsed once, when it's added, into a comparison
+//!          function, a threshold, and the packet to send. The rules are
+//!          indexed by field, so a sample only evaluates rules for its own
+//!          fields. Samples are evaluated as they're parsed, before they
+//!          reach the request queue. A rule fires when its condition goes
+//!          from false to true, so a value which stays past the threshold
+//!          sends a single packet. The packets are sent straight away, and
+//!          are dropped (and counted) while the device is offline, since a
+//!          late action is worse than none.
+//!
+//!          TRIGGER: uint8_t op, then
+//!              ADD:    rule text -> uint8_t id
+//!              REMOVE: uint8_t id -> nothing
+class Triggers : public IPacketHandler, public ISampleSink {
+ public:
+    //! Value of the op byte of a TRIGGER command.
+    enum Op : uint8_t {
+        ADD = 0,     //!< Add a rule.
+        REMOVE = 1,  //!< Remove a rule.
+    };
+
+    //! Largest number of rules.
+    static constexpr size_t MAX_RULES = 64;
+
+    //! @brief Constructor.
+    explicit Triggers(
+        Outbox* outbox  //!< [in] Used to send the packets.
+    )
+        : m_outbox(outbox) {}
+
+    //! @brief Adds a rule.
+    //! @returns the id of the new rule, or -1 if it couldn't be parsed.
+    int add(
+        char const* ruleStr  //!< [in] Text of the rule.
+    );
+
+    //! @brief Removes a rule.
+    //! @returns false if there was no such rule.
+    bool remove(
+        uint8_t id  //!< [in] Id returned by add.
+    );
+
+    //! @brief Evaluates the rules against a sample.
+    void addSample(
+        uint64_t rxNs,          //!< [in] When the sample was received (Clock::realtimeNs).
+        int32_t const* values,  //!< [in] Value of each field.
+        size_t numFields        //!< [in] Number of fields.
+    ) override;
+
+    //! @brief Publishes how often each rule has fired, and how many
+    //!        packets were dropped.
+    void updateMetrics(
+        Metrics* metrics  //!< [out] Where to store the metrics.
+    ) const;
+
+    //! @brief Handles the TRIGGER command.
+    //! @returns true if the packet was handled.
+    bool handlePacket(
+        Packet const& cmd,  //!< [in] Command packet.
+        Packet* rsp         //!< [out] Response packet.
+    ) override;
+
+ private:
+    //! Compares a value against a threshold.
+    using CompareFn = bool (*)(int32_t value, int32_t threshold);
+
+    //! A parsed rule.
+    struct Rule {
+        bool inUse = false;             //!< Is this slot used?
+        uint8_t field = 0;              //!< Field which is tested.
+        CompareFn compare = nullptr;    //!< Condition to test.
+        int32_t threshold = 0;          //!< Value to compare against.
+        bool matched = false;           //!< Did the previous sample match?
+        uint8_t command = 0;            //!< Command of the packet to send.
+        std::vector<uint8_t> data;      //!< Data of the packet to send.
+        uint64_t fired = 0;             //!< Number of times the rule has fired.
+    };
+
+    void reindex();
+
+    Outbox* m_outbox;                                 //!< Used to send the packets.
+    std::vector<Rule> m_rules;                        //!< Rules, indexed by id.
+    std::vector<std::vector<uint8_t>> m_byField;      //!< Ids of the rules for each field.
+    uint64_t m_numDropped = 0;                        //!< Packets dropped while offline.
+};
@@ -0,0 +1,64 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Udp.cpp
+ *
+ *   @brief  Helpers for the UDP sockets used alongside the bus.
+ *
+ ****************************************************************************/
+
+#include "Udp.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "Log.h"
+
+int Udp::open(char const* hostPort, bool passive) {
+    std::string host;
+    std::string port = hostPort;
+    if (auto colon = port.rfind(':'); colon != std::string::npos) {
+        host = port.substr(0, colon);
+        port = port.substr(colon + 1);
+    }
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo* res = nullptr;
+    if (int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res); rc != 0) {
+        Log::error("Unable to resolve '%s': %s", hostPort, gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    for (auto ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int rc = passive ? bind(fd, ai->ai_addr, ai->ai_addrlen) : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        Log::error("Unable to open UDP socket for '%s': %s", hostPort, strerror(errno));
+    }
+    return fd;
+}
@@ -0,0 +1,30 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   Udp.h
+ *
+ *   @brief  Helpers for the UDP sockets used alongside the bus.
+ *
+ ****************************************************************************/
+
+#pragma once
+
+namespace Udp {
+
+//! @brief Creates a non-blocking UDP socket.
+//! @details An active socket is connected to "host:port". A passive socket
+//!          is bound to "port" (or "host:port") on the local machine.
+//! @returns the socket, or -1 on error.
+int open(
+    char const* hostPort,  //!< [in] Address to connect or bind to.
+    bool passive           //!< [in] true to bind rather than connect.
+);
+
+}  // namespace Udp
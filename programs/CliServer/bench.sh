@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# Runs the CliServer benchmark scenarios and prints the wall clock time each
+# one took (one "scenario seconds" line per scenario).
+#
+# Usage: bench.sh PATH-TO-CliServer
+#
+# One CliServer acts as the server, and a second one run with --bench acts
+# as the client. socat provides the transports:
+#
+#   loopback   TCP over localhost (the client's serial port is bridged to
+#              the server's socket).
+#   pipelined  Several clients at once, each over its own pty pair and each
+#              keeping 16 requests outstanding.
+#   pty        A single client over a pty pair, one request at a time.
+#
+# Only the clients are timed. Each scenario's servers are started before its
+# timer starts, and are stopped (with SIGTERM, so that an instrumented build
+# writes its profile) before the next scenario is set up.
+
+set -e
+
+CLI_SERVER=$(realpath "$1")
+REQUESTS=${BENCH_REQUESTS:-20000}
+CLIENTS=${BENCH_CLIENTS:-4}
+PORT=${BENCH_PORT:-8899}
+
+TMP_DIR=$(mktemp -d)
+PIDS=()
+
+# Stops the servers (and socat processes) of the last scenario.
+stop_servers() {
+    if [ ${#PIDS[@]} -gt 0 ]; then
+        kill "${PIDS[@]}" 2> /dev/null || true
+        wait "${PIDS[@]}" 2> /dev/null || true
+    fi
+    PIDS=()
+}
+
+cleanup() {
+    stop_servers
+    rm -rf "${TMP_DIR}"
+}
+trap cleanup EXIT
+
+# Waits for a path to be created by a background process.
+wait_for() {
+    for _ in $(seq 50); do
+        [ -e "$1" ] && return 0
+        sleep 0.1
+    done
+    echo "Timed out waiting for $1" >&2
+    exit 1
+}
+
+# Creates a pty pair, with a server on the first end. The client end is $1.b
+pty_server() {
+    socat "pty,raw,echo=0,link=$1.a" "pty,raw,echo=0,link=$1.b" &
+    PIDS+=($!)
+    wait_for "$1.a"
+    wait_for "$1.b"
+    "${CLI_SERVER}" --serial "$1.a" > /dev/null &
+    PIDS+=($!)
+    sleep 0.5
+}
+
+# Runs a command and prints how long it took.
+timed() {
+    local name=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    "$@"
+    end=$(date +%s.%N)
+    echo "${name} $(echo "${end} - ${start}" | bc)"
+}
+
+setup_loopback() {
+    "${CLI_SERVER}" --port "${PORT}" > /dev/null &
+    PIDS+=($!)
+    sleep 0.5
+    socat "pty,raw,echo=0,link=${TMP_DIR}/loopback" "tcp:127.0.0.1:${PORT}" &
+    PIDS+=($!)
+    wait_for "${TMP_DIR}/loopback"
+}
+
+run_loopback() {
+    "${CLI_SERVER}" --serial "${TMP_DIR}/loopback" --bench "${REQUESTS}" > /dev/null
+}
+
+setup_pipelined() {
+    for i in $(seq "${CLIENTS}"); do
+        pty_server "${TMP_DIR}/pipelined${i}"
+    done
+}
+
+run_pipelined() {
+    local client_pids=()
+    for i in $(seq "${CLIENTS}"); do
+        "${CLI_SERVER}" --serial "${TMP_DIR}/pipelined${i}.b" --bench "${REQUESTS}:16" > /dev/null &
+        client_pids+=($!)
+    done
+    wait "${client_pids[@]}"
+}
+
+setup_pty() {
+    pty_server "${TMP_DIR}/pty"
+}
+
+run_pty() {
+    "${CLI_SERVER}" --serial "${TMP_DIR}/pty.b" --bench "${REQUESTS}" > /dev/null
+}
+
+for scenario in loopback pipelined pty; do
+    "setup_${scenario}"
+    timed "${scenario}" "run_${scenario}"
+    stop_servers
+done
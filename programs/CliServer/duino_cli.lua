@@ -0,0 +1,31 @@
+-- Wireshark dissector for pcapng files written by CliServer --pcap
+--
+-- Copy this file into your Wireshark personal plugins directory. CliServer
+-- captures use LINKTYPE_USER0 (DLT 147) and each frame consists of the
+-- command byte followed by the packet data.
+
+local duino_cli = Proto("duino_cli", "Duino CLI Packet")
+
+local f_command = ProtoField.uint8("duino_cli.command", "Command", base.HEX)
+local f_length = ProtoField.uint16("duino_cli.length", "Length", base.DEC)
+local f_data = ProtoField.bytes("duino_cli.data", "Data")
+
+duino_cli.fields = { f_command, f_length, f_data }
+
+function duino_cli.dissector(buffer, pinfo, tree)
+    if buffer:len() < 1 then
+        return 0
+    end
+    pinfo.cols.protocol = "DuinoCli"
+
+    local subtree = tree:add(duino_cli, buffer(), "Duino CLI Packet")
+    subtree:add(f_command, buffer(0, 1))
+    subtree:add(f_length, buffer:len() - 1):set_generated()
+    if buffer:len() > 1 then
+        subtree:add(f_data, buffer(1))
+    end
+    pinfo.cols.info = string.format("Cmd 0x%02x Len %d", buffer(0, 1):uint(), buffer:len() - 1)
+    return buffer:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, duino_cli)
@@ -0,0 +1,127 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   DeltaDumpHandlerTest.cpp
+ *
+ *   @brief  Tests for DeltaDumpHandler.
+ *
+ ****************************************************************************/
+
+#include "DeltaDumpHandler.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <vector>
+
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+constexpr uint8_t BLOCK_SIZE = 8;
+
+//! Dumps a local buffer through a DeltaDumpHandler.
+class DeltaDumpHandlerTest : public ::testing::Test {
+ protected:
+    DeltaDumpHandlerTest()
+        : m_cmd(sizeof(this->m_cmdData), this->m_cmdData), m_rsp(sizeof(this->m_rspData), this->m_rspData) {
+        for (size_t i = 0; i < sizeof(this->m_memory); i++) {
+            this->m_memory[i] = static_cast<uint8_t>(i);
+        }
+    }
+
+    ~DeltaDumpHandlerTest() override { PacketWriter::setLimit(MAX_PACKET_DATA_LEN); }
+
+    //! Response header, and the indices of the blocks which were returned.
+    struct Reply {
+        uint32_t generation = 0;
+        uint16_t numChanged = 0;
+        uint16_t nextCursor = 0;
+        std::vector<uint16_t> blocks;
+    };
+
+    Packet const& dump(uint32_t generation, uint16_t cursor) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::DELTA_DUMP);
+        writer.write(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(this->m_memory)));
+        writer.write(static_cast<uint32_t>(sizeof(this->m_memory)));
+        writer.write(generation);
+        writer.write(cursor);
+        writer.write(BLOCK_SIZE);
+        EXPECT_TRUE(this->m_handler.handlePacket(this->m_cmd, &this->m_rsp));
+        return this->m_rsp;
+    }
+
+    Reply parse(Packet const& rsp) {
+        Reply reply;
+        EXPECT_EQ(rsp.getCommand(), ServerCommand::DELTA_DUMP);
+        PacketReader reader(rsp);
+        reply.generation = reader.read<uint32_t>();
+        reply.numChanged = reader.read<uint16_t>();
+        reply.nextCursor = reader.read<uint16_t>();
+        while (reader.ok() && reader.remaining() > 0) {
+            uint16_t block = reader.read<uint16_t>();
+            EXPECT_EQ(memcmp(reader.current(), &this->m_memory[block * BLOCK_SIZE], BLOCK_SIZE), 0);
+            reader.skip(BLOCK_SIZE);
+            reply.blocks.push_back(block);
+        }
+        EXPECT_TRUE(reader.ok());
+        return reply;
+    }
+
+    uint8_t m_memory[64];
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    uint8_t m_rspData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    Packet m_rsp;
+    DeltaDumpHandler m_handler;
+};
+
+}  // namespace
+
+TEST_F(DeltaDumpHandlerTest, FirstDumpReturnsEveryBlock) {
+    Reply reply = this->parse(this->dump(0, 0));
+    EXPECT_NE(reply.generation, 0u);
+    EXPECT_EQ(reply.numChanged, 8);
+    EXPECT_EQ(reply.nextCursor, DeltaDumpHandler::NO_MORE_BLOCKS);
+    EXPECT_EQ(reply.blocks, (std::vector<uint16_t>{0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+TEST_F(DeltaDumpHandlerTest, LaterDumpReturnsOnlyChangedBlocks) {
+    Reply first = this->parse(this->dump(0, 0));
+    this->m_memory[20] ^= 0xff;
+    this->m_memory[63] ^= 0xff;
+    Reply second = this->parse(this->dump(first.generation, 0));
+    EXPECT_GT(second.generation, first.generation);
+    EXPECT_EQ(second.blocks, (std::vector<uint16_t>{2, 7}));
+
+    Reply third = this->parse(this->dump(second.generation, 0));
+    EXPECT_TRUE(third.blocks.empty());
+}
+
+TEST_F(DeltaDumpHandlerTest, ContinuesFromCursorWithinPacketLimit) {
+    // Room for the header and 3 blocks of 2 + 8 bytes.
+    PacketWriter::setLimit(40);
+    Reply first = this->parse(this->dump(0, 0));
+    EXPECT_EQ(first.blocks, (std::vector<uint16_t>{0, 1, 2}));
+    EXPECT_EQ(first.nextCursor, 3);
+
+    Reply second = this->parse(this->dump(first.generation, first.nextCursor));
+    EXPECT_EQ(second.generation, first.generation);
+    EXPECT_EQ(second.blocks, (std::vector<uint16_t>{3, 4, 5}));
+    EXPECT_EQ(second.nextCursor, 6);
+}
+
+TEST_F(DeltaDumpHandlerTest, ContinuingAnOldSnapshotIsStale) {
+    Reply first = this->parse(this->dump(0, 0));
+    Packet const& rsp = this->dump(first.generation + 1, 1);
+    ASSERT_EQ(rsp.getCommand(), ServerCommand::ERROR);
+    EXPECT_EQ(rsp.getData()[1], static_cast<uint8_t>(ServerError::STALE));
+}
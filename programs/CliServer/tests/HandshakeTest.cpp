@@ -0,0 +1,113 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   HandshakeTest.cpp
+ *
+ *   @brief  Tests for Handshake.
+ *
+ ****************************************************************************/
+
+#include "Handshake.h"
+
+#include <gtest/gtest.h>
+
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+//! Negotiates with a server which handles 128 byte packets and 4 requests.
+class HandshakeTest : public ::testing::Test {
+ protected:
+    HandshakeTest()
+        : m_cmd(sizeof(this->m_cmdData), this->m_cmdData),
+          m_rsp(sizeof(this->m_rspData), this->m_rspData),
+          m_handshake(128, 4) {
+        this->m_handshake.offer(Feature::SERVER_TIMING);
+    }
+
+    ~HandshakeTest() override { this->m_handshake.reset(); }
+
+    void hello(uint8_t version, uint16_t maxPacketSize, uint8_t window, uint8_t features) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::HELLO);
+        writer.write(version);
+        writer.write(maxPacketSize);
+        writer.write(window);
+        writer.write(features);
+        EXPECT_TRUE(this->m_handshake.handlePacket(this->m_cmd, &this->m_rsp));
+    }
+
+    //! Sets m_cmd to a request with len bytes of data.
+    //! @details Requests are received, so they aren't built with PacketWriter.
+    Packet const& request(size_t len) {
+        this->m_cmd.setCommand(ServerCommand::PING);
+        this->m_cmd.setLength(len);
+        return this->m_cmd;
+    }
+
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    uint8_t m_rspData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    Packet m_rsp;
+    Handshake m_handshake;
+};
+
+}  // namespace
+
+TEST_F(HandshakeTest, LegacyClientsAreNotLimited) {
+    EXPECT_FALSE(this->m_handshake.isNegotiated());
+    EXPECT_EQ(this->m_handshake.current().maxPacketSize, Handshake::LEGACY.maxPacketSize);
+    EXPECT_FALSE(this->m_handshake.current().has(Feature::SERVER_TIMING));
+    EXPECT_EQ(this->m_handshake.admit(this->request(200), 50), ServerError::NONE);
+}
+
+TEST_F(HandshakeTest, NegotiatesTheSmallerLimitsAndCommonFeatures) {
+    this->hello(2, 200, 2, 0xff);
+    ASSERT_EQ(this->m_rsp.getCommand(), ServerCommand::HELLO);
+    PacketReader reader(this->m_rsp);
+    EXPECT_EQ(reader.read<uint8_t>(), Handshake::VERSION);
+    EXPECT_EQ(reader.read<uint16_t>(), 128);
+    EXPECT_EQ(reader.read<uint8_t>(), 2);
+    EXPECT_EQ(reader.read<uint8_t>(), Feature::SERVER_TIMING);
+    EXPECT_TRUE(reader.ok());
+
+    EXPECT_TRUE(this->m_handshake.isNegotiated());
+    EXPECT_TRUE(this->m_handshake.current().has(Feature::SERVER_TIMING));
+}
+
+TEST_F(HandshakeTest, EnforcesTheNegotiatedLimits) {
+    this->hello(1, 64, 2, 0);
+    EXPECT_FALSE(this->m_handshake.current().has(Feature::SERVER_TIMING));
+    EXPECT_EQ(this->m_handshake.admit(this->request(64), 1), ServerError::NONE);
+    EXPECT_EQ(this->m_handshake.admit(this->request(65), 1), ServerError::TOO_BIG);
+    EXPECT_EQ(this->m_handshake.admit(this->request(1), 2), ServerError::OVERLOADED);
+}
+
+TEST_F(HandshakeTest, LimitsResponsesUntilReset) {
+    this->hello(1, 64, 2, 0);
+    EXPECT_EQ(PacketWriter::maxLength(this->m_rsp), 64u);
+    PacketWriter writer(&this->m_rsp, ServerCommand::PING);
+    for (size_t i = 0; i < 65; i++) {
+        writer.write(static_cast<uint8_t>(i));
+    }
+    EXPECT_FALSE(writer.ok());
+    EXPECT_EQ(this->m_rsp.getLength(), 64u);
+
+    this->m_handshake.reset();
+    EXPECT_FALSE(this->m_handshake.isNegotiated());
+    EXPECT_EQ(PacketWriter::maxLength(this->m_rsp), Handshake::LEGACY.maxPacketSize);
+}
+
+TEST_F(HandshakeTest, RejectsMalformedHello) {
+    this->hello(1, 0, 2, 0);
+    ASSERT_EQ(this->m_rsp.getCommand(), ServerCommand::ERROR);
+    EXPECT_EQ(this->m_rsp.getData()[1], static_cast<uint8_t>(ServerError::BAD_REQUEST));
+    EXPECT_FALSE(this->m_handshake.isNegotiated());
+}
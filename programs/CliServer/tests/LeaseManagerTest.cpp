@@ -0,0 +1,165 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   LeaseManagerTest.cpp
+ *
+ *   @brief  Tests for LeaseManager.
+ *
+ ****************************************************************************/
+
+#include "LeaseManager.h"
+
+#include <gtest/gtest.h>
+
+#include "Clock.h"
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+using Mode = LeaseManager::Mode;
+using State = LeaseManager::State;
+
+constexpr uint32_t LEASE_MS = 60000;
+
+//! Sends lease commands to a LeaseManager with two devices.
+class LeaseManagerTest : public ::testing::Test {
+ protected:
+    LeaseManagerTest()
+        : m_cmd(sizeof(this->m_cmdData), this->m_cmdData), m_rsp(sizeof(this->m_rspData), this->m_rspData) {
+        this->m_leases.addDevice("dev0");
+        this->m_leases.addDevice("dev1");
+    }
+
+    //! Reply to LEASE_ACQUIRE (or the error, if it failed).
+    struct Reply {
+        ServerError err = ServerError::NONE;
+        State state = State::GRANTED;
+        uint16_t position = 0;
+    };
+
+    Reply acquire(uint32_t clientId, uint8_t device, Mode mode) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::LEASE_ACQUIRE);
+        writer.write(clientId);
+        writer.write(device);
+        writer.write(static_cast<uint8_t>(mode));
+        writer.write(LEASE_MS);
+        EXPECT_TRUE(this->m_leases.handlePacket(this->m_cmd, &this->m_rsp));
+
+        Reply reply;
+        PacketReader reader(this->m_rsp);
+        if (this->m_rsp.getCommand() == ServerCommand::ERROR) {
+            reader.read<uint8_t>();
+            reply.err = static_cast<ServerError>(reader.read<uint8_t>());
+        } else {
+            reply.state = static_cast<State>(reader.read<uint8_t>());
+            reply.position = reader.read<uint16_t>();
+        }
+        EXPECT_TRUE(reader.ok());
+        return reply;
+    }
+
+    void release(uint32_t clientId, uint8_t device) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::LEASE_RELEASE);
+        writer.write(clientId);
+        writer.write(device);
+        EXPECT_TRUE(this->m_leases.handlePacket(this->m_cmd, &this->m_rsp));
+        EXPECT_EQ(this->m_rsp.getCommand(), ServerCommand::LEASE_RELEASE);
+    }
+
+    ServerError authorize(uint32_t clientId, uint8_t device, uint8_t command) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::DEVICE_REQUEST);
+        writer.write(clientId);
+        writer.write(device);
+        writer.write(command);
+        writer.write(static_cast<uint8_t>(0x5a));
+        return this->m_leases.authorize(&this->m_cmd, Clock::monotonicNs() / 1000000);
+    }
+
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    uint8_t m_rspData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    Packet m_rsp;
+    LeaseManager m_leases;
+};
+
+}  // namespace
+
+TEST_F(LeaseManagerTest, SharedLeasesAreHeldTogether) {
+    EXPECT_EQ(this->acquire(1, 0, Mode::SHARED).state, State::GRANTED);
+    EXPECT_EQ(this->acquire(2, 0, Mode::SHARED).state, State::GRANTED);
+    Reply reply = this->acquire(3, 0, Mode::EXCLUSIVE);
+    EXPECT_EQ(reply.state, State::QUEUED);
+    EXPECT_EQ(reply.position, 1);
+}
+
+TEST_F(LeaseManagerTest, SharedRequestsWaitBehindExclusive) {
+    EXPECT_EQ(this->acquire(1, 0, Mode::SHARED).state, State::GRANTED);
+    EXPECT_EQ(this->acquire(2, 0, Mode::EXCLUSIVE).state, State::QUEUED);
+    Reply reply = this->acquire(3, 0, Mode::SHARED);
+    EXPECT_EQ(reply.state, State::QUEUED);
+    EXPECT_EQ(reply.position, 2);
+
+    // The exclusive request goes first, and then the shared one.
+    this->release(1, 0);
+    EXPECT_EQ(this->acquire(2, 0, Mode::EXCLUSIVE).state, State::GRANTED);
+    EXPECT_EQ(this->acquire(3, 0, Mode::SHARED).state, State::QUEUED);
+    this->release(2, 0);
+    EXPECT_EQ(this->acquire(3, 0, Mode::SHARED).state, State::GRANTED);
+}
+
+TEST_F(LeaseManagerTest, ChangingModeInPlaceConflicts) {
+    EXPECT_EQ(this->acquire(1, 0, Mode::SHARED).state, State::GRANTED);
+    EXPECT_EQ(this->acquire(2, 0, Mode::SHARED).state, State::GRANTED);
+    // Two shared holders upgrading would wait on each other forever.
+    EXPECT_EQ(this->acquire(1, 0, Mode::EXCLUSIVE).err, ServerError::CONFLICT);
+    EXPECT_EQ(this->acquire(2, 0, Mode::EXCLUSIVE).err, ServerError::CONFLICT);
+
+    this->release(2, 0);
+    EXPECT_EQ(this->acquire(2, 0, Mode::EXCLUSIVE).state, State::QUEUED);
+    EXPECT_EQ(this->acquire(2, 0, Mode::SHARED).err, ServerError::CONFLICT);
+}
+
+TEST_F(LeaseManagerTest, ExclusiveHolderMayAskForShared) {
+    EXPECT_EQ(this->acquire(1, 1, Mode::EXCLUSIVE).state, State::GRANTED);
+    Reply reply = this->acquire(1, 1, Mode::SHARED);
+    EXPECT_EQ(reply.err, ServerError::NONE);
+    EXPECT_EQ(reply.state, State::GRANTED);
+}
+
+TEST_F(LeaseManagerTest, AuthorizeChecksTheLeaseForTheWrappedCommand) {
+    EXPECT_EQ(this->authorize(1, 0, ServerCommand::REG_READ), ServerError::NOT_LEASED);
+    EXPECT_EQ(this->acquire(1, 0, Mode::SHARED).state, State::GRANTED);
+    EXPECT_EQ(this->authorize(1, 0, ServerCommand::REG_WRITE), ServerError::NOT_LEASED);
+    EXPECT_EQ(this->authorize(1, 1, ServerCommand::REG_READ), ServerError::NOT_LEASED);
+
+    // An allowed request is unwrapped in place.
+    EXPECT_EQ(this->authorize(1, 0, ServerCommand::REG_READ), ServerError::NONE);
+    EXPECT_EQ(this->m_cmd.getCommand(), ServerCommand::REG_READ);
+    ASSERT_EQ(this->m_cmd.getLength(), 1u);
+    EXPECT_EQ(this->m_cmd.getData()[0], 0x5a);
+}
+
+TEST_F(LeaseManagerTest, BareRequestsOnlyForCommandsWithoutADevice) {
+    PacketWriter(&this->m_cmd, ServerCommand::REG_READ);
+    EXPECT_EQ(this->m_leases.authorize(&this->m_cmd, 0), ServerError::NOT_LEASED);
+    PacketWriter(&this->m_cmd, ServerCommand::HEALTH);
+    EXPECT_EQ(this->m_leases.authorize(&this->m_cmd, 0), ServerError::NONE);
+}
+
+TEST_F(LeaseManagerTest, TargetCommandLooksInsideDeviceRequest) {
+    PacketWriter writer(&this->m_cmd, ServerCommand::DEVICE_REQUEST);
+    writer.write(static_cast<uint32_t>(1));
+    writer.write(static_cast<uint8_t>(0));
+    writer.write(ServerCommand::REG_WRITE);
+    EXPECT_EQ(LeaseManager::targetCommand(this->m_cmd), ServerCommand::REG_WRITE);
+    PacketWriter(&this->m_cmd, ServerCommand::PING);
+    EXPECT_EQ(LeaseManager::targetCommand(this->m_cmd), ServerCommand::PING);
+}
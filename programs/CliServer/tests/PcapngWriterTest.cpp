@@ -0,0 +1,116 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   PcapngWriterTest.cpp
+ *
+ *   @brief  Tests for PcapngWriter.
+ *
+ ****************************************************************************/
+
+#include "PcapngWriter.h"
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+
+//! Creates an empty temporary file, and removes it again.
+class TempFile {
+ public:
+    TempFile() {
+        char name[] = "/tmp/PcapngWriterTest.XXXXXX";
+        int fd = mkstemp(name);
+        ::close(fd);
+        this->m_name = name;
+    }
+
+    ~TempFile() { unlink(this->m_name.c_str()); }
+
+    char const* name() const { return this->m_name.c_str(); }
+
+    std::vector<uint8_t> contents() const {
+        std::ifstream file(this->m_name, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+ private:
+    std::string m_name;
+};
+
+uint16_t u16(std::vector<uint8_t> const& data, size_t offset) {
+    uint16_t val;
+    memcpy(&val, &data[offset], sizeof(val));
+    return val;
+}
+
+uint32_t u32(std::vector<uint8_t> const& data, size_t offset) {
+    uint32_t val;
+    memcpy(&val, &data[offset], sizeof(val));
+    return val;
+}
+
+}  // namespace
+
+TEST(PcapngWriterTest, WritesSectionInterfaceAndPacketBlocks) {
+    TempFile file;
+    PcapngWriter writer;
+    ASSERT_TRUE(writer.open(file.name()));
+    EXPECT_EQ(writer.addInterface("socket"), 0u);
+    EXPECT_EQ(writer.addInterface("/dev/ttyUSB0"), 1u);
+    uint8_t data[] = {0x11, 0x22, 0x33};
+    writer.writePacket(1, 0x123456789abcdef0ull, PcapngWriter::Direction::OUTBOUND, 0x42, data, sizeof(data));
+    writer.close();
+
+    std::vector<uint8_t> contents = file.contents();
+    size_t offset = 0;
+    std::vector<uint32_t> blockTypes;
+    while (offset + 12 <= contents.size()) {
+        uint32_t blockLen = u32(contents, offset + 4);
+        ASSERT_EQ(blockLen % 4, 0u);
+        ASSERT_LE(offset + blockLen, contents.size());
+        // Each block ends with a copy of its length.
+        EXPECT_EQ(u32(contents, offset + blockLen - 4), blockLen);
+        blockTypes.push_back(u32(contents, offset));
+
+        if (blockTypes.size() == 1) {
+            EXPECT_EQ(u32(contents, offset + 8), 0x1A2B3C4Du);
+        } else if (blockTypes.size() == 2) {
+            EXPECT_EQ(u16(contents, offset + 8), PcapngWriter::LINK_TYPE);
+        } else if (blockTypes.size() == 4) {
+            EXPECT_EQ(u32(contents, offset + 8), 1u);
+            EXPECT_EQ(u32(contents, offset + 12), 0x12345678u);
+            EXPECT_EQ(u32(contents, offset + 16), 0x9abcdef0u);
+            EXPECT_EQ(u32(contents, offset + 20), 4u);  // Captured length
+            EXPECT_EQ(u32(contents, offset + 24), 4u);  // Original length
+            EXPECT_EQ(contents[offset + 28], 0x42);
+            EXPECT_EQ(memcmp(&contents[offset + 29], data, sizeof(data)), 0);
+            // epb_flags holds the direction.
+            EXPECT_EQ(u16(contents, offset + 32), 2u);
+            EXPECT_EQ(u32(contents, offset + 36), 2u);
+        }
+        offset += blockLen;
+    }
+    EXPECT_EQ(offset, contents.size());
+    EXPECT_EQ(blockTypes, (std::vector<uint32_t>{0x0A0D0D0A, 1, 1, 6}));
+}
+
+TEST(PcapngWriterTest, IgnoresPacketsWhenClosed) {
+    PcapngWriter writer;
+    uint8_t data[] = {0x01};
+    writer.writePacket(0, 0, PcapngWriter::Direction::INBOUND, 0x40, data, sizeof(data));
+    EXPECT_FALSE(writer.isOpen());
+}
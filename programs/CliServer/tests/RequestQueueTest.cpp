@@ -0,0 +1,142 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   RequestQueueTest.cpp
+ *
+ *   @brief  Tests for RequestQueue.
+ *
+ ****************************************************************************/
+
+#include "RequestQueue.h"
+
+#include <gtest/gtest.h>
+
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+using Verdict = RequestQueue::Verdict;
+
+constexpr uint64_t MS = 1000000;
+constexpr uint8_t LOW = ServerCommand::DELTA_DUMP;
+constexpr uint8_t INTERACTIVE = ServerCommand::PING;
+
+//! Queues requests, with DELTA_DUMP marked as low priority.
+class RequestQueueTest : public ::testing::Test {
+ protected:
+    RequestQueueTest() : m_cmd(sizeof(this->m_cmdData), this->m_cmdData) {
+        this->m_queue.setLowPriority(LOW);
+    }
+
+    bool push(uint8_t command, uint64_t queuedNs) {
+        PacketWriter writer(&this->m_cmd, command);
+        writer.write(static_cast<uint8_t>(this->m_queue.size()));
+        return this->m_queue.push(this->m_cmd, TraceContext(), 0, 0, queuedNs);
+    }
+
+    //! @returns the verdict for the next request, which has to be there.
+    Verdict pop(uint64_t nowNs, uint8_t* command = nullptr) {
+        RequestQueue::Entry entry;
+        Verdict verdict = Verdict::HANDLE;
+        EXPECT_TRUE(this->m_queue.pop(nowNs, &entry, &verdict));
+        if (command != nullptr) {
+            *command = entry.command;
+        }
+        return verdict;
+    }
+
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    RequestQueue m_queue;
+};
+
+}  // namespace
+
+TEST_F(RequestQueueTest, InteractiveRequestsGoFirst) {
+    ASSERT_TRUE(this->push(LOW, 0));
+    ASSERT_TRUE(this->push(INTERACTIVE, 0));
+    uint8_t command;
+    this->pop(0, &command);
+    EXPECT_EQ(command, INTERACTIVE);
+    this->pop(0, &command);
+    EXPECT_EQ(command, LOW);
+    EXPECT_TRUE(this->m_queue.isEmpty());
+}
+
+TEST_F(RequestQueueTest, LowPriorityRequestsLeaveRoomForInteractive) {
+    for (size_t i = 0; i < RequestQueue::MAX_LOW_PRIORITY_QUEUED; i++) {
+        ASSERT_TRUE(this->push(LOW, 0));
+    }
+    EXPECT_FALSE(this->push(LOW, 0));
+    while (this->m_queue.size() < RequestQueue::MAX_QUEUED) {
+        ASSERT_TRUE(this->push(INTERACTIVE, 0));
+    }
+    EXPECT_FALSE(this->push(INTERACTIVE, 0));
+    EXPECT_EQ(this->m_queue.size(), RequestQueue::MAX_QUEUED);
+}
+
+TEST_F(RequestQueueTest, DeviceRequestIsClassifiedByWrappedCommand) {
+    PacketWriter writer(&this->m_cmd, ServerCommand::DEVICE_REQUEST);
+    writer.write(static_cast<uint32_t>(1));
+    writer.write(static_cast<uint8_t>(0));
+    writer.write(LOW);
+    for (size_t i = 0; i < RequestQueue::MAX_LOW_PRIORITY_QUEUED; i++) {
+        ASSERT_TRUE(this->m_queue.push(this->m_cmd, TraceContext(), 0, 0, 0));
+    }
+    EXPECT_FALSE(this->m_queue.push(this->m_cmd, TraceContext(), 0, 0, 0));
+}
+
+TEST_F(RequestQueueTest, NothingIsShedWithoutATarget) {
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(this->push(LOW, 0));
+    }
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(this->pop(1000 * MS), Verdict::HANDLE);
+    }
+}
+
+TEST_F(RequestQueueTest, ShedsOnceDelayStaysAboveTargetForAnInterval) {
+    this->m_queue.setTarget(5 * MS, 100 * MS);
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(this->push(LOW, 0));
+    }
+    // Above the target, but not yet for a whole interval.
+    EXPECT_EQ(this->pop(10 * MS), Verdict::HANDLE);
+    EXPECT_EQ(this->pop(50 * MS), Verdict::HANDLE);
+    // The interval has passed, so shedding starts ...
+    EXPECT_EQ(this->pop(120 * MS), Verdict::SHED);
+    // ... and the next request is shed one interval later.
+    EXPECT_EQ(this->pop(121 * MS), Verdict::HANDLE);
+    EXPECT_EQ(this->pop(230 * MS), Verdict::SHED);
+
+    // Interactive requests are never shed.
+    ASSERT_TRUE(this->push(INTERACTIVE, 0));
+    EXPECT_EQ(this->pop(1000 * MS), Verdict::HANDLE);
+}
+
+TEST_F(RequestQueueTest, DelayBelowTargetEndsShedding) {
+    this->m_queue.setTarget(5 * MS, 100 * MS);
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(this->push(LOW, 0));
+    }
+    EXPECT_EQ(this->pop(10 * MS), Verdict::HANDLE);
+    EXPECT_EQ(this->pop(120 * MS), Verdict::SHED);
+    EXPECT_EQ(this->pop(121 * MS), Verdict::HANDLE);
+
+    // A request which didn't wait long ends the episode, so a later delay
+    // has to stay above the target for a whole interval again.
+    ASSERT_TRUE(this->push(LOW, 200 * MS));
+    EXPECT_EQ(this->pop(201 * MS), Verdict::HANDLE);
+    ASSERT_TRUE(this->push(LOW, 300 * MS));
+    ASSERT_TRUE(this->push(LOW, 300 * MS));
+    EXPECT_EQ(this->pop(350 * MS), Verdict::HANDLE);
+    EXPECT_EQ(this->pop(360 * MS), Verdict::HANDLE);
+}
@@ -0,0 +1,144 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   TelemetryHistoryTest.cpp
+ *
+ *   @brief  Tests for TelemetryHistory.
+ *
+ ****************************************************************************/
+
+#include "TelemetryHistory.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "PacketData.h"
+#include "ServerCommand.h"
+
+namespace {
+
+constexpr uint64_t BASE_NS = 1700000000000000000ull;
+constexpr uint64_t MS = 1000000;
+
+using Point = std::pair<uint64_t, int32_t>;
+
+//! Stores samples with two fields and queries them back.
+class TelemetryHistoryTest : public ::testing::Test {
+ protected:
+    TelemetryHistoryTest()
+        : m_cmd(sizeof(this->m_cmdData), this->m_cmdData), m_rsp(sizeof(this->m_rspData), this->m_rspData) {
+        this->m_history.setRetention(60000);
+    }
+
+    void add(uint64_t rxNs, int32_t field0, int32_t field1) {
+        int32_t values[] = {field0, field1};
+        this->m_history.addSample(rxNs, values, 2);
+    }
+
+    //! @brief Sends one HISTORY query.
+    //! @returns nextStartNs from the response.
+    uint64_t query(uint8_t field, uint64_t startNs, uint64_t endNs, uint64_t stepNs, std::vector<Point>* points) {
+        PacketWriter writer(&this->m_cmd, ServerCommand::HISTORY);
+        writer.write(field);
+        writer.write(startNs);
+        writer.write(endNs);
+        writer.write(stepNs);
+        EXPECT_TRUE(this->m_history.handlePacket(this->m_cmd, &this->m_rsp));
+        EXPECT_EQ(this->m_rsp.getCommand(), ServerCommand::HISTORY);
+
+        PacketReader reader(this->m_rsp);
+        uint8_t numPoints = reader.read<uint8_t>();
+        uint64_t nextStartNs = reader.read<uint64_t>();
+        for (uint8_t i = 0; i < numPoints; i++) {
+            uint64_t timeNs = reader.read<uint64_t>();
+            int32_t value = reader.read<int32_t>();
+            points->emplace_back(timeNs, value);
+        }
+        EXPECT_TRUE(reader.ok());
+        EXPECT_EQ(reader.remaining(), 0u);
+        return nextStartNs;
+    }
+
+    //! @brief Repeats a query until it's complete.
+    std::vector<Point> queryAll(uint8_t field, uint64_t startNs, uint64_t endNs, uint64_t stepNs) {
+        std::vector<Point> points;
+        while (startNs != 0) {
+            startNs = this->query(field, startNs, endNs, stepNs, &points);
+        }
+        return points;
+    }
+
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    uint8_t m_rspData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    Packet m_rsp;
+    TelemetryHistory m_history;
+};
+
+}  // namespace
+
+TEST_F(TelemetryHistoryTest, RawSamplesRoundTrip) {
+    // Enough samples to span several blocks and several responses, with
+    // deltas from tiny to the full range of the field.
+    std::vector<Point> expected;
+    int32_t const extremes[] = {INT32_MIN, INT32_MAX, 0, -1, 1, INT32_MAX, INT32_MIN};
+    for (uint32_t i = 0; i < 3 * TelemetryHistory::BLOCK_SAMPLES; i++) {
+        uint64_t timeNs = BASE_NS + i * MS + (i % 7) * 1000;
+        int32_t value = i < 7 ? extremes[i] : static_cast<int32_t>(i * i) - 1000;
+        this->add(timeNs, -static_cast<int32_t>(i), value);
+        expected.emplace_back(timeNs, value);
+    }
+    EXPECT_EQ(this->queryAll(1, BASE_NS, BASE_NS + 1000 * MS, 0), expected);
+
+    std::vector<Point> field0 = this->queryAll(0, BASE_NS, BASE_NS + 1000 * MS, 0);
+    ASSERT_EQ(field0.size(), expected.size());
+    EXPECT_EQ(field0.back().second, -static_cast<int32_t>(expected.size() - 1));
+}
+
+TEST_F(TelemetryHistoryTest, QueryIsLimitedToTheRange) {
+    for (uint32_t i = 0; i < 10; i++) {
+        this->add(BASE_NS + i * MS, 0, static_cast<int32_t>(i));
+    }
+    std::vector<Point> points = this->queryAll(1, BASE_NS + 3 * MS, BASE_NS + 6 * MS, 0);
+    EXPECT_EQ(points, (std::vector<Point>{{BASE_NS + 3 * MS, 3}, {BASE_NS + 4 * MS, 4}, {BASE_NS + 5 * MS, 5}}));
+}
+
+TEST_F(TelemetryHistoryTest, StepsAreAveraged) {
+    for (uint32_t i = 0; i < 10; i++) {
+        this->add(BASE_NS + i * MS, 0, static_cast<int32_t>(i));
+    }
+    std::vector<Point> points = this->queryAll(1, BASE_NS, BASE_NS + 10 * MS, 5 * MS);
+    EXPECT_EQ(points, (std::vector<Point>{{BASE_NS, 2}, {BASE_NS + 5 * MS, 7}}));
+}
+
+TEST_F(TelemetryHistoryTest, ExpiredBlocksAreDropped) {
+    for (uint32_t i = 0; i < TelemetryHistory::BLOCK_SAMPLES; i++) {
+        this->add(BASE_NS + i * MS, 0, 1);
+    }
+    uint64_t laterNs = BASE_NS + 120000 * MS;
+    this->add(laterNs, 0, 2);
+    std::vector<Point> points = this->queryAll(1, BASE_NS, laterNs + 1, 0);
+    EXPECT_EQ(points, (std::vector<Point>{{laterNs, 2}}));
+}
+
+TEST_F(TelemetryHistoryTest, DisabledHistoryIsNotAvailable) {
+    this->m_history.setRetention(0);
+    PacketWriter writer(&this->m_cmd, ServerCommand::HISTORY);
+    writer.write(static_cast<uint8_t>(0));
+    writer.write(BASE_NS);
+    writer.write(BASE_NS + MS);
+    writer.write(static_cast<uint64_t>(0));
+    EXPECT_TRUE(this->m_history.handlePacket(this->m_cmd, &this->m_rsp));
+    ASSERT_EQ(this->m_rsp.getCommand(), ServerCommand::ERROR);
+    EXPECT_EQ(this->m_rsp.getData()[1], static_cast<uint8_t>(ServerError::NOT_AVAILABLE));
+}
@@ -0,0 +1,149 @@
+/****************************************************************************
+ *
+ *   @copyright Copyright (c) 2024 Dave Hylands     <dhylands@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the MIT License version as described in the
+ *   LICENSE file in the root of this repository.
+ *
+ ****************************************************************************/
+/**
+ *   @file   TriggersTest.cpp
+ *
+ *   @brief  Tests for Triggers.
+ *
+ ****************************************************************************/
+
+#include "Triggers.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "LinuxSerialBus.h"
+#include "Metrics.h"
+#include "Outbox.h"
+#include "PacketData.h"
+#include "PacketQueue.h"
+
+namespace {
+
+//! Sends the triggered packets over a serial bus on a pseudo terminal.
+class TriggersTest : public ::testing::Test {
+ protected:
+    TriggersTest()
+        : m_cmd(sizeof(this->m_cmdData), this->m_cmdData),
+          m_rsp(sizeof(this->m_rspData), this->m_rspData),
+          m_bus(&this->m_cmd, &this->m_rsp),
+          m_outbox(&this->m_bus, &this->m_queue),
+          m_triggers(&this->m_outbox) {}
+
+    void SetUp() override {
+        this->m_pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        ASSERT_GE(this->m_pty, 0);
+        ASSERT_EQ(grantpt(this->m_pty), 0);
+        ASSERT_EQ(unlockpt(this->m_pty), 0);
+        ASSERT_EQ(this->m_bus.open(ptsname(this->m_pty), 115200), IBus::Error::NONE);
+    }
+
+    void TearDown() override {
+        this->m_bus.close();
+        ::close(this->m_pty);
+    }
+
+    void sample(int32_t field0, int32_t field1) {
+        int32_t values[] = {field0, field1};
+        this->m_triggers.addSample(0, values, 2);
+    }
+
+    //! @returns the number of bytes written to the bus since the last call.
+    size_t bytesWritten() {
+        size_t total = 0;
+        uint8_t buf[256];
+        ssize_t len;
+        while ((len = read(this->m_pty, buf, sizeof(buf))) > 0) {
+            total += len;
+        }
+        return total;
+    }
+
+    //! @returns the metrics published by the triggers.
+    std::map<std::string, double> metrics() {
+        Metrics metrics;
+        this->m_triggers.updateMetrics(&metrics);
+        char fileName[] = "/tmp/TriggersTest.XXXXXX";
+        ::close(mkstemp(fileName));
+        EXPECT_TRUE(metrics.write(fileName));
+        std::map<std::string, double> values;
+        std::ifstream file(fileName);
+        std::string name;
+        double value;
+        while (file >> name >> value) {
+            values[name] = value;
+        }
+        unlink(fileName);
+        return values;
+    }
+
+    uint8_t m_cmdData[MAX_PACKET_DATA_LEN];
+    uint8_t m_rspData[MAX_PACKET_DATA_LEN];
+    Packet m_cmd;
+    Packet m_rsp;
+    LinuxSerialBus m_bus;
+    PacketQueue m_queue;
+    Outbox m_outbox;
+    Triggers m_triggers;
+    int m_pty = -1;
+};
+
+}  // namespace
+
+TEST_F(TriggersTest, ParsesRules) {
+    EXPECT_EQ(this->m_triggers.add("1 > 1000 -> 0x4e 0x10 0x00 0x01"), 0);
+    EXPECT_EQ(this->m_triggers.add("0<=-5->0x4e"), 1);
+    EXPECT_EQ(this->m_triggers.add("0 != 0x7fffffff -> 64 255"), 2);
+
+    EXPECT_EQ(this->m_triggers.add(""), -1);
+    EXPECT_EQ(this->m_triggers.add("1 >> 5 -> 0x4e"), -1);
+    EXPECT_EQ(this->m_triggers.add("1 > 5"), -1);
+    EXPECT_EQ(this->m_triggers.add("1 > 5 -> 0x4e 256"), -1);
+    EXPECT_EQ(this->m_triggers.add("256 > 5 -> 0x4e"), -1);
+    EXPECT_EQ(this->m_triggers.add("1 > 5 -> 0x4e junk"), -1);
+
+    // Removed ids are reused.
+    EXPECT_TRUE(this->m_triggers.remove(1));
+    EXPECT_FALSE(this->m_triggers.remove(1));
+    EXPECT_EQ(this->m_triggers.add("0 == 3 -> 0x4e"), 1);
+}
+
+TEST_F(TriggersTest, FiresWhenTheConditionBecomesTrue) {
+    ASSERT_EQ(this->m_triggers.add("1 > 100 -> 0x4e 0x10"), 0);
+    this->sample(500, 50);
+    EXPECT_EQ(this->bytesWritten(), 0u);
+    this->sample(0, 150);
+    EXPECT_GT(this->bytesWritten(), 0u);
+    this->sample(0, 200);
+    EXPECT_EQ(this->bytesWritten(), 0u);
+    this->sample(0, 50);
+    this->sample(0, 101);
+    EXPECT_GT(this->bytesWritten(), 0u);
+    EXPECT_EQ(this->metrics()["cliserver_trigger_fired_total{rule=\"0\"}"], 2);
+}
+
+TEST_F(TriggersTest, DropsPacketsWhileOffline) {
+    ASSERT_EQ(this->m_triggers.add("0 < 0 -> 0x4e"), 0);
+    this->m_outbox.setOnline(false);
+    this->sample(-1, 0);
+    this->m_outbox.setOnline(true);
+    EXPECT_EQ(this->bytesWritten(), 0u);
+
+    auto values = this->metrics();
+    EXPECT_EQ(values["cliserver_trigger_fired_total{rule=\"0\"}"], 0);
+    EXPECT_EQ(values["cliserver_trigger_dropped_total"], 1);
+}